@@ -0,0 +1,234 @@
+/* cowmail-admission.c
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cowmail-admission.h"
+
+#define COWMAIL_ADMISSION_ADDR_BITS (COWMAIL_ADMISSION_ADDR_SIZE * 8)
+
+
+
+/* a token bucket for an address or a prefix, which is its own key */
+typedef struct
+{
+  guchar   addr[COWMAIL_ADMISSION_ADDR_SIZE];
+  guint    bits;
+  gdouble  tokens;
+  gint64   updated;
+} cowmail_bucket;
+
+
+
+struct _cowmail_admission
+{
+  cowmail_admission_limits  limits;
+  gint                      conns;
+
+  GMutex                    lock;
+  GHashTable               *buckets;
+  gint64                    swept;
+};
+
+
+
+static guint
+cowmail_bucket_hash (gconstpointer key)
+{
+  const cowmail_bucket *b = key;
+  guint hash = b->bits;
+  for (guint i = 0; i < COWMAIL_ADMISSION_ADDR_SIZE; i++)
+    hash = hash * 31 + b->addr[i];
+  return hash;
+}
+
+
+
+static gboolean
+cowmail_bucket_equal (gconstpointer a,
+                      gconstpointer b)
+{
+  const cowmail_bucket *ba = a;
+  const cowmail_bucket *bb = b;
+  return ba->bits == bb->bits && memcmp (ba->addr, bb->addr, COWMAIL_ADMISSION_ADDR_SIZE) == 0;
+}
+
+
+
+cowmail_admission *
+cowmail_admission_new (const cowmail_admission_limits *limits)
+{
+  cowmail_admission *adm = g_new0 (cowmail_admission, 1);
+  adm->limits = *limits;
+  g_mutex_init (&adm->lock);
+  adm->buckets = g_hash_table_new_full (cowmail_bucket_hash, cowmail_bucket_equal, g_free, NULL);
+  return adm;
+}
+
+
+
+void
+cowmail_admission_free (cowmail_admission *adm)
+{
+  g_hash_table_unref (adm->buckets);
+  g_mutex_clear (&adm->lock);
+  g_free (adm);
+}
+
+
+
+gboolean
+cowmail_admission_connect (cowmail_admission *adm)
+{
+  gint n;
+  do {
+    n = g_atomic_int_get (&adm->conns);
+    if (adm->limits.max_conns && (guint) n >= adm->limits.max_conns)
+      return FALSE;
+  } while (!g_atomic_int_compare_and_exchange (&adm->conns, n, n + 1));
+  return TRUE;
+}
+
+
+
+void
+cowmail_admission_disconnect (cowmail_admission *adm)
+{
+  g_atomic_int_add (&adm->conns, -1);
+}
+
+
+
+static gdouble
+cowmail_admission_rate (cowmail_admission *adm,
+                        cowmail_bucket    *b)
+{
+  return b->bits == COWMAIL_ADMISSION_ADDR_BITS ? adm->limits.addr_rate : adm->limits.prefix_rate;
+}
+
+
+
+static void
+cowmail_admission_refill (cowmail_admission *adm,
+                          cowmail_bucket    *b,
+                          gint64             now)
+{
+  gdouble rate = cowmail_admission_rate (adm, b);
+  b->tokens = MIN (rate * COWMAIL_ADMISSION_BURST, b->tokens + rate * (now - b->updated) / G_USEC_PER_SEC);
+  b->updated = now;
+}
+
+
+
+/* drops the buckets that are full again, which is the same as having none, at most once a second */
+static void
+cowmail_admission_sweep (cowmail_admission *adm,
+                         gint64             now)
+{
+  if (now - adm->swept < G_USEC_PER_SEC)
+    return;
+  adm->swept = now;
+
+  GHashTableIter iter;
+  cowmail_bucket *b;
+  g_hash_table_iter_init (&iter, adm->buckets);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &b, NULL)) {
+    cowmail_admission_refill (adm, b, now);
+    if (b->tokens >= cowmail_admission_rate (adm, b) * COWMAIL_ADMISSION_BURST)
+      g_hash_table_iter_remove (&iter);
+  }
+}
+
+
+
+/* returns the refilled bucket of the first bits of addr, or NULL if there is no room for a new one */
+static cowmail_bucket *
+cowmail_admission_bucket (cowmail_admission *adm,
+                          const guchar      *addr,
+                          guint              bits,
+                          gint64             now)
+{
+  cowmail_bucket key = { .bits = bits };
+  memcpy (key.addr, addr, bits / 8);
+  if (bits % 8)
+    key.addr[bits / 8] = addr[bits / 8] & (0xff << (8 - bits % 8));
+
+  cowmail_bucket *b = g_hash_table_lookup (adm->buckets, &key);
+  if (b) {
+    cowmail_admission_refill (adm, b, now);
+    return b;
+  }
+  if (g_hash_table_size (adm->buckets) >= COWMAIL_ADMISSION_MAX_BUCKETS)
+    return NULL;
+
+  /* a new source starts with a full bucket */
+  b = g_new (cowmail_bucket, 1);
+  *b = key;
+  b->updated = now;
+  b->tokens = cowmail_admission_rate (adm, b) * COWMAIL_ADMISSION_BURST;
+  g_hash_table_add (adm->buckets, b);
+  return b;
+}
+
+
+
+/* IPv4 addresses come as ::ffff:a.b.c.d from the dual-stack listeners */
+static guint
+cowmail_admission_prefix (const guchar *addr)
+{
+  static const guchar v4mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+  return memcmp (addr, v4mapped, sizeof (v4mapped)) == 0 ? COWMAIL_ADMISSION_PREFIX_V4 : COWMAIL_ADMISSION_PREFIX_V6;
+}
+
+
+
+gboolean
+cowmail_admission_request (cowmail_admission *adm,
+                           const guchar      *addr,
+                           guint              cost)
+{
+  if (!addr || (!adm->limits.addr_rate && !adm->limits.prefix_rate))
+    return TRUE;
+
+  gint64 now = g_get_monotonic_time ();
+  g_mutex_lock (&adm->lock);
+  if (g_hash_table_size (adm->buckets) >= COWMAIL_ADMISSION_MAX_BUCKETS)
+    cowmail_admission_sweep (adm, now);
+  cowmail_bucket *prefix = adm->limits.prefix_rate ?
+    cowmail_admission_bucket (adm, addr, cowmail_admission_prefix (addr), now) : NULL;
+  cowmail_bucket *source = adm->limits.addr_rate ?
+    cowmail_admission_bucket (adm, addr, COWMAIL_ADMISSION_ADDR_BITS, now) : NULL;
+
+  /*
+   * When the table is full, new addresses are judged by their prefix alone,
+   * and new prefixes are refused until idle buckets can be dropped. A bucket
+   * with a token left admits a request of any cost and goes into debt, so
+   * that large requests are not refused forever.
+   */
+  gboolean ok = TRUE;
+  if (adm->limits.prefix_rate)
+    ok = prefix && prefix->tokens >= 1;
+  if (adm->limits.addr_rate)
+    ok = ok && (source ? source->tokens >= 1 : prefix != NULL);
+  if (ok) {
+    if (prefix)
+      prefix->tokens -= cost;
+    if (source)
+      source->tokens -= cost;
+  }
+  g_mutex_unlock (&adm->lock);
+  return ok;
+}
@@ -0,0 +1,103 @@
+/* cowmail-admission.h
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "libcowmail.h"
+
+/* size of a source address, IPv4 sources are mapped to IPv6 */
+#define COWMAIL_ADMISSION_ADDR_SIZE  16
+/* prefixes that share a bucket: an IPv4 /24, or an IPv6 /48 */
+#define COWMAIL_ADMISSION_PREFIX_V4  120
+#define COWMAIL_ADMISSION_PREFIX_V6  48
+/* a bucket holds this many seconds of its rate */
+#define COWMAIL_ADMISSION_BURST      10
+/* number of buckets kept before full ones are dropped */
+#define COWMAIL_ADMISSION_MAX_BUCKETS 65536
+
+
+
+typedef struct _cowmail_admission cowmail_admission;
+
+typedef struct
+{
+  guint    max_conns;
+  gdouble  addr_rate;
+  gdouble  prefix_rate;
+} cowmail_admission_limits;
+
+
+
+/**
+ * cowmail_admission_new:
+ * @limits: the limits, 0 for no limit on any of them
+ *
+ * Creates the admission control of a server, shared by all its reactors.
+ *
+ * @limits.max_conns caps the concurrent connections. @limits.addr_rate is the
+ * number of requests per second one source address may make, and
+ * @limits.prefix_rate the number that all addresses of one prefix may make
+ * together, so that an attacker with many addresses in one network does not
+ * get a bucket per address. Each bucket holds COWMAIL_ADMISSION_BURST seconds
+ * of its rate, so clients may send bursts after being idle.
+ *
+ * Returns: the admission control
+ */
+cowmail_admission *cowmail_admission_new   (const cowmail_admission_limits *limits);
+
+/**
+ * cowmail_admission_free:
+ * @adm: the admission control
+ */
+void               cowmail_admission_free  (cowmail_admission     *adm);
+
+/**
+ * cowmail_admission_connect:
+ * @adm: the admission control
+ *
+ * Counts a new connection, unless there are already @limits.max_conns.
+ *
+ * Returns: TRUE if the connection is admitted and must be released with
+ * cowmail_admission_disconnect()
+ */
+gboolean           cowmail_admission_connect (cowmail_admission   *adm);
+
+/**
+ * cowmail_admission_disconnect:
+ * @adm: the admission control
+ *
+ * Releases a connection that cowmail_admission_connect() admitted.
+ */
+void               cowmail_admission_disconnect (cowmail_admission *adm);
+
+/**
+ * cowmail_admission_request:
+ * @adm: the admission control
+ * @addr: (nullable): COWMAIL_ADMISSION_ADDR_SIZE bytes of source address, or
+ *   NULL for a local client, which is not limited
+ * @cost: number of requests to take from the buckets
+ *
+ * Takes @cost tokens from the buckets of the address and of its prefix, if
+ * neither is empty. A request that costs more than is left puts the buckets
+ * into debt, so that large requests are delayed rather than refused forever.
+ *
+ * Returns: TRUE if the request is admitted
+ */
+gboolean           cowmail_admission_request (cowmail_admission   *adm,
+                                              const guchar        *addr,
+                                              guint                cost);
@@ -0,0 +1,292 @@
+/* cowmail-bench.c
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libcowmail-private.h"
+#include "cowmail-stamp.h"
+#include <gnutls/crypto.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+/* minimum run time of each benchmark, in microseconds */
+#define COWMAIL_BENCH_TIME   (G_USEC_PER_SEC / 2)
+/* number of distinct heads each head benchmark cycles through */
+#define COWMAIL_BENCH_HEADS  1024
+/* number of heads per scan and the share of them that match */
+#define COWMAIL_BENCH_SCAN   65536
+#define COWMAIL_BENCH_MATCH  100
+/* number of identities in the ids file */
+#define COWMAIL_BENCH_IDS    10000
+
+
+
+/*
+ * Allocation counting: these replace the allocator of the C library for the
+ * whole process, including GLib, and forward to the glibc implementation.
+ */
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t n, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static atomic_ulong cowmail_bench_allocs;
+
+void *
+malloc (size_t size)
+{
+  atomic_fetch_add_explicit (&cowmail_bench_allocs, 1, memory_order_relaxed);
+  return __libc_malloc (size);
+}
+
+
+
+void *
+calloc (size_t n,
+        size_t size)
+{
+  atomic_fetch_add_explicit (&cowmail_bench_allocs, 1, memory_order_relaxed);
+  return __libc_calloc (n, size);
+}
+
+
+
+void *
+realloc (void   *ptr,
+         size_t  size)
+{
+  atomic_fetch_add_explicit (&cowmail_bench_allocs, 1, memory_order_relaxed);
+  return __libc_realloc (ptr, size);
+}
+
+
+
+typedef void (*cowmail_bench_func) (gpointer data);
+
+typedef struct
+{
+  cowmail_id      *id;
+  cowmail_id      *contact;
+  GList           *ids;
+  gchar           *msg;
+  gsize            n;
+  guchar          *heads;
+  gsize            nheads;
+  guint            next;
+  cowmail_ticket  *ticket;
+  guchar          *cryptotext;
+  gsize            len;
+  GFile           *file;
+  guint            bits;
+  guchar           stamp[COWMAIL_STAMP_SIZE];
+} cowmail_bench;
+
+static const gchar *filter = NULL;
+
+
+
+/* runs func for at least COWMAIL_BENCH_TIME and prints the cost per operation */
+static void
+cowmail_bench_run (const gchar        *name,
+                   cowmail_bench_func  func,
+                   cowmail_bench      *bench,
+                   guint64             ops_per_call)
+{
+  if (filter && !strstr (name, filter))
+    return;
+
+  /* warm up caches and the scan thread pool */
+  func (bench);
+
+  guint64 calls = 0;
+  gulong allocs = atomic_load (&cowmail_bench_allocs);
+  gint64 start = g_get_monotonic_time ();
+  gint64 elapsed;
+  do {
+    func (bench);
+    calls++;
+    elapsed = g_get_monotonic_time () - start;
+  } while (elapsed < COWMAIL_BENCH_TIME);
+  allocs = atomic_load (&cowmail_bench_allocs) - allocs;
+
+  gdouble ops = (gdouble) calls * ops_per_call;
+  g_print ("%-28s %14.1f ns/op %14.1f ops/s %10.2f allocs/op\n",
+           name, elapsed * 1000.0 / ops, ops * G_USEC_PER_SEC / elapsed, allocs / ops);
+}
+
+
+
+/*
+ * Generates n heads for the contact of which every match-th one is a real
+ * head and the others are random. A random A is as costly to try as a real
+ * one, since curve25519 accepts any 32 bytes as a point.
+ */
+static guchar *
+cowmail_bench_heads (const cowmail_id *contact,
+                     gsize             n,
+                     gsize             match)
+{
+  guchar *heads = g_malloc (n * COWMAIL_HEAD_SIZE);
+  gnutls_rnd (GNUTLS_RND_NONCE, heads, n * COWMAIL_HEAD_SIZE);
+  for (gsize i = 0; match && i < n; i += match) {
+    gsize len;
+    g_autofree guchar *cryptotext = cowmail_encrypt_msg (contact, "", 1, &len);
+    memcpy (heads + i * COWMAIL_HEAD_SIZE, cryptotext, COWMAIL_HEAD_SIZE);
+  }
+  return heads;
+}
+
+
+
+static void
+bench_encrypt_msg (gpointer data)
+{
+  cowmail_bench *bench = data;
+  gsize len;
+  g_free (cowmail_encrypt_msg (bench->contact, bench->msg, bench->n, &len));
+}
+
+
+
+static void
+bench_decrypt_head (gpointer data)
+{
+  cowmail_bench *bench = data;
+  const guchar *head = bench->heads + bench->next * COWMAIL_HEAD_SIZE;
+  bench->next = (bench->next + 1) % bench->nheads;
+  g_free (cowmail_decrypt_head (bench->id, head));
+}
+
+
+
+static void
+bench_decrypt_msg (gpointer data)
+{
+  cowmail_bench *bench = data;
+  g_free (cowmail_decrypt_msg (bench->ticket, bench->cryptotext + COWMAIL_HEAD_SIZE, bench->len - COWMAIL_HEAD_SIZE));
+}
+
+
+
+static void
+bench_scan_heads (gpointer data)
+{
+  cowmail_bench *bench = data;
+  g_list_free_full (cowmail_scan_heads (bench->ids, bench->heads, bench->nheads), g_free);
+}
+
+
+
+static void
+bench_stamp_solve (gpointer data)
+{
+  cowmail_bench *bench = data;
+  cowmail_stamp_solve (bench->heads, bench->bits, bench->stamp, NULL);
+}
+
+
+
+static void
+bench_stamp_verify (gpointer data)
+{
+  cowmail_bench *bench = data;
+  cowmail_stamp_verify (bench->heads, bench->stamp, bench->bits);
+}
+
+
+
+static void
+bench_ids_load (gpointer data)
+{
+  cowmail_bench *bench = data;
+  g_list_free_full (cowmail_ids_load (bench->file), (GDestroyNotify) cowmail_id_free);
+}
+
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+  if (argc > 1)
+    filter = argv[1];
+
+  cowmail_bench bench = { 0 };
+  bench.id = cowmail_id_generate ("bench");
+  bench.contact = cowmail_id_to_contact (bench.id);
+  bench.ids = g_list_append (NULL, bench.id);
+
+  gsize sizes[] = { 64, 1024, 16 * 1024, 64 * 1024, 1024 * 1024 };
+  for (guint s = 0; s < G_N_ELEMENTS (sizes); s++) {
+    g_autofree gchar *name = g_strdup_printf ("encrypt_msg/%" G_GSIZE_FORMAT, sizes[s]);
+    bench.n = sizes[s];
+    bench.msg = g_malloc0 (bench.n);
+    cowmail_bench_run (name, bench_encrypt_msg, &bench, 1);
+    g_free (bench.msg);
+  }
+
+  bench.nheads = COWMAIL_BENCH_HEADS;
+  bench.heads = cowmail_bench_heads (bench.contact, bench.nheads, 1);
+  cowmail_bench_run ("decrypt_head/match", bench_decrypt_head, &bench, 1);
+  g_free (bench.heads);
+  bench.heads = cowmail_bench_heads (bench.contact, bench.nheads, 0);
+  cowmail_bench_run ("decrypt_head/miss", bench_decrypt_head, &bench, 1);
+  g_free (bench.heads);
+
+  for (guint s = 0; s < G_N_ELEMENTS (sizes); s++) {
+    g_autofree gchar *name = g_strdup_printf ("decrypt_msg/%" G_GSIZE_FORMAT, sizes[s]);
+    g_autofree gchar *msg = g_malloc0 (sizes[s]);
+    bench.cryptotext = cowmail_encrypt_msg (bench.contact, msg, sizes[s], &bench.len);
+    bench.ticket = cowmail_decrypt_head (bench.id, bench.cryptotext);
+    cowmail_bench_run (name, bench_decrypt_msg, &bench, 1);
+    g_free (bench.ticket);
+    g_free (bench.cryptotext);
+  }
+
+  bench.nheads = COWMAIL_BENCH_SCAN;
+  bench.heads = cowmail_bench_heads (bench.contact, bench.nheads, COWMAIL_BENCH_MATCH);
+  cowmail_bench_run ("scan_heads/head", bench_scan_heads, &bench, bench.nheads);
+  g_free (bench.heads);
+
+  /* a fresh random start per solve, so the time is the average over many stamps */
+  bench.heads = cowmail_bench_heads (bench.contact, 1, 1);
+  guint bits[] = { 12, 16, 20 };
+  for (guint b = 0; b < G_N_ELEMENTS (bits); b++) {
+    g_autofree gchar *name = g_strdup_printf ("stamp_solve/%u", bits[b]);
+    bench.bits = bits[b];
+    cowmail_bench_run (name, bench_stamp_solve, &bench, 1);
+  }
+  cowmail_bench_run ("stamp_verify", bench_stamp_verify, &bench, 1);
+  g_free (bench.heads);
+
+  GList *ids = NULL;
+  for (guint i = 0; i < COWMAIL_BENCH_IDS; i++) {
+    g_autofree gchar *name = g_strdup_printf ("id%u", i);
+    ids = g_list_prepend (ids, cowmail_id_generate (name));
+  }
+  g_autofree gchar *path = g_build_filename (g_get_tmp_dir (), "cowmail-bench-ids.conf", NULL);
+  bench.file = g_file_new_for_path (path);
+  cowmail_ids_store (bench.file, ids);
+  g_list_free_full (ids, (GDestroyNotify) cowmail_id_free);
+  cowmail_bench_run ("ids_load/10k", bench_ids_load, &bench, 1);
+  g_file_delete (bench.file, NULL, NULL);
+  g_object_unref (bench.file);
+
+  g_list_free (bench.ids);
+  cowmail_id_free (bench.contact);
+  cowmail_id_free (bench.id);
+  return 0;
+}
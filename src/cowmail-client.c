@@ -0,0 +1,391 @@
+/* cowmail-client.c
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cowmail-client.h"
+#include "cowmail-transport.h"
+#include "cowmail-head-cache.h"
+#include "libcowmail-private.h"
+
+
+
+typedef struct
+{
+  cowmail_session *session;
+  gint64           since;
+} cowmail_client_idle;
+
+
+
+struct _cowmail_client
+{
+  gchar   *server;
+  gchar   *scheme;
+  gchar   *host;
+  guint16  port;
+
+  GMutex   lock;
+  GQueue   idle;
+  GList   *addresses;
+  gint64   expires;
+
+  cowmail_head_cache *cache;
+};
+
+
+
+/* clients shared by the functions that take a server name */
+static GMutex shared_lock;
+static GHashTable *shared = NULL;
+
+
+
+cowmail_client *
+cowmail_client_new (const gchar *server)
+{
+  cowmail_client *client = g_new0 (cowmail_client, 1);
+  client->server = g_strdup (server);
+  g_mutex_init (&client->lock);
+  g_queue_init (&client->idle);
+
+  /* only host names are resolved here, socket paths and literal addresses are used as they are */
+  g_autofree gchar *address = NULL;
+  cowmail_transport transport = cowmail_transport_parse (server, &address);
+  if (transport == COWMAIL_TRANSPORT_UNIX)
+    return client;
+  g_autoptr (GSocketConnectable) connectable = g_network_address_parse (address, COWMAIL_DEFAULT_PORT, NULL);
+  if (!connectable)
+    return client;
+  const gchar *host = g_network_address_get_hostname (G_NETWORK_ADDRESS (connectable));
+  if (g_hostname_is_ip_address (host))
+    return client;
+
+  client->scheme = g_strndup (server, strlen (server) - strlen (address));
+  client->host = g_strdup (host);
+  client->port = g_network_address_get_port (G_NETWORK_ADDRESS (connectable));
+  return client;
+}
+
+
+
+cowmail_client *
+cowmail_client_lookup (const gchar *server)
+{
+  g_mutex_lock (&shared_lock);
+  if (!shared)
+    shared = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) cowmail_client_free);
+  cowmail_client *client = g_hash_table_lookup (shared, server);
+  if (!client) {
+    client = cowmail_client_new (server);
+    g_hash_table_insert (shared, g_strdup (server), client);
+  }
+  g_mutex_unlock (&shared_lock);
+  return client;
+}
+
+
+
+void
+cowmail_client_free (cowmail_client *client)
+{
+  cowmail_client_idle *idle;
+  while ((idle = g_queue_pop_head (&client->idle))) {
+    cowmail_session_close (idle->session);
+    g_free (idle);
+  }
+  g_list_free_full (client->addresses, g_object_unref);
+  if (client->cache)
+    cowmail_head_cache_close (client->cache);
+  g_mutex_clear (&client->lock);
+  g_free (client->server);
+  g_free (client->scheme);
+  g_free (client->host);
+  g_free (client);
+}
+
+
+
+const gchar *
+cowmail_client_get_server (cowmail_client *client)
+{
+  return client->server;
+}
+
+
+
+static GList *
+cowmail_client_copy_addresses (GList *addresses)
+{
+  GList *copy = NULL;
+  for (GList *a = addresses; a; a = a->next)
+    copy = g_list_prepend (copy, g_object_ref (a->data));
+  return g_list_reverse (copy);
+}
+
+
+
+gboolean
+cowmail_client_open_head_cache (cowmail_client  *client,
+                                GError         **error)
+{
+  g_autofree gchar *filename = cowmail_head_cache_filename (client->server);
+  g_mutex_lock (&client->lock);
+  if (!client->cache)
+    client->cache = cowmail_head_cache_open (filename, error);
+  gboolean ok = client->cache != NULL;
+  g_mutex_unlock (&client->lock);
+  return ok;
+}
+
+
+
+/* returns the cached addresses of the server, resolving them when they expired */
+static GList *
+cowmail_client_resolve (cowmail_client  *client,
+                        GCancellable    *cancellable,
+                        GError         **error)
+{
+  gint64 now = g_get_monotonic_time ();
+  g_mutex_lock (&client->lock);
+  GList *addresses = now < client->expires ? cowmail_client_copy_addresses (client->addresses) : NULL;
+  g_mutex_unlock (&client->lock);
+  if (addresses)
+    return addresses;
+
+  /* without the lock, so that a slow lookup does not hold up requests on pooled sessions */
+  g_autoptr (GResolver) resolver = g_resolver_get_default ();
+  addresses = g_resolver_lookup_by_name (resolver, client->host, cancellable, error);
+  if (!addresses)
+    return NULL;
+
+  g_mutex_lock (&client->lock);
+  g_list_free_full (client->addresses, g_object_unref);
+  client->addresses = cowmail_client_copy_addresses (addresses);
+  client->expires = now + COWMAIL_CLIENT_DNS_TTL * G_USEC_PER_SEC;
+  g_mutex_unlock (&client->lock);
+  return addresses;
+}
+
+
+
+/* connects to each resolved address in turn, like GSocketClient does for a host name */
+static cowmail_session *
+cowmail_client_connect (cowmail_client  *client,
+                        GCancellable    *cancellable,
+                        GError         **error)
+{
+  if (!client->host)
+    return cowmail_session_connect (client->server, cancellable, error);
+
+  GList *addresses = cowmail_client_resolve (client, cancellable, error);
+  if (!addresses)
+    return NULL;
+
+  cowmail_session *session = NULL;
+  g_autoptr (GError) lerror = NULL;
+  for (GList *a = addresses; a && !session; a = a->next) {
+    g_autofree gchar *ip = g_inet_address_to_string (a->data);
+    gboolean ipv6 = g_inet_address_get_family (a->data) == G_SOCKET_FAMILY_IPV6;
+    g_autofree gchar *uri = g_strdup_printf (ipv6 ? "%s[%s]:%u" : "%s%s:%u", client->scheme, ip, client->port);
+
+    g_clear_error (&lerror);
+    session = cowmail_session_connect (uri, cancellable, &lerror);
+    if (g_error_matches (lerror, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      break;
+  }
+  g_list_free_full (addresses, g_object_unref);
+
+  if (!session) {
+    /* the server may have moved, so look it up again next time */
+    g_mutex_lock (&client->lock);
+    client->expires = 0;
+    g_mutex_unlock (&client->lock);
+    g_propagate_error (error, g_steal_pointer (&lerror));
+  }
+  return session;
+}
+
+
+
+/* takes an idle session that the server has not closed, or connects a new one */
+static cowmail_session *
+cowmail_client_acquire (cowmail_client  *client,
+                        GCancellable    *cancellable,
+                        GError         **error)
+{
+  gint64 now = g_get_monotonic_time ();
+  cowmail_session *session = NULL;
+
+  g_mutex_lock (&client->lock);
+  cowmail_client_idle *idle;
+  while (!session && (idle = g_queue_pop_head (&client->idle))) {
+    if (now - idle->since < COWMAIL_CLIENT_IDLE_TIMEOUT * G_USEC_PER_SEC && cowmail_session_is_idle (idle->session))
+      session = idle->session;
+    else
+      cowmail_session_close (idle->session);
+    g_free (idle);
+  }
+  g_mutex_unlock (&client->lock);
+
+  if (session) {
+    cowmail_session_set_cancellable (session, cancellable);
+    return session;
+  }
+  GError *lerror = NULL;
+  session = cowmail_client_connect (client, cancellable, &lerror);
+  if (!session) {
+    if (!g_error_matches (lerror, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      g_printerr ("COWMAIL ERROR SESSION: %s\n", lerror->message);
+    g_propagate_error (error, lerror);
+  }
+  return session;
+}
+
+
+
+/* returns the session to the pool, or closes it after an error; returns FALSE with the error of the request */
+static gboolean
+cowmail_client_release (cowmail_client   *client,
+                        cowmail_session  *session,
+                        GError          **error)
+{
+  GError *serror = cowmail_session_take_error (session);
+  if (serror) {
+    cowmail_session_close (session);
+    g_propagate_error (error, serror);
+    return FALSE;
+  }
+
+  cowmail_session_set_cancellable (session, NULL);
+  g_mutex_lock (&client->lock);
+  if (g_queue_get_length (&client->idle) < COWMAIL_CLIENT_POOL_SIZE) {
+    cowmail_client_idle *idle = g_new (cowmail_client_idle, 1);
+    idle->session = session;
+    idle->since = g_get_monotonic_time ();
+    /* most recently used first, so that the oldest sessions time out */
+    g_queue_push_head (&client->idle, idle);
+    session = NULL;
+  }
+  g_mutex_unlock (&client->lock);
+  if (session)
+    cowmail_session_close (session);
+  return TRUE;
+}
+
+
+
+gsize
+cowmail_client_put_many (cowmail_client  *client,
+                         GBytes         **msgs,
+                         gsize            n,
+                         guchar          *status,
+                         GCancellable    *cancellable,
+                         GError         **error)
+{
+  cowmail_session *session = cowmail_client_acquire (client, cancellable, error);
+  if (!session) {
+    for (gsize i = 0; i < n; i++)
+      status[i] = COWMAIL_STATUS_SERVER_ERROR;
+    return 0;
+  }
+  gsize nacked = cowmail_session_put_many (session, msgs, n, status);
+  cowmail_client_release (client, session, error);
+  return nacked;
+}
+
+
+
+gboolean
+cowmail_client_put (cowmail_client    *client,
+                    const gchar       *msg,
+                    const cowmail_id  *id,
+                    GCancellable      *cancellable,
+                    GError           **error)
+{
+  g_autoptr (GBytes) cmsg = cowmail_msg_encrypt (msg, id);
+  guchar status;
+  if (!cowmail_client_put_many (client, &cmsg, 1, &status, cancellable, error) && error && !*error)
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "%s", status == COWMAIL_STATUS_SENT ?
+                 cowmail_status_message (status) : "The server did not store the message");
+  return status == COWMAIL_STATUS_OK;
+}
+
+
+
+gsize
+cowmail_client_list (cowmail_client       *client,
+                     GList                *ids,
+                     guint64               cursor,
+                     guint32               limit,
+                     guint64              *next,
+                     cowmail_ticket_func   func,
+                     gpointer              userdata,
+                     GCancellable         *cancellable,
+                     GError              **error)
+{
+  g_mutex_lock (&client->lock);
+  cowmail_head_cache *cache = client->cache;
+  g_mutex_unlock (&client->lock);
+
+  /* the heads that are cached need no request */
+  gsize n = cache ? cowmail_head_cache_scan (cache, ids, cursor, limit, func, userdata) : 0;
+  *next = cursor + n;
+  if (limit && n == limit)
+    return n;
+
+  cowmail_session *session = cowmail_client_acquire (client, cancellable, error);
+  if (!session)
+    return n;
+  n += cowmail_session_list_cached (session, ids, cursor + n, limit ? limit - n : 0, next, cache, func, userdata);
+  cowmail_client_release (client, session, error);
+  return n;
+}
+
+
+
+gsize
+cowmail_client_get_many (cowmail_client    *client,
+                         GList             *tickets,
+                         cowmail_msg_func   func,
+                         gpointer           userdata,
+                         GCancellable      *cancellable,
+                         GError           **error)
+{
+  cowmail_session *session = cowmail_client_acquire (client, cancellable, error);
+  if (!session)
+    return 0;
+  gsize received = cowmail_session_get_many (session, tickets, func, userdata);
+  cowmail_client_release (client, session, error);
+  return received;
+}
+
+
+
+gchar *
+cowmail_client_get (cowmail_client  *client,
+                    cowmail_ticket  *ticket,
+                    GCancellable    *cancellable,
+                    GError         **error)
+{
+  cowmail_session *session = cowmail_client_acquire (client, cancellable, error);
+  if (!session)
+    return NULL;
+  gchar *msg = cowmail_session_get (session, ticket);
+  if (cowmail_client_release (client, session, error) && !msg)
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "No such message");
+  return msg;
+}
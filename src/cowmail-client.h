@@ -0,0 +1,195 @@
+/* cowmail-client.h
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "libcowmail.h"
+
+/* idle sessions a client keeps open to its server */
+#define COWMAIL_CLIENT_POOL_SIZE 4
+/* seconds an idle session stays in the pool */
+#define COWMAIL_CLIENT_IDLE_TIMEOUT 60
+/* seconds the resolved addresses of the server are used before resolving again */
+#define COWMAIL_CLIENT_DNS_TTL 300
+
+
+
+/*
+ * A client for one server. It resolves the host name once per
+ * COWMAIL_CLIENT_DNS_TTL and keeps up to COWMAIL_CLIENT_POOL_SIZE sessions
+ * open between requests, so that repeated requests skip the lookup, the
+ * connection setup and the HELLO handshake. All functions are safe to call
+ * from any number of threads at once; each request takes a session of its
+ * own from the pool.
+ *
+ * A session whose request failed is closed instead of returned to the pool.
+ * Requests are not retried, because a PUT that failed after it was sent may
+ * have been stored.
+ */
+typedef struct _cowmail_client cowmail_client;
+
+
+
+/**
+ * cowmail_client_new:
+ * @server: the server, in any form that cowmail_transport_connect() accepts
+ *
+ * Creates a client without connecting.
+ *
+ * Returns: the client
+ */
+cowmail_client    *cowmail_client_new      (const gchar           *server);
+
+/**
+ * cowmail_client_lookup:
+ * @server: the server
+ *
+ * Returns: (transfer none): the client that the functions of libcowmail taking
+ * a server name share for @server, valid until the process exits
+ */
+cowmail_client    *cowmail_client_lookup   (const gchar           *server);
+
+/**
+ * cowmail_client_free:
+ * @client: the client
+ *
+ * Closes the idle sessions and frees the client. No request may be running.
+ */
+void               cowmail_client_free     (cowmail_client        *client);
+
+/**
+ * cowmail_client_get_server:
+ * @client: the client
+ *
+ * Returns: the server of @client
+ */
+const gchar       *cowmail_client_get_server (cowmail_client      *client);
+
+/**
+ * cowmail_client_open_head_cache:
+ * @client: the client
+ * @error: return location for an error
+ *
+ * Keeps the heads that cowmail_client_list() receives in the file that
+ * cowmail_head_cache_filename() names for the server. Later lists take the
+ * heads the cache holds from the file and ask the server only for newer ones,
+ * so identities added later are scanned against the cached heads without the
+ * network. The cache is emptied when the server reports fewer messages than
+ * it holds.
+ *
+ * Returns: TRUE if the cache is open
+ */
+gboolean           cowmail_client_open_head_cache (cowmail_client *client,
+                                                   GError        **error);
+
+/**
+ * cowmail_client_put_many:
+ * @client: the client
+ * @msgs: messages from cowmail_msg_encrypt()
+ * @n: number of messages
+ * @status: return location for @n statuses
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for an error
+ *
+ * Like cowmail_session_put_many(), over a pooled session.
+ *
+ * Returns: the number of acknowledged messages
+ */
+gsize              cowmail_client_put_many (cowmail_client        *client,
+                                            GBytes               **msgs,
+                                            gsize                  n,
+                                            guchar                *status,
+                                            GCancellable          *cancellable,
+                                            GError               **error);
+
+/**
+ * cowmail_client_put:
+ * @client: the client
+ * @msg: the message to be put
+ * @id: the recipient's cowmail identity
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for an error
+ *
+ * Returns: TRUE if the server stored the message
+ */
+gboolean           cowmail_client_put      (cowmail_client        *client,
+                                            const gchar           *msg,
+                                            const cowmail_id      *id,
+                                            GCancellable          *cancellable,
+                                            GError               **error);
+
+/**
+ * cowmail_client_list:
+ * @client: the client
+ * @ids: identities to get messages for
+ * @cursor: sequence number of the first header to get
+ * @limit: maximum number of headers to get, 0 for no limit
+ * @next: return location for the cursor to continue with
+ * @func: called for every header that belongs to one of the identities
+ * @userdata: user data for @func
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for an error
+ *
+ * Like cowmail_session_list(), over a pooled session, or from the head cache
+ * as far as it reaches.
+ *
+ * Returns: the number of headers scanned
+ */
+gsize              cowmail_client_list     (cowmail_client        *client,
+                                            GList                 *ids,
+                                            guint64                cursor,
+                                            guint32                limit,
+                                            guint64               *next,
+                                            cowmail_ticket_func    func,
+                                            gpointer               userdata,
+                                            GCancellable          *cancellable,
+                                            GError               **error);
+
+/**
+ * cowmail_client_get_many:
+ * @client: the client
+ * @tickets: the headers for the messages
+ * @func: called for every message, in the order of @tickets
+ * @userdata: user data for @func
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for an error
+ *
+ * Like cowmail_session_get_many(), over a pooled session.
+ *
+ * Returns: the number of messages received
+ */
+gsize              cowmail_client_get_many (cowmail_client        *client,
+                                            GList                 *tickets,
+                                            cowmail_msg_func       func,
+                                            gpointer               userdata,
+                                            GCancellable          *cancellable,
+                                            GError               **error);
+
+/**
+ * cowmail_client_get:
+ * @client: the client
+ * @ticket: the header for the message
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for an error
+ *
+ * Returns: the decrypted message, or NULL with @error set
+ */
+gchar             *cowmail_client_get      (cowmail_client        *client,
+                                            cowmail_ticket        *ticket,
+                                            GCancellable          *cancellable,
+                                            GError               **error);
@@ -26,6 +26,7 @@ struct _CowmailContactRow
 
   GtkLabel      *name;
   guchar         pkey[COWMAIL_KEY_SIZE];
+  guint32        features;
 };
 
 G_DEFINE_TYPE (CowmailContactRow, cowmail_contact_row, GTK_TYPE_LIST_BOX_ROW)
@@ -40,6 +41,7 @@ cowmail_contact_row_new (cowmail_id *contact)
   if (contact) {
     gtk_label_set_text (self->name, contact->name);
     memcpy (self->pkey, contact->key, COWMAIL_KEY_SIZE);
+    self->features = contact->features;
   } else {
     memset (self->pkey, 0, COWMAIL_KEY_SIZE);
   }
@@ -83,6 +85,23 @@ cowmail_contact_row_set_pkey (CowmailContactRow *self,
 
 
 
+guint32
+cowmail_contact_row_get_features (CowmailContactRow *self)
+{
+  return self->features;
+}
+
+
+
+void
+cowmail_contact_row_set_features (CowmailContactRow *self,
+                                  guint32            features)
+{
+  self->features = features;
+}
+
+
+
 static void
 cowmail_contact_row_finalize (GObject *object)
 {
@@ -80,4 +80,20 @@ const guchar      *cowmail_contact_row_get_pkey  (CowmailContactRow *self);
 void               cowmail_contact_row_set_pkey  (CowmailContactRow *self,
                                                   const guchar      *pkey);
 
+/**
+ * cowmail_contact_row_get_features:
+ * @self: the contact row
+ *
+ * Returns: the COWMAIL_MSG_FEATURES the contact can read
+ */
+guint32            cowmail_contact_row_get_features (CowmailContactRow *self);
+
+/**
+ * cowmail_contact_row_set_features:
+ * @self: the contact row
+ * @features: the COWMAIL_MSG_FEATURES the contact can read
+ */
+void               cowmail_contact_row_set_features (CowmailContactRow *self,
+                                                     guint32            features);
+
 G_END_DECLS
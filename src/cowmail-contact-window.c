@@ -36,6 +36,19 @@ G_DEFINE_TYPE (CowmailContactWindow, cowmail_contact_window, GTK_TYPE_WINDOW)
 
 
 
+/* shows the key of the contact with its message features */
+static void
+cowmail_contact_window_show_key (CowmailContactWindow *self,
+                                 CowmailContactRow    *row)
+{
+  cowmail_id contact = { .features = cowmail_contact_row_get_features (row) };
+  memcpy (contact.key, cowmail_contact_row_get_pkey (row), COWMAIL_KEY_SIZE);
+  g_autofree gchar *key = cowmail_id_key_to_string (&contact);
+  gtk_entry_set_text (self->en_pkey, key);
+}
+
+
+
 CowmailContactWindow *
 cowmail_contact_window_new (GList **contacts)
 {
@@ -49,8 +62,7 @@ cowmail_contact_window_new (GList **contacts)
   CowmailContactRow *row = COWMAIL_CONTACT_ROW (gtk_list_box_get_row_at_index (self->lb_contacts, 0));
   gtk_list_box_select_row (self->lb_contacts, GTK_LIST_BOX_ROW (row));
   gtk_entry_set_text (self->en_name, cowmail_contact_row_get_name (row));
-  g_autofree gchar *b64pkey = g_base64_encode (cowmail_contact_row_get_pkey (row), COWMAIL_KEY_SIZE);
-  gtk_entry_set_text (self->en_pkey, b64pkey);
+  cowmail_contact_window_show_key (self, row);
 
   return self;
 }
@@ -69,6 +81,7 @@ on_bn_save_clicked (GtkButton            *self,
     CowmailContactRow *row = c->data;
     cowmail_id *id = cowmail_id_from_key (cowmail_contact_row_get_name (row),
                                           cowmail_contact_row_get_pkey (row));
+    id->features = cowmail_contact_row_get_features (row);
     c->data = id;
   }
 
@@ -108,8 +121,7 @@ on_lb_contacts_row_activated (GtkListBox           *self,
   COWMAIL_IS_CONTACT_WINDOW (window);
 
   gtk_entry_set_text (window->en_name, cowmail_contact_row_get_name (row));
-  g_autofree gchar *b64pkey = g_base64_encode (cowmail_contact_row_get_pkey (row), COWMAIL_KEY_SIZE);
-  gtk_entry_set_text (window->en_pkey, b64pkey);
+  cowmail_contact_window_show_key (window, row);
 }
 
 
@@ -134,12 +146,13 @@ on_en_pkey_changed (GtkEntry             *self,
   GTK_IS_ENTRY (self);
   COWMAIL_IS_CONTACT_WINDOW (window);
 
-  gsize plen;
-  g_autofree guchar *pkey = g_base64_decode (gtk_entry_get_text (self), &plen);
+  guchar pkey[COWMAIL_KEY_SIZE];
+  guint32 features;
 
-  if (plen == COWMAIL_KEY_SIZE) {
+  if (cowmail_id_key_from_string (gtk_entry_get_text (self), pkey, &features)) {
     GtkListBoxRow *row = gtk_list_box_get_selected_row (window->lb_contacts);
     cowmail_contact_row_set_pkey (COWMAIL_CONTACT_ROW (row), pkey);
+    cowmail_contact_row_set_features (COWMAIL_CONTACT_ROW (row), features);
     gtk_info_bar_set_revealed (window->ib_warning, FALSE);
   } else {
     gtk_info_bar_set_revealed (window->ib_warning, TRUE);
@@ -0,0 +1,284 @@
+/* cowmail-head-cache.c
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cowmail-head-cache.h"
+#include "libcowmail-private.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define COWMAIL_HEAD_CACHE_MAGIC "COWHDC1"
+
+
+
+/* file header, integers in little endian */
+typedef struct
+{
+  gchar    magic[8];
+  guint64  base;
+  guint64  count;
+  guchar   reserved[40];
+} cowmail_head_cache_header;
+
+G_STATIC_ASSERT (sizeof (cowmail_head_cache_header) == COWMAIL_HEAD_CACHE_HEADER_SIZE);
+
+
+
+struct _cowmail_head_cache
+{
+  gchar   *filename;
+  GRWLock  lock;
+  gint     fd;
+  guchar  *map;
+  gsize    size;
+  guint64  capacity;
+  guint64  base;
+  guint64  count;
+};
+
+
+
+static gboolean
+cowmail_head_cache_map (cowmail_head_cache  *cache,
+                        gsize                size,
+                        GError             **error)
+{
+  if (cache->map)
+    munmap (cache->map, cache->size);
+  cache->map = NULL;
+  if (ftruncate (cache->fd, size) < 0 ||
+      (cache->map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0)) == MAP_FAILED) {
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno), "%s: %s", cache->filename, g_strerror (errno));
+    cache->map = NULL;
+    return FALSE;
+  }
+  cache->size = size;
+  cache->capacity = (size - COWMAIL_HEAD_CACHE_HEADER_SIZE) / COWMAIL_HEAD_SIZE;
+  return TRUE;
+}
+
+
+
+/* empties the cache, keeping the file mapped */
+static gboolean
+cowmail_head_cache_init (cowmail_head_cache  *cache,
+                         GError             **error)
+{
+  if (!cowmail_head_cache_map (cache, COWMAIL_HEAD_CACHE_HEADER_SIZE +
+                                      COWMAIL_HEAD_CACHE_MIN_CAPACITY * COWMAIL_HEAD_SIZE, error))
+    return FALSE;
+  cowmail_head_cache_header *header = (cowmail_head_cache_header *) cache->map;
+  memset (header, 0, sizeof (*header));
+  memcpy (header->magic, COWMAIL_HEAD_CACHE_MAGIC, sizeof (header->magic));
+  cache->base = 0;
+  cache->count = 0;
+  return TRUE;
+}
+
+
+
+cowmail_head_cache *
+cowmail_head_cache_open (const gchar  *filename,
+                         GError      **error)
+{
+  g_autofree gchar *dir = g_path_get_dirname (filename);
+  g_mkdir_with_parents (dir, 0700);
+
+  gint fd = open (filename, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  struct stat st;
+  if (fd < 0 || fstat (fd, &st) < 0) {
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno), "%s: %s", filename, g_strerror (errno));
+    if (fd >= 0)
+      close (fd);
+    return NULL;
+  }
+
+  cowmail_head_cache *cache = g_new0 (cowmail_head_cache, 1);
+  cache->filename = g_strdup (filename);
+  cache->fd = fd;
+  g_rw_lock_init (&cache->lock);
+
+  gboolean ok = FALSE;
+  if (st.st_size >= COWMAIL_HEAD_CACHE_HEADER_SIZE + COWMAIL_HEAD_SIZE &&
+      cowmail_head_cache_map (cache, st.st_size, NULL)) {
+    cowmail_head_cache_header *header = (cowmail_head_cache_header *) cache->map;
+    cache->base = GUINT64_FROM_LE (header->base);
+    cache->count = GUINT64_FROM_LE (header->count);
+    ok = memcmp (header->magic, COWMAIL_HEAD_CACHE_MAGIC, sizeof (header->magic)) == 0 &&
+         cache->count <= MIN (cache->capacity, COWMAIL_HEAD_CACHE_MAX_CAPACITY);
+  }
+  if (!ok && !cowmail_head_cache_init (cache, error)) {
+    cowmail_head_cache_close (cache);
+    return NULL;
+  }
+  return cache;
+}
+
+
+
+void
+cowmail_head_cache_close (cowmail_head_cache *cache)
+{
+  if (cache->map) {
+    msync (cache->map, cache->size, MS_SYNC);
+    munmap (cache->map, cache->size);
+  }
+  close (cache->fd);
+  g_rw_lock_clear (&cache->lock);
+  g_free (cache->filename);
+  g_free (cache);
+}
+
+
+
+gchar *
+cowmail_head_cache_filename (const gchar *server)
+{
+  g_autofree gchar *name = g_uri_escape_string (server, NULL, FALSE);
+  return g_build_filename (g_get_user_cache_dir (), "cowmail", "heads", name, NULL);
+}
+
+
+
+guint64
+cowmail_head_cache_get_watermark (cowmail_head_cache *cache,
+                                  guint64            *base)
+{
+  g_rw_lock_reader_lock (&cache->lock);
+  guint64 watermark = cache->base + cache->count;
+  if (base)
+    *base = cache->base;
+  g_rw_lock_reader_unlock (&cache->lock);
+  return watermark;
+}
+
+
+
+gboolean
+cowmail_head_cache_reset (cowmail_head_cache  *cache,
+                          GError             **error)
+{
+  g_rw_lock_writer_lock (&cache->lock);
+  gboolean ok = cowmail_head_cache_init (cache, error);
+  g_rw_lock_writer_unlock (&cache->lock);
+  return ok;
+}
+
+
+
+/* drops the oldest heads to make room for m more, at least half of them so that few appends move the rest */
+static void
+cowmail_head_cache_drop (cowmail_head_cache *cache,
+                         gsize               m)
+{
+  if (cache->count + m <= COWMAIL_HEAD_CACHE_MAX_CAPACITY)
+    return;
+  guint64 drop = MIN (cache->count, MAX (cache->count + m - COWMAIL_HEAD_CACHE_MAX_CAPACITY, cache->count / 2));
+  guchar *heads = cache->map + COWMAIL_HEAD_CACHE_HEADER_SIZE;
+  memmove (heads, heads + drop * COWMAIL_HEAD_SIZE, (cache->count - drop) * COWMAIL_HEAD_SIZE);
+  cache->base += drop;
+  cache->count -= drop;
+}
+
+
+
+gboolean
+cowmail_head_cache_append (cowmail_head_cache  *cache,
+                           guint64              cursor,
+                           const guchar        *heads,
+                           gsize                n,
+                           GError             **error)
+{
+  gboolean ok = TRUE;
+  g_rw_lock_writer_lock (&cache->lock);
+
+  /* an empty cache starts wherever the first response starts */
+  if (cache->count == 0)
+    cache->base = cursor;
+  guint64 watermark = cache->base + cache->count;
+  if (cache->map && cursor <= watermark && cursor + n > watermark) {
+    gsize skip = watermark - cursor;
+    gsize m = n - skip;
+    cowmail_head_cache_drop (cache, m);
+    /* a response larger than the whole cache only leaves its last heads */
+    if (m > COWMAIL_HEAD_CACHE_MAX_CAPACITY) {
+      skip += m - COWMAIL_HEAD_CACHE_MAX_CAPACITY;
+      cache->base += m - COWMAIL_HEAD_CACHE_MAX_CAPACITY;
+      m = COWMAIL_HEAD_CACHE_MAX_CAPACITY;
+    }
+    guint64 capacity = cache->capacity;
+    while (cache->count + m > capacity)
+      capacity *= 2;
+    capacity = MIN (capacity, COWMAIL_HEAD_CACHE_MAX_CAPACITY);
+    if (capacity > cache->capacity)
+      ok = cowmail_head_cache_map (cache, COWMAIL_HEAD_CACHE_HEADER_SIZE + capacity * COWMAIL_HEAD_SIZE, error);
+
+    if (ok) {
+      memcpy (cache->map + COWMAIL_HEAD_CACHE_HEADER_SIZE + cache->count * COWMAIL_HEAD_SIZE,
+              heads + skip * COWMAIL_HEAD_SIZE, m * COWMAIL_HEAD_SIZE);
+      cache->count += m;
+      cowmail_head_cache_header *header = (cowmail_head_cache_header *) cache->map;
+      header->base = GUINT64_TO_LE (cache->base);
+      header->count = GUINT64_TO_LE (cache->count);
+    }
+  }
+
+  g_rw_lock_writer_unlock (&cache->lock);
+  return ok;
+}
+
+
+
+gsize
+cowmail_head_cache_scan (cowmail_head_cache  *cache,
+                         GList               *ids,
+                         guint64              cursor,
+                         guint64              limit,
+                         cowmail_ticket_func  func,
+                         gpointer             userdata)
+{
+  gsize total = 0;
+  if (limit == 0)
+    limit = G_MAXUINT64;
+
+  /* one batch per lock, so that appends are not held up by a long scan */
+  while (total < limit) {
+    g_rw_lock_reader_lock (&cache->lock);
+    guint64 watermark = cache->base + cache->count;
+    if (!cache->map || cursor < cache->base || cursor >= watermark) {
+      g_rw_lock_reader_unlock (&cache->lock);
+      break;
+    }
+    gsize n = MIN (MIN (watermark - cursor, limit - total), COWMAIL_SCAN_BATCH);
+    const guchar *heads = cache->map + COWMAIL_HEAD_CACHE_HEADER_SIZE + (cursor - cache->base) * COWMAIL_HEAD_SIZE;
+    GList *tickets = g_list_reverse (cowmail_scan_heads (ids, heads, n));
+    g_rw_lock_reader_unlock (&cache->lock);
+
+    for (GList *t = tickets; t; t = t->next) {
+      ((cowmail_ticket *) t->data)->seq += cursor;
+      func (t->data, userdata);
+    }
+    g_list_free (tickets);
+    total += n;
+    cursor += n;
+  }
+  return total;
+}
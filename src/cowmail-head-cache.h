@@ -0,0 +1,135 @@
+/* cowmail-head-cache.h
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "libcowmail.h"
+
+/* size of the file header */
+#define COWMAIL_HEAD_CACHE_HEADER_SIZE 64
+/* number of heads a new cache file has room for before it grows */
+#define COWMAIL_HEAD_CACHE_MIN_CAPACITY 4096
+/* number of heads a cache file holds at most, 80 MiB */
+#define COWMAIL_HEAD_CACHE_MAX_CAPACITY (1 << 20)
+
+
+
+typedef struct _cowmail_head_cache cowmail_head_cache;
+
+
+
+/**
+ * cowmail_head_cache_open:
+ * @filename: file of the cache
+ * @error: return location for an error
+ *
+ * Maps the local copy of the heads of one server. It holds the heads from the
+ * sequence number where caching started, the base, up to the watermark, with
+ * no gaps. LIST responses are appended as they are scanned, so identities
+ * added later can be scanned against all cached heads without the network.
+ * A damaged file is opened empty. Once the cache holds
+ * COWMAIL_HEAD_CACHE_MAX_CAPACITY heads, the oldest ones are dropped and the
+ * base moves up.
+ *
+ * The cache is safe to use from several threads.
+ *
+ * Returns: the cache, or NULL on error
+ */
+cowmail_head_cache *cowmail_head_cache_open (const gchar          *filename,
+                                             GError              **error);
+
+/**
+ * cowmail_head_cache_close:
+ * @cache: the cache
+ *
+ * Writes the cache to disk and frees it.
+ */
+void               cowmail_head_cache_close (cowmail_head_cache   *cache);
+
+/**
+ * cowmail_head_cache_filename:
+ * @server: the server
+ *
+ * Returns: the file in the user cache directory for the heads of @server
+ */
+gchar             *cowmail_head_cache_filename (const gchar       *server);
+
+/**
+ * cowmail_head_cache_get_watermark:
+ * @cache: the cache
+ * @base: (nullable): return location for the sequence number of the first
+ *   cached head
+ *
+ * Returns: the sequence number after the last cached head
+ */
+guint64            cowmail_head_cache_get_watermark (cowmail_head_cache *cache,
+                                                     guint64            *base);
+
+/**
+ * cowmail_head_cache_reset:
+ * @cache: the cache
+ * @error: return location for an error
+ *
+ * Empties the cache, for a server that has fewer messages than the watermark
+ * and so must have lost the heads that are cached.
+ *
+ * Returns: TRUE on success
+ */
+gboolean           cowmail_head_cache_reset (cowmail_head_cache   *cache,
+                                             GError              **error);
+
+/**
+ * cowmail_head_cache_append:
+ * @cache: the cache
+ * @cursor: sequence number of the first of @heads
+ * @heads: consecutive heads as the server sent them
+ * @n: number of heads
+ * @error: return location for an error
+ *
+ * Appends the heads beyond the watermark. Heads that are already cached are
+ * skipped, and heads after a gap are not cached at all.
+ *
+ * Returns: TRUE on success
+ */
+gboolean           cowmail_head_cache_append (cowmail_head_cache  *cache,
+                                              guint64              cursor,
+                                              const guchar        *heads,
+                                              gsize                n,
+                                              GError             **error);
+
+/**
+ * cowmail_head_cache_scan:
+ * @cache: the cache
+ * @ids: identities to try
+ * @cursor: sequence number of the first head to scan
+ * @limit: maximum number of heads to scan, 0 for no limit
+ * @func: called for every head that belongs to one of the identities
+ * @userdata: user data for @func
+ *
+ * Scans the cached heads from @cursor like a LIST response, in batches of
+ * COWMAIL_SCAN_BATCH on all processors. Nothing is scanned if @cursor is not
+ * in the cache.
+ *
+ * Returns: the number of heads scanned
+ */
+gsize              cowmail_head_cache_scan (cowmail_head_cache    *cache,
+                                            GList                 *ids,
+                                            guint64                cursor,
+                                            guint64                limit,
+                                            cowmail_ticket_func    func,
+                                            gpointer               userdata);
@@ -0,0 +1,376 @@
+/* cowmail-index.c
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cowmail-index.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define COWMAIL_INDEX_MAGIC "COWIDX1"
+
+
+
+/* file header, integers in little endian */
+typedef struct
+{
+  gchar    magic[8];
+  guint64  capacity;
+  guint64  used;
+  guint64  records;
+  guint32  clean;
+  guchar   reserved[28];
+} cowmail_index_header;
+
+G_STATIC_ASSERT (sizeof (cowmail_index_header) == COWMAIL_INDEX_HEADER_SIZE);
+G_STATIC_ASSERT (sizeof (cowmail_index_entry) == COWMAIL_INDEX_SLOT_SIZE);
+
+
+
+struct _cowmail_index
+{
+  gchar    *filename;
+  gint      fd;
+  guchar   *map;
+  gsize     size;
+  guint64   capacity;
+  guint64   used;
+  guint64   records;
+  gboolean  broken;
+  /* the table before it grew, while its slots are moved over */
+  cowmail_index *old;
+  guint64   moved;
+};
+
+
+
+static cowmail_index_entry *
+cowmail_index_slot (cowmail_index *index,
+                    guint64        i)
+{
+  return (cowmail_index_entry *) (index->map + COWMAIL_INDEX_HEADER_SIZE + i * COWMAIL_INDEX_SLOT_SIZE);
+}
+
+
+
+static guint64
+cowmail_index_bucket (cowmail_index *index,
+                      const guchar  *hash)
+{
+  guint64 prefix;
+  memcpy (&prefix, hash, sizeof (prefix));
+  return GUINT64_FROM_LE (prefix) & (index->capacity - 1);
+}
+
+
+
+static void
+cowmail_index_unmap (cowmail_index *index)
+{
+  if (index->map)
+    munmap (index->map, index->size);
+  if (index->fd >= 0)
+    close (index->fd);
+  index->map = NULL;
+  index->fd = -1;
+}
+
+
+
+/* creates an empty, dirty index file with the given capacity */
+static gboolean
+cowmail_index_create (cowmail_index  *index,
+                      const gchar    *filename,
+                      guint64         capacity,
+                      GError        **error)
+{
+  gsize size = COWMAIL_INDEX_HEADER_SIZE + capacity * COWMAIL_INDEX_SLOT_SIZE;
+  gint fd = open (filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0 || ftruncate (fd, size) < 0) {
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno), "%s: %s", filename, g_strerror (errno));
+    if (fd >= 0)
+      close (fd);
+    return FALSE;
+  }
+  guchar *map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno), "%s: %s", filename, g_strerror (errno));
+    close (fd);
+    return FALSE;
+  }
+
+  cowmail_index_header *header = (cowmail_index_header *) map;
+  memcpy (header->magic, COWMAIL_INDEX_MAGIC, sizeof (header->magic));
+  header->capacity = GUINT64_TO_LE (capacity);
+
+  index->fd = fd;
+  index->map = map;
+  index->size = size;
+  index->capacity = capacity;
+  index->used = 0;
+  return TRUE;
+}
+
+
+
+/* maps an existing index file if it is valid and was closed cleanly */
+static gboolean
+cowmail_index_load (cowmail_index *index)
+{
+  struct stat st;
+  gint fd = open (index->filename, O_RDWR | O_CLOEXEC);
+  if (fd < 0)
+    return FALSE;
+  if (fstat (fd, &st) < 0 || st.st_size < COWMAIL_INDEX_HEADER_SIZE + COWMAIL_INDEX_SLOT_SIZE) {
+    close (fd);
+    return FALSE;
+  }
+  guchar *map = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    close (fd);
+    return FALSE;
+  }
+  index->fd = fd;
+  index->map = map;
+  index->size = st.st_size;
+
+  cowmail_index_header *header = (cowmail_index_header *) map;
+  guint64 capacity = GUINT64_FROM_LE (header->capacity);
+  if (memcmp (header->magic, COWMAIL_INDEX_MAGIC, sizeof (header->magic)) != 0 ||
+      !GUINT32_FROM_LE (header->clean) ||
+      capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+      (guint64) st.st_size != COWMAIL_INDEX_HEADER_SIZE + capacity * COWMAIL_INDEX_SLOT_SIZE) {
+    cowmail_index_unmap (index);
+    return FALSE;
+  }
+  index->capacity = capacity;
+  index->used = GUINT64_FROM_LE (header->used);
+  index->records = GUINT64_FROM_LE (header->records);
+  return TRUE;
+}
+
+
+
+/* puts a slot into the table, returns TRUE if it took a free slot */
+static gboolean
+cowmail_index_place (cowmail_index             *index,
+                     const cowmail_index_entry *slot,
+                     gboolean                   replace)
+{
+  guint64 i = cowmail_index_bucket (index, slot->hash);
+  cowmail_index_entry *s = cowmail_index_slot (index, i);
+  while (s->length != 0 && memcmp (s->hash, slot->hash, COWMAIL_KEY_SIZE) != 0) {
+    i = (i + 1) & (index->capacity - 1);
+    s = cowmail_index_slot (index, i);
+  }
+  gboolean fresh = s->length == 0;
+  if (fresh || replace)
+    *s = *slot;
+  return fresh;
+}
+
+
+
+static void
+cowmail_index_free_old (cowmail_index *index)
+{
+  cowmail_index_unmap (index->old);
+  g_clear_pointer (&index->old, g_free);
+}
+
+
+
+/* moves up to n slots of the old table, and replaces the old file once all are moved */
+static gboolean
+cowmail_index_migrate (cowmail_index  *index,
+                       guint64         n,
+                       GError        **error)
+{
+  cowmail_index *old = index->old;
+  for (; n > 0 && index->moved < old->capacity; n--, index->moved++) {
+    cowmail_index_entry *s = cowmail_index_slot (old, index->moved);
+    /* an entry inserted since the table grew is newer */
+    if (s->length != 0)
+      index->used += cowmail_index_place (index, s, FALSE);
+  }
+  if (index->moved < old->capacity)
+    return TRUE;
+
+  g_autofree gchar *tmpname = g_strconcat (index->filename, ".tmp", NULL);
+  gboolean ok = rename (tmpname, index->filename) == 0;
+  if (!ok)
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno), "%s: %s", index->filename, g_strerror (errno));
+  cowmail_index_free_old (index);
+  return ok;
+}
+
+
+
+/* switches to a file of twice the size, into which inserts move the old slots bit by bit */
+static gboolean
+cowmail_index_grow (cowmail_index  *index,
+                    GError        **error)
+{
+  g_autofree gchar *tmpname = g_strconcat (index->filename, ".tmp", NULL);
+  cowmail_index *old = g_new (cowmail_index, 1);
+  *old = *index;
+  if (!cowmail_index_create (index, tmpname, index->capacity * 2, error)) {
+    g_free (old);
+    return FALSE;
+  }
+  index->old = old;
+  index->moved = 0;
+  return TRUE;
+}
+
+
+
+cowmail_index *
+cowmail_index_open (const gchar  *filename,
+                    GError      **error)
+{
+  cowmail_index *index = g_new0 (cowmail_index, 1);
+  index->filename = g_strdup (filename);
+  index->fd = -1;
+
+  if (!cowmail_index_load (index) &&
+      !cowmail_index_create (index, filename, COWMAIL_INDEX_MIN_CAPACITY, error)) {
+    g_free (index->filename);
+    g_free (index);
+    return NULL;
+  }
+
+  /* a crash from now on leaves the index dirty */
+  cowmail_index_header *header = (cowmail_index_header *) index->map;
+  header->clean = 0;
+  msync (index->map, COWMAIL_INDEX_HEADER_SIZE, MS_SYNC);
+  return index;
+}
+
+
+
+void
+cowmail_index_close (cowmail_index *index)
+{
+  if (index->old && !cowmail_index_migrate (index, G_MAXUINT64, NULL))
+    index->broken = TRUE;
+  cowmail_index_header *header = (cowmail_index_header *) index->map;
+  header->used = GUINT64_TO_LE (index->used);
+  header->records = GUINT64_TO_LE (index->records);
+  if (!index->broken && msync (index->map, index->size, MS_SYNC) == 0) {
+    header->clean = GUINT32_TO_LE (1);
+    msync (index->map, COWMAIL_INDEX_HEADER_SIZE, MS_SYNC);
+  }
+  cowmail_index_unmap (index);
+  g_free (index->filename);
+  g_free (index);
+}
+
+
+
+guint64
+cowmail_index_records (cowmail_index *index)
+{
+  return index->records;
+}
+
+
+
+gboolean
+cowmail_index_reset (cowmail_index  *index,
+                     GError        **error)
+{
+  if (index->old) {
+    g_autofree gchar *tmpname = g_strconcat (index->filename, ".tmp", NULL);
+    cowmail_index_free_old (index);
+    unlink (tmpname);
+  }
+  cowmail_index_unmap (index);
+  index->records = 0;
+  index->broken = !cowmail_index_create (index, index->filename, COWMAIL_INDEX_MIN_CAPACITY, error);
+  return !index->broken;
+}
+
+
+
+gboolean
+cowmail_index_insert (cowmail_index              *index,
+                      const cowmail_index_entry  *entry,
+                      GError                    **error)
+{
+  if (index->broken) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Index is broken");
+    return FALSE;
+  }
+  gboolean ok = !index->old || cowmail_index_migrate (index, COWMAIL_INDEX_MIGRATE_STEP, error);
+  /* the old slots are all moved long before the grown table is full again */
+  if (ok && (index->used + 1) * COWMAIL_INDEX_LOAD_DEN > index->capacity * COWMAIL_INDEX_LOAD_NUM)
+    ok = (!index->old || cowmail_index_migrate (index, G_MAXUINT64, error)) && cowmail_index_grow (index, error);
+  if (!ok) {
+    /* the entry is missing now, so have the store rebuild the index */
+    index->broken = TRUE;
+    return FALSE;
+  }
+
+  cowmail_index_entry slot;
+  memcpy (slot.hash, entry->hash, COWMAIL_KEY_SIZE);
+  slot.segment = GUINT32_TO_LE (entry->segment);
+  slot.length = GUINT32_TO_LE (entry->length);
+  slot.offset = GUINT64_TO_LE (entry->offset);
+  index->used += cowmail_index_place (index, &slot, TRUE);
+  index->records++;
+  return TRUE;
+}
+
+
+
+static gboolean
+cowmail_index_find (cowmail_index       *index,
+                    const guchar        *hash,
+                    cowmail_index_entry *entry)
+{
+  guint64 i = cowmail_index_bucket (index, hash);
+  cowmail_index_entry *s = cowmail_index_slot (index, i);
+  while (s->length != 0) {
+    if (memcmp (s->hash, hash, COWMAIL_KEY_SIZE) == 0) {
+      memcpy (entry->hash, s->hash, COWMAIL_KEY_SIZE);
+      entry->segment = GUINT32_FROM_LE (s->segment);
+      entry->length = GUINT32_FROM_LE (s->length);
+      entry->offset = GUINT64_FROM_LE (s->offset);
+      return TRUE;
+    }
+    i = (i + 1) & (index->capacity - 1);
+    s = cowmail_index_slot (index, i);
+  }
+  return FALSE;
+}
+
+
+
+gboolean
+cowmail_index_lookup (cowmail_index       *index,
+                      const guchar        *hash,
+                      cowmail_index_entry *entry)
+{
+  if (index->broken)
+    return FALSE;
+  /* the grown table holds the newer entry of a hash in both */
+  return cowmail_index_find (index, hash, entry) ||
+         (index->old && cowmail_index_find (index->old, hash, entry));
+}
@@ -0,0 +1,125 @@
+/* cowmail-index.h
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "libcowmail.h"
+
+/* size of the file header */
+#define COWMAIL_INDEX_HEADER_SIZE  64
+/* size of a slot, the same layout as a location record of the store */
+#define COWMAIL_INDEX_SLOT_SIZE    48
+/* number of slots of a new index, a power of two */
+#define COWMAIL_INDEX_MIN_CAPACITY 1024
+/* the table is doubled when more than 7 of 10 slots are used */
+#define COWMAIL_INDEX_LOAD_NUM     7
+#define COWMAIL_INDEX_LOAD_DEN     10
+/* slots of the table before growing that each insert moves to the grown one */
+#define COWMAIL_INDEX_MIGRATE_STEP 64
+
+
+
+typedef struct _cowmail_index cowmail_index;
+
+typedef struct
+{
+  guchar   hash[COWMAIL_KEY_SIZE];
+  guint32  segment;
+  guint32  length;
+  guint64  offset;
+} cowmail_index_entry;
+
+
+
+/**
+ * cowmail_index_open:
+ * @filename: file of the index
+ * @error: return location for an error
+ *
+ * Maps a persistent hash table from body hashes to body locations. It uses
+ * open addressing with linear probing in a power-of-two table. The hashes are
+ * uniformly random, so the first 8 bytes of a hash select its bucket directly
+ * and a lookup touches one or two slots, no matter how large the table is.
+ *
+ * The index is derived from the location records of the store. It is only
+ * marked clean by cowmail_index_close(); an index that was not closed cleanly,
+ * is missing or is damaged is opened empty, so that the store rebuilds it.
+ *
+ * The index is not thread-safe.
+ *
+ * Returns: the index, or NULL on error
+ */
+cowmail_index     *cowmail_index_open      (const gchar           *filename,
+                                            GError               **error);
+
+/**
+ * cowmail_index_close:
+ * @index: the index
+ *
+ * Writes the index to disk, marks it clean and frees it.
+ */
+void               cowmail_index_close     (cowmail_index         *index);
+
+/**
+ * cowmail_index_records:
+ * @index: the index
+ *
+ * Returns: the number of location records inserted so far
+ */
+guint64            cowmail_index_records   (cowmail_index         *index);
+
+/**
+ * cowmail_index_reset:
+ * @index: the index
+ * @error: return location for an error
+ *
+ * Removes all entries.
+ *
+ * Returns: TRUE on success
+ */
+gboolean           cowmail_index_reset     (cowmail_index         *index,
+                                            GError               **error);
+
+/**
+ * cowmail_index_insert:
+ * @index: the index
+ * @entry: the location of a body
+ * @error: return location for an error
+ *
+ * Inserts the next location record, replacing an entry with the same hash. The
+ * table grows into a new file when it gets too full. Rather than rehashing all
+ * at once, every insert then moves COWMAIL_INDEX_MIGRATE_STEP slots of the old
+ * table, and lookups try both tables until the old one is empty.
+ *
+ * Returns: TRUE on success
+ */
+gboolean           cowmail_index_insert    (cowmail_index         *index,
+                                            const cowmail_index_entry *entry,
+                                            GError               **error);
+
+/**
+ * cowmail_index_lookup:
+ * @index: the index
+ * @hash: SHA-256 of a body
+ * @entry: return location for the location of the body
+ *
+ * Returns: TRUE if the hash was found
+ */
+gboolean           cowmail_index_lookup    (cowmail_index         *index,
+                                            const guchar          *hash,
+                                            cowmail_index_entry   *entry);
@@ -0,0 +1,429 @@
+/* cowmail-load.c
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glib/gstdio.h>
+
+#include "cowmail-metrics.h"
+#include "cowmail-server.h"
+
+/* the histograms have 2^COWMAIL_LOAD_SUB_BITS buckets per power of two, for a precision of 6% */
+#define COWMAIL_LOAD_SUB_BITS 4
+#define COWMAIL_LOAD_SUB      (1 << COWMAIL_LOAD_SUB_BITS)
+#define COWMAIL_LOAD_BUCKETS  ((64 - COWMAIL_LOAD_SUB_BITS + 1) * COWMAIL_LOAD_SUB)
+
+
+
+typedef enum
+{
+  COWMAIL_LOAD_PUT,
+  COWMAIL_LOAD_LIST,
+  COWMAIL_LOAD_GET,
+  COWMAIL_LOAD_COMMANDS
+} cowmail_load_command;
+
+static const gchar *command_names[COWMAIL_LOAD_COMMANDS] = { "PUT", "LIST", "GET" };
+
+
+
+/* latencies in microseconds */
+typedef struct
+{
+  guint64 buckets[COWMAIL_LOAD_BUCKETS];
+  guint64 count;
+  guint64 errors;
+  guint64 max;
+} cowmail_load_histogram;
+
+
+
+typedef struct
+{
+  cowmail_id             *id;
+  GList                  *ids;
+  cowmail_session        *session;
+  guint64                 cursor;
+  GPtrArray              *tickets;
+  GRand                  *rand;
+  cowmail_load_histogram  histograms[COWMAIL_LOAD_COMMANDS];
+} cowmail_load_user;
+
+
+
+static gchar *server = NULL;
+static gint users = 8;
+static gint duration = 10;
+static gchar *mix = NULL;
+static gint inbox = 16;
+static gint size = 1024;
+static gint latency = 0;
+static gint threads = 0;
+static gint max_conns = 0;
+static gboolean metrics = FALSE;
+
+static GOptionEntry entries[] =
+{
+  { "server", 's', 0, G_OPTION_ARG_STRING, &server, "Server to load (default: an in-process server on the loopback)", "HOST" },
+  { "users", 'u', 0, G_OPTION_ARG_INT, &users, "Number of concurrent users (default: 8)", "N" },
+  { "duration", 't', 0, G_OPTION_ARG_INT, &duration, "Seconds to run (default: 10)", "SECONDS" },
+  { "mix", 'm', 0, G_OPTION_ARG_STRING, &mix, "Relative weights of the commands (default: 20:40:40)", "PUT:LIST:GET" },
+  { "inbox", 'i', 0, G_OPTION_ARG_INT, &inbox, "Messages in each inbox before the run (default: 16)", "N" },
+  { "size", 'b', 0, G_OPTION_ARG_INT, &size, "Size of each message in bytes (default: 1024)", "BYTES" },
+  { "latency", 'l', 0, G_OPTION_ARG_INT, &latency, "Delay before each request, like a slow network (default: 0)", "MS" },
+  { "threads", 'T', 0, G_OPTION_ARG_INT, &threads, "Reactor threads of the in-process server (default: one per processor)", "N" },
+  { "max-conns", 0, 0, G_OPTION_ARG_INT, &max_conns, "Connection cap of the in-process server, to see how it sheds load (default: 0, none)", "N" },
+  { "metrics", 0, 0, G_OPTION_ARG_NONE, &metrics, "Print the metrics of libcowmail for the run as JSON", NULL },
+  { NULL }
+};
+
+static guint weights[COWMAIL_LOAD_COMMANDS] = { 20, 40, 40 };
+static gchar *message = NULL;
+static GList *contacts = NULL;
+static gint64 deadline = 0;
+
+
+
+/* the bucket of v is its highest COWMAIL_LOAD_SUB_BITS + 1 bits */
+static guint
+cowmail_load_bucket (guint64 v)
+{
+  if (v < COWMAIL_LOAD_SUB)
+    return v;
+  guint e = 63;
+  while (!(v >> e))
+    e--;
+  guint shift = e - COWMAIL_LOAD_SUB_BITS;
+  return (shift + 1) * COWMAIL_LOAD_SUB + ((v >> shift) & (COWMAIL_LOAD_SUB - 1));
+}
+
+
+
+/* the largest value of a bucket */
+static guint64
+cowmail_load_bucket_max (guint bucket)
+{
+  if (bucket < COWMAIL_LOAD_SUB)
+    return bucket;
+  guint shift = bucket / COWMAIL_LOAD_SUB - 1;
+  guint64 sub = bucket % COWMAIL_LOAD_SUB;
+  return ((COWMAIL_LOAD_SUB + sub + 1) << shift) - 1;
+}
+
+
+
+static void
+cowmail_load_record (cowmail_load_histogram *histogram,
+                     gint64                  start,
+                     gboolean                ok)
+{
+  if (!ok) {
+    histogram->errors++;
+    return;
+  }
+  guint64 us = g_get_monotonic_time () - start;
+  histogram->buckets[cowmail_load_bucket (us)]++;
+  histogram->count++;
+  histogram->max = MAX (histogram->max, us);
+}
+
+
+
+static guint64
+cowmail_load_percentile (const cowmail_load_histogram *histogram,
+                         gdouble                       p)
+{
+  guint64 rank = (guint64) (p * histogram->count + 0.5);
+  guint64 seen = 0;
+  for (guint b = 0; b < COWMAIL_LOAD_BUCKETS; b++) {
+    seen += histogram->buckets[b];
+    if (seen >= MAX (rank, 1))
+      return MIN (cowmail_load_bucket_max (b), histogram->max);
+  }
+  return histogram->max;
+}
+
+
+
+static void
+on_ticket (cowmail_ticket *ticket,
+           gpointer        userdata)
+{
+  cowmail_load_user *user = userdata;
+  g_ptr_array_add (user->tickets, ticket);
+}
+
+
+
+/* a failed request may leave the session out of sync, so start a new one */
+static void
+cowmail_load_reconnect (cowmail_load_user *user)
+{
+  if (user->session)
+    cowmail_session_close (user->session);
+  user->session = cowmail_session_open (server);
+}
+
+
+
+static gboolean
+cowmail_load_put (cowmail_load_user *user)
+{
+  const cowmail_id *contact = g_list_nth_data (contacts, g_rand_int_range (user->rand, 0, users));
+  return cowmail_session_put (user->session, message, contact);
+}
+
+
+
+static gboolean
+cowmail_load_list (cowmail_load_user *user)
+{
+  /* a failed LIST looks like an empty one, the next PUT or GET on the session reports it */
+  cowmail_session_list (user->session, user->ids, user->cursor, 0, &user->cursor, on_ticket, user);
+  return TRUE;
+}
+
+
+
+static gboolean
+cowmail_load_get (cowmail_load_user *user)
+{
+  cowmail_ticket *ticket = g_ptr_array_index (user->tickets, g_rand_int_range (user->rand, 0, user->tickets->len));
+  g_autofree gchar *msg = cowmail_session_get (user->session, ticket);
+  return msg != NULL;
+}
+
+
+
+static gpointer
+cowmail_load_user_run (gpointer data)
+{
+  cowmail_load_user *user = data;
+  guint total = weights[COWMAIL_LOAD_PUT] + weights[COWMAIL_LOAD_LIST] + weights[COWMAIL_LOAD_GET];
+
+  while (g_get_monotonic_time () < deadline) {
+    if (!user->session) {
+      cowmail_load_reconnect (user);
+      if (!user->session) {
+        g_usleep (G_USEC_PER_SEC / 10);
+        continue;
+      }
+    }
+
+    guint r = g_rand_int_range (user->rand, 0, total);
+    cowmail_load_command command = r < weights[COWMAIL_LOAD_PUT] ? COWMAIL_LOAD_PUT :
+                                   r < weights[COWMAIL_LOAD_PUT] + weights[COWMAIL_LOAD_LIST] ? COWMAIL_LOAD_LIST :
+                                   COWMAIL_LOAD_GET;
+    if (command == COWMAIL_LOAD_GET && user->tickets->len == 0)
+      command = COWMAIL_LOAD_LIST;
+
+    if (latency > 0)
+      g_usleep (latency * 1000);
+
+    gint64 start = g_get_monotonic_time ();
+    gboolean ok;
+    switch (command) {
+    case COWMAIL_LOAD_PUT:
+      ok = cowmail_load_put (user);
+      break;
+    case COWMAIL_LOAD_LIST:
+      ok = cowmail_load_list (user);
+      break;
+    default:
+      ok = cowmail_load_get (user);
+      break;
+    }
+    cowmail_load_record (&user->histograms[command], start, ok);
+    if (!ok)
+      g_clear_pointer (&user->session, cowmail_session_close);
+  }
+  return NULL;
+}
+
+
+
+/* fills the inbox of the user and lists it once, so the run starts with tickets to get */
+static gboolean
+cowmail_load_user_prepare (cowmail_load_user *user)
+{
+  cowmail_load_reconnect (user);
+  if (!user->session)
+    return FALSE;
+  for (gint i = 0; i < inbox; i++)
+    if (!cowmail_session_put (user->session, message, user->id))
+      return FALSE;
+  cowmail_session_list (user->session, user->ids, 0, 0, &user->cursor, on_ticket, user);
+  return TRUE;
+}
+
+
+
+static void
+cowmail_load_report (cowmail_load_histogram *histograms,
+                     gdouble                 seconds)
+{
+  g_print ("%-5s %10s %8s %10s %10s %10s %10s %10s\n",
+           "", "requests", "errors", "req/s", "p50 ms", "p99 ms", "p999 ms", "max ms");
+  guint64 requests = 0;
+  for (guint c = 0; c < COWMAIL_LOAD_COMMANDS; c++) {
+    cowmail_load_histogram *h = &histograms[c];
+    requests += h->count;
+    g_print ("%-5s %10" G_GUINT64_FORMAT " %8" G_GUINT64_FORMAT " %10.1f %10.3f %10.3f %10.3f %10.3f\n",
+             command_names[c], h->count, h->errors, h->count / seconds,
+             cowmail_load_percentile (h, 0.5) / 1000.0, cowmail_load_percentile (h, 0.99) / 1000.0,
+             cowmail_load_percentile (h, 0.999) / 1000.0, h->max / 1000.0);
+  }
+  g_print ("total %10" G_GUINT64_FORMAT " %8s %10.1f\n", requests, "", requests / seconds);
+}
+
+
+
+/* the store keeps all its files directly in its directory */
+static void
+cowmail_load_remove_dir (const gchar *path)
+{
+  g_autoptr (GDir) dir = g_dir_open (path, 0, NULL);
+  const gchar *name;
+  while (dir && (name = g_dir_read_name (dir))) {
+    g_autofree gchar *file = g_build_filename (path, name, NULL);
+    g_unlink (file);
+  }
+  g_rmdir (path);
+}
+
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GOptionContext) context = g_option_context_new ("- generate load on a Cowmail server");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_printerr ("COWMAIL ERROR: %s\n", error->message);
+    return 1;
+  }
+  if (mix) {
+    g_auto (GStrv) parts = g_strsplit (mix, ":", -1);
+    if (g_strv_length (parts) != COWMAIL_LOAD_COMMANDS) {
+      g_printerr ("COWMAIL ERROR: Invalid mix: %s\n", mix);
+      return 1;
+    }
+    for (guint c = 0; c < COWMAIL_LOAD_COMMANDS; c++)
+      weights[c] = g_ascii_strtoull (parts[c], NULL, 10);
+  }
+  if (users < 1 || duration < 1 || inbox < 0 || size < 0 || latency < 0 ||
+      weights[COWMAIL_LOAD_PUT] + weights[COWMAIL_LOAD_LIST] + weights[COWMAIL_LOAD_GET] == 0) {
+    g_printerr ("COWMAIL ERROR: Invalid arguments\n");
+    return 1;
+  }
+
+  g_autofree gchar *dir = NULL;
+  cowmail_store *store = NULL;
+  cowmail_server *loopback = NULL;
+  if (!server) {
+    dir = g_dir_make_tmp ("cowmail-load-XXXXXX", &error);
+    if (dir)
+      store = cowmail_store_open (dir, &error);
+    if (!store) {
+      g_printerr ("COWMAIL ERROR STORE: %s\n", error->message);
+      return 1;
+    }
+    /* measure the protocol and the server, not the disk */
+    cowmail_store_set_sync (store, FALSE);
+    loopback = cowmail_server_new (store, 0, threads);
+    cowmail_admission_limits limits = { MAX (max_conns, 0), 0, 0 };
+    cowmail_server_set_limits (loopback, &limits);
+    if (!cowmail_server_start (loopback, &error)) {
+      g_printerr ("COWMAIL ERROR SERVER: %s\n", error->message);
+      return 1;
+    }
+    server = g_strdup_printf ("localhost:%u", cowmail_server_get_port (loopback));
+  }
+
+  message = g_malloc (size + 1);
+  memset (message, 'm', size);
+  message[size] = '\0';
+
+  g_print ("Preparing %d users with %d messages each on %s\n", users, inbox, server);
+  cowmail_load_user *load = g_new0 (cowmail_load_user, users);
+  for (gint u = 0; u < users; u++) {
+    g_autofree gchar *name = g_strdup_printf ("user%d", u);
+    load[u].id = cowmail_id_generate (name);
+    load[u].ids = g_list_append (NULL, load[u].id);
+    load[u].tickets = g_ptr_array_new_with_free_func (g_free);
+    load[u].rand = g_rand_new ();
+    cowmail_id *contact = cowmail_id_to_contact (load[u].id);
+    /* the repetitive test messages would compress to almost nothing, so keep --size what is sent */
+    contact->features = 0;
+    contacts = g_list_append (contacts, contact);
+  }
+  for (gint u = 0; u < users; u++)
+    if (!cowmail_load_user_prepare (&load[u])) {
+      g_printerr ("COWMAIL ERROR: Cannot prepare the inbox of user %d\n", u);
+      return 1;
+    }
+
+  g_print ("Running %d users for %d s with PUT:LIST:GET = %u:%u:%u\n\n", users, duration,
+           weights[COWMAIL_LOAD_PUT], weights[COWMAIL_LOAD_LIST], weights[COWMAIL_LOAD_GET]);
+  GThread **workers = g_new (GThread *, users);
+  cowmail_metrics_reset ();
+  gint64 start = g_get_monotonic_time ();
+  deadline = start + (gint64) duration * G_USEC_PER_SEC;
+  for (gint u = 0; u < users; u++)
+    workers[u] = g_thread_new ("cowmail-load", cowmail_load_user_run, &load[u]);
+
+  cowmail_load_histogram *total = g_new0 (cowmail_load_histogram, COWMAIL_LOAD_COMMANDS);
+  for (gint u = 0; u < users; u++) {
+    g_thread_join (workers[u]);
+    for (guint c = 0; c < COWMAIL_LOAD_COMMANDS; c++) {
+      cowmail_load_histogram *h = &load[u].histograms[c];
+      for (guint b = 0; b < COWMAIL_LOAD_BUCKETS; b++)
+        total[c].buckets[b] += h->buckets[b];
+      total[c].count += h->count;
+      total[c].errors += h->errors;
+      total[c].max = MAX (total[c].max, h->max);
+    }
+  }
+  cowmail_load_report (total, (g_get_monotonic_time () - start) / (gdouble) G_USEC_PER_SEC);
+  if (metrics) {
+    g_autofree gchar *json = cowmail_metrics_to_json ();
+    g_print ("\n%s", json);
+  }
+
+  for (gint u = 0; u < users; u++) {
+    if (load[u].session)
+      cowmail_session_close (load[u].session);
+    g_ptr_array_unref (load[u].tickets);
+    g_rand_free (load[u].rand);
+    g_list_free (load[u].ids);
+    cowmail_id_free (load[u].id);
+  }
+  g_list_free_full (contacts, (GDestroyNotify) cowmail_id_free);
+  g_free (total);
+  g_free (workers);
+  g_free (load);
+  g_free (message);
+
+  if (loopback) {
+    cowmail_server_free (loopback);
+    cowmail_store_close (store);
+    cowmail_load_remove_dir (dir);
+  }
+  g_free (server);
+  return 0;
+}
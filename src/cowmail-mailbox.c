@@ -0,0 +1,287 @@
+/* cowmail-mailbox.c
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cowmail-mailbox.h"
+#include <gnutls/crypto.h>
+#include <nettle/gcm.h>
+
+
+
+struct _cowmail_mailbox
+{
+  GFile      *dir;
+  GList      *ids;
+  GHashTable *known;
+};
+
+
+
+typedef struct
+{
+  gint64  time;
+  gchar  *msg;
+} cowmail_mailbox_entry;
+
+
+
+static guint
+cowmail_mailbox_hash (gconstpointer key)
+{
+  /* the keys are SHA-256 hashes, so any 4 bytes are uniformly distributed */
+  guint h;
+  memcpy (&h, key, sizeof (h));
+  return h;
+}
+
+
+
+static gboolean
+cowmail_mailbox_equal (gconstpointer a,
+                       gconstpointer b)
+{
+  return memcmp (a, b, COWMAIL_KEY_SIZE) == 0;
+}
+
+
+
+static void
+cowmail_mailbox_key (const cowmail_id *id,
+                     guchar           *key)
+{
+  gsize llen = strlen (COWMAIL_MAILBOX_LABEL);
+  guchar material[sizeof (COWMAIL_MAILBOX_LABEL) + COWMAIL_KEY_SIZE];
+  memcpy (material, COWMAIL_MAILBOX_LABEL, llen);
+  memcpy (material + llen, id->key, COWMAIL_KEY_SIZE);
+  gnutls_hash_fast (GNUTLS_DIG_SHA256, material, llen + COWMAIL_KEY_SIZE, key);
+  memset (material, 0, sizeof (material));
+}
+
+
+
+static GFile *
+cowmail_mailbox_id_dir (cowmail_mailbox  *mailbox,
+                        const cowmail_id *id)
+{
+  g_autofree gchar *fp = cowmail_id_fingerprint (id);
+  return g_file_get_child (mailbox->dir, fp);
+}
+
+
+
+/* parses a file name of 64 hex digits and ".msg" */
+static gboolean
+cowmail_mailbox_parse_name (const gchar *name,
+                            guchar      *hash)
+{
+  if (strlen (name) != 2 * COWMAIL_KEY_SIZE + 4 || !g_str_has_suffix (name, ".msg"))
+    return FALSE;
+  for (gsize i = 0; i < COWMAIL_KEY_SIZE; i++) {
+    gint hi = g_ascii_xdigit_value (name[2 * i]);
+    gint lo = g_ascii_xdigit_value (name[2 * i + 1]);
+    if (hi < 0 || lo < 0)
+      return FALSE;
+    hash[i] = hi << 4 | lo;
+  }
+  return TRUE;
+}
+
+
+
+cowmail_mailbox *
+cowmail_mailbox_new (GFile *dir,
+                     GList *ids)
+{
+  cowmail_mailbox *mailbox = g_new0 (cowmail_mailbox, 1);
+  mailbox->dir = g_object_ref (dir);
+  mailbox->ids = ids;
+  mailbox->known = g_hash_table_new_full (cowmail_mailbox_hash, cowmail_mailbox_equal, g_free, NULL);
+
+  for (GList *idl = ids; idl; idl = idl->next) {
+    g_autoptr (GFile) iddir = cowmail_mailbox_id_dir (mailbox, idl->data);
+    g_file_make_directory_with_parents (iddir, NULL, NULL);
+
+    g_autoptr (GFileEnumerator) files = g_file_enumerate_children (iddir, G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                                                  G_FILE_QUERY_INFO_NONE, NULL, NULL);
+    GFileInfo *info;
+    while (files && g_file_enumerator_iterate (files, &info, NULL, NULL, NULL) && info) {
+      guchar *hash = g_malloc (COWMAIL_KEY_SIZE);
+      if (cowmail_mailbox_parse_name (g_file_info_get_name (info), hash))
+        g_hash_table_replace (mailbox->known, hash, idl->data);
+      else
+        g_free (hash);
+    }
+  }
+  return mailbox;
+}
+
+
+
+gboolean
+cowmail_mailbox_contains (cowmail_mailbox *mailbox,
+                          const guchar    *hash)
+{
+  return g_hash_table_contains (mailbox->known, hash);
+}
+
+
+
+/*
+ * A message file is a random nonce (16 bytes), then the receive time in
+ * microseconds (8 bytes, big endian) and the message including its terminating
+ * zero, encrypted with AES-256-GCM, and the GCM tag (16 bytes).
+ */
+void
+cowmail_mailbox_add (cowmail_mailbox      *mailbox,
+                     const cowmail_ticket *ticket,
+                     const gchar          *msg)
+{
+  g_autoptr (GError) error = NULL;
+  gsize n = sizeof (gint64) + strlen (msg) + 1;
+  gsize len = COWMAIL_TAG_SIZE + n + COWMAIL_TAG_SIZE;
+  g_autofree guchar *clear = g_malloc (n);
+  g_autofree guchar *data = g_malloc (len);
+
+  guint64 time = GUINT64_TO_BE (g_get_real_time ());
+  memcpy (clear, &time, sizeof (time));
+  memcpy (clear + sizeof (time), msg, n - sizeof (time));
+  gnutls_rnd (GNUTLS_RND_NONCE, data, COWMAIL_TAG_SIZE);
+
+  guchar key[COWMAIL_KEY_SIZE];
+  struct gcm_aes256_ctx aes;
+  cowmail_mailbox_key (ticket->id, key);
+  gcm_aes256_set_key (&aes, key);
+  gcm_aes256_set_iv (&aes, COWMAIL_TAG_SIZE, data);
+  gcm_aes256_encrypt (&aes, n, data + COWMAIL_TAG_SIZE, clear);
+  gcm_aes256_digest (&aes, COWMAIL_TAG_SIZE, data + COWMAIL_TAG_SIZE + n);
+  memset (&aes, 0, sizeof (aes));
+  memset (key, 0, sizeof (key));
+  memset (clear, 0, n);
+
+  gchar name[2 * COWMAIL_KEY_SIZE + 5];
+  for (gsize i = 0; i < COWMAIL_KEY_SIZE; i++)
+    g_snprintf (name + 2 * i, 3, "%02x", ticket->hash[i]);
+  g_strlcpy (name + 2 * COWMAIL_KEY_SIZE, ".msg", 5);
+
+  g_autoptr (GFile) iddir = cowmail_mailbox_id_dir (mailbox, ticket->id);
+  g_autoptr (GFile) file = g_file_get_child (iddir, name);
+  if (!g_file_replace_contents (file, (const gchar *) data, len, NULL, FALSE, G_FILE_CREATE_PRIVATE,
+                                NULL, NULL, &error)) {
+    g_printerr ("COWMAIL ERROR MAILBOX: %s\n", error->message);
+    return;
+  }
+  guchar *hash = g_malloc (COWMAIL_KEY_SIZE);
+  memcpy (hash, ticket->hash, COWMAIL_KEY_SIZE);
+  g_hash_table_replace (mailbox->known, hash, (gpointer) ticket->id);
+}
+
+
+
+static gboolean
+cowmail_mailbox_load (GFile                 *file,
+                      const guchar          *key,
+                      cowmail_mailbox_entry *entry)
+{
+  g_autoptr (GError) error = NULL;
+  g_autofree gchar *data = NULL;
+  gsize len;
+  if (!g_file_load_contents (file, NULL, &data, &len, NULL, &error)) {
+    g_printerr ("COWMAIL ERROR MAILBOX: %s\n", error->message);
+    return FALSE;
+  }
+  if (len < 2 * COWMAIL_TAG_SIZE + sizeof (gint64) + 1)
+    return FALSE;
+
+  gsize n = len - 2 * COWMAIL_TAG_SIZE;
+  g_autofree guchar *clear = g_malloc (n);
+  guchar tag[COWMAIL_TAG_SIZE];
+  struct gcm_aes256_ctx aes;
+  gcm_aes256_set_key (&aes, key);
+  gcm_aes256_set_iv (&aes, COWMAIL_TAG_SIZE, (guchar *) data);
+  gcm_aes256_decrypt (&aes, n, clear, (guchar *) data + COWMAIL_TAG_SIZE);
+  gcm_aes256_digest (&aes, COWMAIL_TAG_SIZE, tag);
+  memset (&aes, 0, sizeof (aes));
+
+  if (memcmp (tag, data + COWMAIL_TAG_SIZE + n, COWMAIL_TAG_SIZE) != 0 || clear[n - 1] != '\0') {
+    g_autofree gchar *fname = g_file_get_basename (file);
+    g_printerr ("COWMAIL ERROR MAILBOX: Cannot decrypt %s\n", fname);
+    return FALSE;
+  }
+  guint64 time;
+  memcpy (&time, clear, sizeof (time));
+  entry->time = GUINT64_FROM_BE (time);
+  entry->msg = g_strdup ((gchar *) clear + sizeof (time));
+  memset (clear, 0, n);
+  return TRUE;
+}
+
+
+
+static gint
+cowmail_mailbox_entry_compare (gconstpointer a,
+                               gconstpointer b)
+{
+  gint64 ta = ((const cowmail_mailbox_entry *) a)->time;
+  gint64 tb = ((const cowmail_mailbox_entry *) b)->time;
+  return (ta > tb) - (ta < tb);
+}
+
+
+
+void
+cowmail_mailbox_foreach (cowmail_mailbox      *mailbox,
+                         cowmail_mailbox_func  func,
+                         gpointer              userdata)
+{
+  g_autoptr (GArray) entries = g_array_new (FALSE, FALSE, sizeof (cowmail_mailbox_entry));
+
+  for (GList *idl = mailbox->ids; idl; idl = idl->next) {
+    guchar key[COWMAIL_KEY_SIZE];
+    cowmail_mailbox_key (idl->data, key);
+
+    g_autoptr (GFile) iddir = cowmail_mailbox_id_dir (mailbox, idl->data);
+    g_autoptr (GFileEnumerator) files = g_file_enumerate_children (iddir, G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                                                  G_FILE_QUERY_INFO_NONE, NULL, NULL);
+    GFileInfo *info;
+    GFile *file;
+    while (files && g_file_enumerator_iterate (files, &info, &file, NULL, NULL) && info) {
+      guchar hash[COWMAIL_KEY_SIZE];
+      cowmail_mailbox_entry entry;
+      if (cowmail_mailbox_parse_name (g_file_info_get_name (info), hash) &&
+          cowmail_mailbox_load (file, key, &entry))
+        g_array_append_val (entries, entry);
+    }
+    memset (key, 0, sizeof (key));
+  }
+
+  g_array_sort (entries, cowmail_mailbox_entry_compare);
+  for (guint i = 0; i < entries->len; i++) {
+    cowmail_mailbox_entry *entry = &g_array_index (entries, cowmail_mailbox_entry, i);
+    func (entry->msg, userdata);
+    g_free (entry->msg);
+  }
+}
+
+
+
+void
+cowmail_mailbox_free (cowmail_mailbox *mailbox)
+{
+  g_hash_table_unref (mailbox->known);
+  g_object_unref (mailbox->dir);
+  g_free (mailbox);
+}
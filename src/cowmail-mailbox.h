@@ -0,0 +1,90 @@
+/* cowmail-mailbox.h
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "libcowmail.h"
+
+/* label hashed with the identity key to derive the mailbox key */
+#define COWMAIL_MAILBOX_LABEL "cowmail mailbox v1"
+
+
+
+typedef struct _cowmail_mailbox cowmail_mailbox;
+
+typedef void     (*cowmail_mailbox_func)   (const gchar           *msg,
+                                            gpointer               userdata);
+
+
+
+/**
+ * cowmail_mailbox_new:
+ * @dir: directory to keep received messages in
+ * @ids: identities the messages belong to, must outlive the mailbox
+ *
+ * Opens the local mailbox. Each identity has a subdirectory named by its
+ * fingerprint, with one file per message named by the hex SHA-256 of the
+ * message body on the server. The files are encrypted with AES-256-GCM under a
+ * key derived from the identity key, so they are only readable with it.
+ *
+ * Returns: the mailbox
+ */
+cowmail_mailbox   *cowmail_mailbox_new     (GFile                 *dir,
+                                            GList                 *ids);
+
+/**
+ * cowmail_mailbox_contains:
+ * @mailbox: the mailbox
+ * @hash: SHA-256 of a message body, as in a ticket
+ *
+ * Returns: TRUE if the message is in the mailbox already
+ */
+gboolean           cowmail_mailbox_contains (cowmail_mailbox      *mailbox,
+                                             const guchar         *hash);
+
+/**
+ * cowmail_mailbox_add:
+ * @mailbox: the mailbox
+ * @ticket: the header the message was fetched with
+ * @msg: the decrypted message
+ *
+ * Stores a received message for the identity of @ticket.
+ */
+void               cowmail_mailbox_add     (cowmail_mailbox       *mailbox,
+                                            const cowmail_ticket  *ticket,
+                                            const gchar           *msg);
+
+/**
+ * cowmail_mailbox_foreach:
+ * @mailbox: the mailbox
+ * @func: called for every message, oldest first
+ * @userdata: user data for @func
+ *
+ * Decrypts all stored messages of all identities.
+ */
+void               cowmail_mailbox_foreach (cowmail_mailbox       *mailbox,
+                                            cowmail_mailbox_func   func,
+                                            gpointer               userdata);
+
+/**
+ * cowmail_mailbox_free:
+ * @mailbox: the mailbox
+ *
+ * Frees the mailbox. The messages stay on disk.
+ */
+void               cowmail_mailbox_free    (cowmail_mailbox       *mailbox);
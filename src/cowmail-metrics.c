@@ -0,0 +1,267 @@
+/* cowmail-metrics.c
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cowmail-metrics.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+
+
+
+typedef struct
+{
+  atomic_uint_fast64_t count;
+  atomic_uint_fast64_t errors;
+  atomic_uint_fast64_t time;
+  atomic_uint_fast64_t max_time;
+} cowmail_metrics_atomic_timer;
+
+
+
+static struct
+{
+  cowmail_metrics_atomic_timer commands[COWMAIL_METRICS_COMMANDS];
+  cowmail_metrics_atomic_timer connects;
+  atomic_uint_fast64_t         bytes_in;
+  atomic_uint_fast64_t         bytes_out;
+  atomic_uint_fast64_t         heads_scanned;
+  atomic_uint_fast64_t         heads_skipped;
+  atomic_uint_fast64_t         heads_matched;
+  atomic_uint_fast64_t         scan_time;
+  atomic_uint_fast64_t         auth_failures;
+} counters;
+
+static const gchar *command_names[COWMAIL_METRICS_COMMANDS] = { "put", "list", "get" };
+
+
+
+static void
+cowmail_metrics_add (atomic_uint_fast64_t *counter,
+                     guint64               n)
+{
+  atomic_fetch_add_explicit (counter, n, memory_order_relaxed);
+}
+
+
+
+static guint64
+cowmail_metrics_load (atomic_uint_fast64_t *counter)
+{
+  return atomic_load_explicit (counter, memory_order_relaxed);
+}
+
+
+
+static void
+cowmail_metrics_time (cowmail_metrics_atomic_timer *timer,
+                      gint64                        start,
+                      gboolean                      ok)
+{
+  if (!ok) {
+    cowmail_metrics_add (&timer->errors, 1);
+    return;
+  }
+  guint64 time = g_get_monotonic_time () - start;
+  cowmail_metrics_add (&timer->count, 1);
+  cowmail_metrics_add (&timer->time, time);
+
+  uint_fast64_t max = cowmail_metrics_load (&timer->max_time);
+  while (time > max &&
+         !atomic_compare_exchange_weak_explicit (&timer->max_time, &max, time,
+                                                 memory_order_relaxed, memory_order_relaxed));
+}
+
+
+
+void
+cowmail_metrics_record (cowmail_metrics_command command,
+                        gint64                  start,
+                        gboolean                ok)
+{
+  cowmail_metrics_time (&counters.commands[command], start, ok);
+}
+
+
+
+void
+cowmail_metrics_connect (gint64   start,
+                         gboolean ok)
+{
+  cowmail_metrics_time (&counters.connects, start, ok);
+}
+
+
+
+void
+cowmail_metrics_bytes (guint64 in,
+                       guint64 out)
+{
+  if (in)
+    cowmail_metrics_add (&counters.bytes_in, in);
+  if (out)
+    cowmail_metrics_add (&counters.bytes_out, out);
+}
+
+
+
+void
+cowmail_metrics_scan (guint64 scanned,
+                      guint64 skipped,
+                      guint64 matched,
+                      gint64  start)
+{
+  cowmail_metrics_add (&counters.heads_scanned, scanned);
+  cowmail_metrics_add (&counters.heads_skipped, skipped);
+  cowmail_metrics_add (&counters.heads_matched, matched);
+  cowmail_metrics_add (&counters.scan_time, g_get_monotonic_time () - start);
+}
+
+
+
+void
+cowmail_metrics_auth_failure (void)
+{
+  cowmail_metrics_add (&counters.auth_failures, 1);
+}
+
+
+
+static void
+cowmail_metrics_timer_get (cowmail_metrics_atomic_timer *timer,
+                           cowmail_metrics_timer        *result)
+{
+  result->count = cowmail_metrics_load (&timer->count);
+  result->errors = cowmail_metrics_load (&timer->errors);
+  result->time = cowmail_metrics_load (&timer->time);
+  result->max_time = cowmail_metrics_load (&timer->max_time);
+}
+
+
+
+void
+cowmail_metrics_get (cowmail_metrics *metrics)
+{
+  for (guint c = 0; c < COWMAIL_METRICS_COMMANDS; c++)
+    cowmail_metrics_timer_get (&counters.commands[c], &metrics->commands[c]);
+  cowmail_metrics_timer_get (&counters.connects, &metrics->connects);
+  metrics->bytes_in = cowmail_metrics_load (&counters.bytes_in);
+  metrics->bytes_out = cowmail_metrics_load (&counters.bytes_out);
+  metrics->heads_scanned = cowmail_metrics_load (&counters.heads_scanned);
+  metrics->heads_skipped = cowmail_metrics_load (&counters.heads_skipped);
+  metrics->heads_matched = cowmail_metrics_load (&counters.heads_matched);
+  metrics->scan_time = cowmail_metrics_load (&counters.scan_time);
+  metrics->auth_failures = cowmail_metrics_load (&counters.auth_failures);
+}
+
+
+
+static void
+cowmail_metrics_timer_reset (cowmail_metrics_atomic_timer *timer)
+{
+  atomic_store_explicit (&timer->count, 0, memory_order_relaxed);
+  atomic_store_explicit (&timer->errors, 0, memory_order_relaxed);
+  atomic_store_explicit (&timer->time, 0, memory_order_relaxed);
+  atomic_store_explicit (&timer->max_time, 0, memory_order_relaxed);
+}
+
+
+
+void
+cowmail_metrics_reset (void)
+{
+  for (guint c = 0; c < COWMAIL_METRICS_COMMANDS; c++)
+    cowmail_metrics_timer_reset (&counters.commands[c]);
+  cowmail_metrics_timer_reset (&counters.connects);
+  atomic_store_explicit (&counters.bytes_in, 0, memory_order_relaxed);
+  atomic_store_explicit (&counters.bytes_out, 0, memory_order_relaxed);
+  atomic_store_explicit (&counters.heads_scanned, 0, memory_order_relaxed);
+  atomic_store_explicit (&counters.heads_skipped, 0, memory_order_relaxed);
+  atomic_store_explicit (&counters.heads_matched, 0, memory_order_relaxed);
+  atomic_store_explicit (&counters.scan_time, 0, memory_order_relaxed);
+  atomic_store_explicit (&counters.auth_failures, 0, memory_order_relaxed);
+}
+
+
+
+static void
+cowmail_metrics_timer_json (GString                     *json,
+                            const gchar                 *name,
+                            const cowmail_metrics_timer *timer)
+{
+  g_string_append_printf (json, "\"%s\": { \"count\": %" G_GUINT64_FORMAT ", \"errors\": %" G_GUINT64_FORMAT
+                          ", \"time_us\": %" G_GUINT64_FORMAT ", \"mean_us\": %" G_GUINT64_FORMAT
+                          ", \"max_us\": %" G_GUINT64_FORMAT " }",
+                          name, timer->count, timer->errors, timer->time,
+                          timer->count ? timer->time / timer->count : 0, timer->max_time);
+}
+
+
+
+gchar *
+cowmail_metrics_to_json (void)
+{
+  cowmail_metrics metrics;
+  cowmail_metrics_get (&metrics);
+  GString *json = g_string_new ("{\n  \"commands\": {\n");
+  for (guint c = 0; c < COWMAIL_METRICS_COMMANDS; c++) {
+    g_string_append (json, "    ");
+    cowmail_metrics_timer_json (json, command_names[c], &metrics.commands[c]);
+    g_string_append (json, c + 1 < COWMAIL_METRICS_COMMANDS ? ",\n" : "\n");
+  }
+  g_string_append (json, "  },\n  ");
+  cowmail_metrics_timer_json (json, "connects", &metrics.connects);
+
+  /* the scan rate includes the heads that the seen sets let the scan skip */
+  guint64 rate = metrics.scan_time ? metrics.heads_scanned * G_USEC_PER_SEC / metrics.scan_time : 0;
+  g_string_append_printf (json, ",\n  \"bytes_in\": %" G_GUINT64_FORMAT ",\n  \"bytes_out\": %" G_GUINT64_FORMAT
+                          ",\n  \"heads_scanned\": %" G_GUINT64_FORMAT ",\n  \"heads_skipped\": %" G_GUINT64_FORMAT
+                          ",\n  \"heads_matched\": %" G_GUINT64_FORMAT ",\n  \"scan_time_us\": %" G_GUINT64_FORMAT
+                          ",\n  \"scan_heads_per_sec\": %" G_GUINT64_FORMAT ",\n  \"auth_failures\": %" G_GUINT64_FORMAT
+                          "\n}\n",
+                          metrics.bytes_in, metrics.bytes_out, metrics.heads_scanned, metrics.heads_skipped,
+                          metrics.heads_matched, metrics.scan_time, rate, metrics.auth_failures);
+  return g_string_free (json, FALSE);
+}
+
+
+
+static void
+cowmail_metrics_dump (void)
+{
+  g_autoptr (GError) error = NULL;
+  const gchar *path = g_getenv (COWMAIL_METRICS_ENV);
+  g_autofree gchar *json = cowmail_metrics_to_json ();
+  if (g_strcmp0 (path, "-") == 0)
+    g_printerr ("%s", json);
+  else if (!g_file_set_contents (path, json, -1, &error))
+    g_printerr ("COWMAIL ERROR METRICS: %s\n", error->message);
+}
+
+
+
+void
+cowmail_metrics_init (void)
+{
+  static gsize initialized = 0;
+
+  if (g_once_init_enter (&initialized)) {
+    const gchar *path = g_getenv (COWMAIL_METRICS_ENV);
+    if (path && *path)
+      atexit (cowmail_metrics_dump);
+    g_once_init_leave (&initialized, 1);
+  }
+}
@@ -0,0 +1,148 @@
+/* cowmail-metrics.h
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+/* environment variable naming a file to dump the metrics to at exit, "-" for stderr */
+#define COWMAIL_METRICS_ENV "COWMAIL_METRICS"
+
+
+
+typedef enum
+{
+  COWMAIL_METRICS_PUT,
+  COWMAIL_METRICS_LIST,
+  COWMAIL_METRICS_GET,
+  COWMAIL_METRICS_COMMANDS
+} cowmail_metrics_command;
+
+
+
+/* times in microseconds */
+typedef struct
+{
+  guint64 count;
+  guint64 errors;
+  guint64 time;
+  guint64 max_time;
+} cowmail_metrics_timer;
+
+
+
+typedef struct
+{
+  cowmail_metrics_timer commands[COWMAIL_METRICS_COMMANDS];
+  cowmail_metrics_timer connects;
+  guint64               bytes_in;
+  guint64               bytes_out;
+  guint64               heads_scanned;
+  guint64               heads_skipped;
+  guint64               heads_matched;
+  guint64               scan_time;
+  guint64               auth_failures;
+} cowmail_metrics;
+
+
+
+/**
+ * cowmail_metrics_get:
+ * @metrics: return location for the metrics
+ *
+ * Copies the counters of libcowmail since the start of the process or the last
+ * cowmail_metrics_reset(). Each counter is read atomically, but the copy is
+ * not a consistent snapshot of all of them while requests are running.
+ */
+void               cowmail_metrics_get     (cowmail_metrics       *metrics);
+
+/**
+ * cowmail_metrics_reset:
+ *
+ * Sets all counters to zero.
+ */
+void               cowmail_metrics_reset   (void);
+
+/**
+ * cowmail_metrics_to_json:
+ *
+ * Returns: the current metrics as a JSON object, including the scan rate in
+ * heads per second
+ */
+gchar             *cowmail_metrics_to_json (void);
+
+/**
+ * cowmail_metrics_init:
+ *
+ * Arranges for the metrics to be dumped at exit if COWMAIL_METRICS_ENV is set.
+ * libcowmail calls this before its first connection, so applications do not
+ * need to.
+ */
+void               cowmail_metrics_init    (void);
+
+
+
+/*
+ * Recording, used by libcowmail. Every function is a few relaxed atomic
+ * operations, safe to call from any thread.
+ */
+
+/**
+ * cowmail_metrics_record:
+ * @command: the command
+ * @start: g_get_monotonic_time() when the request started
+ * @ok: whether the request succeeded
+ */
+void               cowmail_metrics_record  (cowmail_metrics_command command,
+                                            gint64                  start,
+                                            gboolean                ok);
+
+/**
+ * cowmail_metrics_connect:
+ * @start: g_get_monotonic_time() when the connection setup started
+ * @ok: whether the connection was established
+ */
+void               cowmail_metrics_connect (gint64                 start,
+                                            gboolean               ok);
+
+/**
+ * cowmail_metrics_bytes:
+ * @in: bytes received from a server
+ * @out: bytes sent to a server
+ */
+void               cowmail_metrics_bytes   (guint64                in,
+                                            guint64                out);
+
+/**
+ * cowmail_metrics_scan:
+ * @scanned: number of heads scanned
+ * @skipped: number of trial decryptions skipped because the identity had seen the head before
+ * @matched: number of heads that belong to an identity
+ * @start: g_get_monotonic_time() when the scan started
+ */
+void               cowmail_metrics_scan    (guint64                scanned,
+                                            guint64                skipped,
+                                            guint64                matched,
+                                            gint64                 start);
+
+/**
+ * cowmail_metrics_auth_failure:
+ *
+ * Counts a message body whose authentication tag or hash did not match.
+ */
+void               cowmail_metrics_auth_failure (void);
@@ -0,0 +1,368 @@
+/* cowmail-outbox.c
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cowmail-outbox.h"
+#include "cowmail-client.h"
+
+
+
+typedef struct
+{
+  GFile   *file;
+  gchar   *server;
+  GBytes  *msg;
+  guint    attempts;
+  gint64   next_try;
+} cowmail_outbox_entry;
+
+
+
+struct _cowmail_outbox
+{
+  GFile   *dir;
+  GThread *thread;
+  GMutex   mutex;
+  GCond    cond;
+  GList   *queue;
+  guint    failed;
+  gboolean stop;
+
+  cowmail_outbox_failed_func failed_func;
+  gpointer                   failed_data;
+};
+
+
+
+/* a failed message on its way to the main context */
+typedef struct
+{
+  cowmail_outbox_failed_func func;
+  gpointer                   userdata;
+  gchar                     *server;
+  guchar                     status;
+} cowmail_outbox_report;
+
+
+
+static void
+cowmail_outbox_entry_free (cowmail_outbox_entry *entry)
+{
+  g_object_unref (entry->file);
+  g_free (entry->server);
+  g_bytes_unref (entry->msg);
+  g_free (entry);
+}
+
+
+
+/*
+ * A queued message is stored as the server name, a newline and the encrypted
+ * message. It is encrypted for the recipient already, so it is safe at rest.
+ */
+static cowmail_outbox_entry *
+cowmail_outbox_entry_load (GFile *file)
+{
+  g_autoptr (GError) error = NULL;
+  gchar *data;
+  gsize len;
+  if (!g_file_load_contents (file, NULL, &data, &len, NULL, &error)) {
+    g_printerr ("COWMAIL ERROR OUTBOX: %s\n", error->message);
+    return NULL;
+  }
+
+  gchar *eol = memchr (data, '\n', len);
+  if (!eol) {
+    g_autofree gchar *fname = g_file_get_basename (file);
+    g_printerr ("COWMAIL ERROR OUTBOX: Invalid file: %s\n", fname);
+    g_free (data);
+    return NULL;
+  }
+
+  cowmail_outbox_entry *entry = g_new0 (cowmail_outbox_entry, 1);
+  entry->file = g_object_ref (file);
+  entry->server = g_strndup (data, eol - data);
+  entry->msg = g_bytes_new (eol + 1, len - (eol + 1 - data));
+  g_free (data);
+  return entry;
+}
+
+
+
+static gint
+cowmail_outbox_entry_compare (gconstpointer a,
+                              gconstpointer b)
+{
+  g_autofree gchar *aname = g_file_get_basename (((cowmail_outbox_entry *) a)->file);
+  g_autofree gchar *bname = g_file_get_basename (((cowmail_outbox_entry *) b)->file);
+  return g_strcmp0 (aname, bname);
+}
+
+
+
+/* rejections that a retry would get again */
+static gboolean
+cowmail_outbox_is_permanent (guchar status)
+{
+  return status == COWMAIL_STATUS_BAD_REQUEST ||
+         status == COWMAIL_STATUS_TOO_LARGE ||
+         status == COWMAIL_STATUS_UNSUPPORTED;
+}
+
+
+
+static gboolean
+cowmail_outbox_report_run (gpointer data)
+{
+  cowmail_outbox_report *report = data;
+  report->func (report->server, report->status, report->userdata);
+  return G_SOURCE_REMOVE;
+}
+
+
+
+static void
+cowmail_outbox_report_free (gpointer data)
+{
+  cowmail_outbox_report *report = data;
+  g_free (report->server);
+  g_free (report);
+}
+
+
+
+/* keeps the message as failed, so that it is not queued again, and reports it */
+static void
+cowmail_outbox_fail (cowmail_outbox       *outbox,
+                     cowmail_outbox_entry *entry,
+                     guchar                status)
+{
+  g_autoptr (GError) error = NULL;
+  g_autofree gchar *fname = g_file_get_basename (entry->file);
+  g_autofree gchar *failed = g_strconcat (fname, ".failed", NULL);
+  g_autoptr (GFile) file = g_file_get_child (outbox->dir, failed);
+  if (!g_file_move (entry->file, file, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL, &error))
+    g_printerr ("COWMAIL ERROR OUTBOX: %s\n", error->message);
+  g_printerr ("COWMAIL ERROR OUTBOX: %s rejected %s: %s.\n", entry->server, fname, cowmail_status_message (status));
+
+  outbox->failed++;
+  if (outbox->failed_func) {
+    cowmail_outbox_report *report = g_new0 (cowmail_outbox_report, 1);
+    report->func = outbox->failed_func;
+    report->userdata = outbox->failed_data;
+    report->server = g_strdup (entry->server);
+    report->status = status;
+    g_main_context_invoke_full (NULL, G_PRIORITY_DEFAULT, cowmail_outbox_report_run, report,
+                                cowmail_outbox_report_free);
+  }
+}
+
+
+
+/* puts one batch of messages for one server and updates the queue */
+static void
+cowmail_outbox_send (cowmail_outbox *outbox,
+                     GPtrArray      *batch)
+{
+  cowmail_outbox_entry *first = g_ptr_array_index (batch, 0);
+  g_autofree GBytes **msgs = g_new (GBytes *, batch->len);
+  g_autofree guchar *status = g_new0 (guchar, batch->len);
+  for (guint i = 0; i < batch->len; i++)
+    msgs[i] = ((cowmail_outbox_entry *) g_ptr_array_index (batch, i))->msg;
+
+  g_autoptr (GError) error = NULL;
+  cowmail_client_put_many (cowmail_client_lookup (first->server), msgs, batch->len, status, NULL, &error);
+
+  g_mutex_lock (&outbox->mutex);
+  gint64 now = g_get_monotonic_time ();
+  for (guint i = 0; i < batch->len; i++) {
+    cowmail_outbox_entry *entry = g_ptr_array_index (batch, i);
+    if (status[i] == COWMAIL_STATUS_OK || cowmail_outbox_is_permanent (status[i])) {
+      outbox->queue = g_list_remove (outbox->queue, entry);
+      if (status[i] == COWMAIL_STATUS_OK)
+        g_file_delete (entry->file, NULL, NULL);
+      else
+        cowmail_outbox_fail (outbox, entry, status[i]);
+      cowmail_outbox_entry_free (entry);
+    } else if (status[i] == COWMAIL_STATUS_SENT) {
+      /* sent again once the server may know sessions, a replay is stored only once */
+      entry->next_try = now + COWMAIL_LEGACY_TTL * G_USEC_PER_SEC;
+    } else {
+      gint64 delay = (gint64) COWMAIL_OUTBOX_RETRY_MIN << MIN (entry->attempts, 16);
+      entry->attempts++;
+      entry->next_try = now + MIN (delay, COWMAIL_OUTBOX_RETRY_MAX) * G_USEC_PER_SEC;
+    }
+  }
+  g_mutex_unlock (&outbox->mutex);
+}
+
+
+
+static gpointer
+cowmail_outbox_run (gpointer data)
+{
+  cowmail_outbox *outbox = data;
+
+  g_mutex_lock (&outbox->mutex);
+  while (!outbox->stop) {
+    /* collect due messages for the server of the oldest due message */
+    gint64 now = g_get_monotonic_time ();
+    gint64 wakeup = G_MAXINT64;
+    g_autoptr (GPtrArray) batch = g_ptr_array_new ();
+    const gchar *server = NULL;
+    for (GList *e = outbox->queue; e && batch->len < COWMAIL_OUTBOX_BATCH; e = e->next) {
+      cowmail_outbox_entry *entry = e->data;
+      if (entry->next_try > now) {
+        wakeup = MIN (wakeup, entry->next_try);
+      } else if (!server || g_str_equal (server, entry->server)) {
+        g_ptr_array_add (batch, entry);
+        server = entry->server;
+      }
+    }
+
+    if (batch->len == 0) {
+      if (wakeup == G_MAXINT64)
+        g_cond_wait (&outbox->cond, &outbox->mutex);
+      else
+        g_cond_wait_until (&outbox->cond, &outbox->mutex, wakeup);
+      continue;
+    }
+
+    /* only this thread removes entries, so they stay valid while unlocked */
+    g_mutex_unlock (&outbox->mutex);
+    cowmail_outbox_send (outbox, batch);
+    g_mutex_lock (&outbox->mutex);
+  }
+  g_mutex_unlock (&outbox->mutex);
+  return NULL;
+}
+
+
+
+cowmail_outbox *
+cowmail_outbox_new (GFile *dir)
+{
+  cowmail_outbox *outbox = g_new0 (cowmail_outbox, 1);
+  outbox->dir = g_object_ref (dir);
+  g_mutex_init (&outbox->mutex);
+  g_cond_init (&outbox->cond);
+  g_file_make_directory_with_parents (dir, NULL, NULL);
+
+  g_autoptr (GFileEnumerator) files = g_file_enumerate_children (dir, G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                                                G_FILE_QUERY_INFO_NONE, NULL, NULL);
+  GFileInfo *info;
+  GFile *file;
+  while (files && g_file_enumerator_iterate (files, &info, &file, NULL, NULL) && info) {
+    if (g_str_has_suffix (g_file_info_get_name (info), ".failed")) {
+      outbox->failed++;
+      continue;
+    }
+    cowmail_outbox_entry *entry = cowmail_outbox_entry_load (file);
+    if (entry)
+      outbox->queue = g_list_prepend (outbox->queue, entry);
+  }
+  outbox->queue = g_list_sort (outbox->queue, cowmail_outbox_entry_compare);
+
+  outbox->thread = g_thread_new ("cowmail-outbox", cowmail_outbox_run, outbox);
+  return outbox;
+}
+
+
+
+void
+cowmail_outbox_put (cowmail_outbox   *outbox,
+                    const gchar      *server,
+                    const gchar      *msg,
+                    const cowmail_id *contact)
+{
+  g_autoptr (GError) error = NULL;
+  cowmail_outbox_entry *entry = g_new0 (cowmail_outbox_entry, 1);
+  entry->server = g_strdup (server);
+  entry->msg = cowmail_msg_encrypt (msg, contact);
+
+  /* file names sort in queue order */
+  g_autofree gchar *fname = g_strdup_printf ("%016" G_GINT64_MODIFIER "x-%08x.msg", g_get_real_time (), g_random_int ());
+  entry->file = g_file_get_child (outbox->dir, fname);
+
+  gsize len;
+  const guchar *data = g_bytes_get_data (entry->msg, &len);
+  g_autoptr (GByteArray) contents = g_byte_array_new ();
+  g_byte_array_append (contents, (guchar *) server, strlen (server));
+  g_byte_array_append (contents, (guchar *) "\n", 1);
+  g_byte_array_append (contents, data, len);
+  if (!g_file_replace_contents (entry->file, (gchar *) contents->data, contents->len, NULL, FALSE,
+                                G_FILE_CREATE_PRIVATE, NULL, NULL, &error))
+    g_printerr ("COWMAIL ERROR OUTBOX: %s\n", error->message);
+
+  g_mutex_lock (&outbox->mutex);
+  outbox->queue = g_list_append (outbox->queue, entry);
+  g_cond_signal (&outbox->cond);
+  g_mutex_unlock (&outbox->mutex);
+}
+
+
+
+guint
+cowmail_outbox_pending (cowmail_outbox *outbox)
+{
+  g_mutex_lock (&outbox->mutex);
+  guint n = g_list_length (outbox->queue);
+  g_mutex_unlock (&outbox->mutex);
+  return n;
+}
+
+
+
+guint
+cowmail_outbox_failed (cowmail_outbox *outbox)
+{
+  g_mutex_lock (&outbox->mutex);
+  guint n = outbox->failed;
+  g_mutex_unlock (&outbox->mutex);
+  return n;
+}
+
+
+
+void
+cowmail_outbox_set_failed_func (cowmail_outbox             *outbox,
+                                cowmail_outbox_failed_func  func,
+                                gpointer                    userdata)
+{
+  g_mutex_lock (&outbox->mutex);
+  outbox->failed_func = func;
+  outbox->failed_data = userdata;
+  g_mutex_unlock (&outbox->mutex);
+}
+
+
+
+void
+cowmail_outbox_free (cowmail_outbox *outbox)
+{
+  g_mutex_lock (&outbox->mutex);
+  outbox->stop = TRUE;
+  g_cond_signal (&outbox->cond);
+  g_mutex_unlock (&outbox->mutex);
+  g_thread_join (outbox->thread);
+
+  g_list_free_full (outbox->queue, (GDestroyNotify) cowmail_outbox_entry_free);
+  g_mutex_clear (&outbox->mutex);
+  g_cond_clear (&outbox->cond);
+  g_object_unref (outbox->dir);
+  g_free (outbox);
+}
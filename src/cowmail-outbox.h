@@ -0,0 +1,114 @@
+/* cowmail-outbox.h
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "libcowmail.h"
+
+/* maximum number of messages sent to one server per connection */
+#define COWMAIL_OUTBOX_BATCH       256
+/* first and maximum delay before a failed message is retried, in seconds */
+#define COWMAIL_OUTBOX_RETRY_MIN   1
+#define COWMAIL_OUTBOX_RETRY_MAX   300
+
+
+
+typedef struct _cowmail_outbox cowmail_outbox;
+
+/**
+ * cowmail_outbox_failed_func:
+ * @server: the server that rejected the message
+ * @status: the COWMAIL_STATUS_* it was rejected with
+ * @userdata: user data
+ *
+ * Called in the main context for a message that a server will never accept.
+ */
+typedef void     (*cowmail_outbox_failed_func) (const gchar       *server,
+                                                guchar             status,
+                                                gpointer           userdata);
+
+
+
+/**
+ * cowmail_outbox_new:
+ * @dir: directory to keep queued messages in
+ *
+ * Creates an outbox and starts its sender thread. Messages left in @dir by a
+ * previous run are queued again.
+ *
+ * Returns: the outbox
+ */
+cowmail_outbox    *cowmail_outbox_new      (GFile                 *dir);
+
+/**
+ * cowmail_outbox_put:
+ * @outbox: the outbox
+ * @server: server to put the message to, may include a port (default: 1337)
+ * @msg: the message to be put
+ * @contact: the recipient's cowmail identity
+ *
+ * Encrypts a message, stores it in the outbox directory and queues it. Does not
+ * block on the network: the sender thread puts queued messages in batches per
+ * server over one session and retries with backoff until the server
+ * acknowledges them. Messages sent to a server without sessions are kept and
+ * sent again every COWMAIL_LEGACY_TTL seconds, since it never acknowledges
+ * them. Messages the server rejects for good, because they are
+ * too large, malformed or ask for a stamp the client cannot solve, are not
+ * retried: their file is kept with the suffix ".failed" and they are reported
+ * to the function set with cowmail_outbox_set_failed_func().
+ */
+void               cowmail_outbox_put      (cowmail_outbox        *outbox,
+                                            const gchar           *server,
+                                            const gchar           *msg,
+                                            const cowmail_id      *contact);
+
+/**
+ * cowmail_outbox_pending:
+ * @outbox: the outbox
+ *
+ * Returns: the number of messages not yet acknowledged by their server
+ */
+guint              cowmail_outbox_pending  (cowmail_outbox        *outbox);
+
+/**
+ * cowmail_outbox_failed:
+ * @outbox: the outbox
+ *
+ * Returns: the number of messages that failed for good, including those of
+ * previous runs
+ */
+guint              cowmail_outbox_failed   (cowmail_outbox        *outbox);
+
+/**
+ * cowmail_outbox_set_failed_func:
+ * @outbox: the outbox
+ * @func: (nullable): called for every message that fails from now on
+ * @userdata: user data for @func
+ */
+void               cowmail_outbox_set_failed_func (cowmail_outbox            *outbox,
+                                                   cowmail_outbox_failed_func  func,
+                                                   gpointer                    userdata);
+
+/**
+ * cowmail_outbox_free:
+ * @outbox: the outbox
+ *
+ * Stops the sender thread and frees the outbox. Queued messages stay in the
+ * outbox directory.
+ */
+void               cowmail_outbox_free     (cowmail_outbox        *outbox);
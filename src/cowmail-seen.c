@@ -0,0 +1,413 @@
+/* cowmail-seen.c
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cowmail-seen.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define COWMAIL_SEEN_MAGIC "COWSEEN2"
+/* the stages start at a page boundary of any system, so that each is mapped on its own */
+#define COWMAIL_SEEN_HEADER_SIZE 65536
+/* the last stage holds 2^47 heads, which is more than any server has */
+#define COWMAIL_SEEN_STAGES_MAX  32
+
+
+
+typedef struct
+{
+  guint64  capacity;
+  guint64  count;
+  guint64 *bits;
+  gsize    size;
+  gboolean dirty;
+} cowmail_seen_stage;
+
+
+
+struct _cowmail_seen
+{
+  GPtrArray  *stages;
+  GHashTable *matched;
+  GPtrArray  *unstored;
+  GRWLock     lock;
+
+  /* the stage file, -1 if the set only lives in memory */
+  gchar      *filename;
+  gint        fd;
+  guint64     file_end;
+};
+
+
+
+static guint
+cowmail_seen_hash (gconstpointer key)
+{
+  guint h;
+  memcpy (&h, key, sizeof (h));
+  return h;
+}
+
+
+
+static gboolean
+cowmail_seen_equal (gconstpointer a,
+                    gconstpointer b)
+{
+  return memcmp (a, b, COWMAIL_KEY_SIZE) == 0;
+}
+
+
+
+static void
+cowmail_seen_stage_free (cowmail_seen_stage *stage)
+{
+  munmap (stage->bits, stage->size);
+  g_free (stage);
+}
+
+
+
+/*
+ * Maps the next stage, from the file if there is one. Stage s has
+ * COWMAIL_SEEN_STAGE_MIN << s heads and follows the stages before it.
+ */
+static cowmail_seen_stage *
+cowmail_seen_stage_map (cowmail_seen *seen,
+                        gboolean      create)
+{
+  guint s = seen->stages->len;
+  if (s >= COWMAIL_SEEN_STAGES_MAX || (guint64) COWMAIL_SEEN_STAGE_MIN << s > G_MAXSIZE / COWMAIL_SEEN_BITS)
+    return NULL;
+  guint64 capacity = (guint64) COWMAIL_SEEN_STAGE_MIN << s;
+  gsize size = capacity * COWMAIL_SEEN_BITS / 8;
+
+  gpointer bits = MAP_FAILED;
+  if (seen->fd >= 0 && (!create || ftruncate (seen->fd, seen->file_end + size) == 0))
+    bits = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, seen->fd, seen->file_end);
+  if (bits == MAP_FAILED && seen->fd >= 0) {
+    g_printerr ("COWMAIL ERROR: %s: %s\n", seen->filename, g_strerror (errno));
+    close (seen->fd);
+    seen->fd = -1;
+    if (!create)
+      return NULL;
+  }
+  /* without a file, the set works for this run only */
+  if (bits == MAP_FAILED)
+    bits = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (bits == MAP_FAILED)
+    return NULL;
+
+  cowmail_seen_stage *stage = g_new0 (cowmail_seen_stage, 1);
+  stage->capacity = capacity;
+  stage->bits = bits;
+  stage->size = size;
+  stage->dirty = create;
+  seen->file_end += size;
+  g_ptr_array_add (seen->stages, stage);
+  return stage;
+}
+
+
+
+static cowmail_seen *
+cowmail_seen_new (void)
+{
+  cowmail_seen *seen = g_new0 (cowmail_seen, 1);
+  seen->stages = g_ptr_array_new_with_free_func ((GDestroyNotify) cowmail_seen_stage_free);
+  seen->matched = g_hash_table_new_full (cowmail_seen_hash, cowmail_seen_equal, g_free, NULL);
+  seen->unstored = g_ptr_array_new ();
+  seen->fd = -1;
+  seen->file_end = COWMAIL_SEEN_HEADER_SIZE;
+  g_rw_lock_init (&seen->lock);
+  return seen;
+}
+
+
+
+/*
+ * The key A is a fresh curve25519 public key, so its first 16 bytes are two
+ * uniformly distributed words that serve directly for double hashing.
+ */
+static void
+cowmail_seen_probe (const guchar *head,
+                    guint64      *h1,
+                    guint64      *h2)
+{
+  memcpy (h1, head, sizeof (*h1));
+  memcpy (h2, head + sizeof (*h1), sizeof (*h2));
+  *h1 = GUINT64_FROM_LE (*h1);
+  *h2 = GUINT64_FROM_LE (*h2) | 1;
+}
+
+
+
+/* the words of the filter are little endian, as they are in the file */
+static gboolean
+cowmail_seen_stage_contains (const cowmail_seen_stage *stage,
+                             guint64                   h1,
+                             guint64                   h2)
+{
+  guint64 mask = stage->capacity * COWMAIL_SEEN_BITS - 1;
+  for (guint i = 0; i < COWMAIL_SEEN_HASHES; i++) {
+    guint64 bit = (h1 + i * h2) & mask;
+    if (!(GUINT64_FROM_LE (stage->bits[bit / 64]) & G_GUINT64_CONSTANT (1) << (bit % 64)))
+      return FALSE;
+  }
+  return TRUE;
+}
+
+
+
+gboolean
+cowmail_seen_skip (cowmail_seen *seen,
+                   const guchar *head)
+{
+  guint64 h1, h2;
+  cowmail_seen_probe (head, &h1, &h2);
+  for (guint s = 0; s < seen->stages->len; s++)
+    if (cowmail_seen_stage_contains (g_ptr_array_index (seen->stages, s), h1, h2))
+      return !g_hash_table_contains (seen->matched, head);
+  return FALSE;
+}
+
+
+
+void
+cowmail_seen_read_lock (cowmail_seen *seen)
+{
+  g_rw_lock_reader_lock (&seen->lock);
+}
+
+
+
+void
+cowmail_seen_read_unlock (cowmail_seen *seen)
+{
+  g_rw_lock_reader_unlock (&seen->lock);
+}
+
+
+
+/*
+ * Matched heads are never skipped, so they only go to the exact set. Keeping
+ * them out of the filter also means that a filter that reached the disk before
+ * the matched keys did cannot hide a message.
+ */
+static void
+cowmail_seen_add_locked (cowmail_seen *seen,
+                         const guchar *head,
+                         gboolean      matched)
+{
+  if (matched) {
+    if (!g_hash_table_contains (seen->matched, head)) {
+      guchar *key = g_malloc (COWMAIL_KEY_SIZE);
+      memcpy (key, head, COWMAIL_KEY_SIZE);
+      g_hash_table_add (seen->matched, key);
+      g_ptr_array_add (seen->unstored, key);
+    }
+    return;
+  }
+
+  guint64 h1, h2;
+  cowmail_seen_probe (head, &h1, &h2);
+  for (guint s = 0; s < seen->stages->len; s++)
+    if (cowmail_seen_stage_contains (g_ptr_array_index (seen->stages, s), h1, h2))
+      return;
+
+  /* a full stage would exceed its false positive rate, so start a larger one */
+  cowmail_seen_stage *stage = seen->stages->len ? g_ptr_array_index (seen->stages, seen->stages->len - 1) : NULL;
+  if (!stage || stage->count == stage->capacity)
+    stage = cowmail_seen_stage_map (seen, TRUE);
+  if (!stage)
+    return;
+  guint64 mask = stage->capacity * COWMAIL_SEEN_BITS - 1;
+  for (guint i = 0; i < COWMAIL_SEEN_HASHES; i++) {
+    guint64 bit = (h1 + i * h2) & mask;
+    stage->bits[bit / 64] |= GUINT64_TO_LE (G_GUINT64_CONSTANT (1) << (bit % 64));
+  }
+  stage->count++;
+  stage->dirty = TRUE;
+}
+
+
+
+void
+cowmail_seen_add (cowmail_seen *seen,
+                  const guchar *head,
+                  gboolean      matched)
+{
+  g_rw_lock_writer_lock (&seen->lock);
+  cowmail_seen_add_locked (seen, head, matched);
+  g_rw_lock_writer_unlock (&seen->lock);
+}
+
+
+
+/* the matched keys are appended to a file of their own, a torn key at the end is ignored */
+static void
+cowmail_seen_load_matched (cowmail_seen *seen)
+{
+  g_autofree gchar *fname = g_strconcat (seen->filename, ".matched", NULL);
+  g_autofree gchar *data = NULL;
+  gsize len;
+  if (!g_file_get_contents (fname, &data, &len, NULL))
+    return;
+  for (gsize i = 0; i + COWMAIL_KEY_SIZE <= len; i += COWMAIL_KEY_SIZE) {
+    guchar *key = g_malloc (COWMAIL_KEY_SIZE);
+    memcpy (key, data + i, COWMAIL_KEY_SIZE);
+    g_hash_table_add (seen->matched, key);
+  }
+}
+
+
+
+/*
+ * The file starts with a header of COWMAIL_SEEN_HEADER_SIZE bytes: the magic,
+ * the number of stages (4 bytes) and 4 reserved bytes, then the count of each
+ * stage (8 bytes each). The stages follow, see cowmail_seen_stage_map(). All
+ * integers are little endian.
+ */
+cowmail_seen *
+cowmail_seen_load (GFile *file)
+{
+  cowmail_seen *seen = cowmail_seen_new ();
+  seen->filename = g_file_get_path (file);
+  g_autofree gchar *dir = g_path_get_dirname (seen->filename);
+  g_mkdir_with_parents (dir, 0700);
+  seen->fd = open (seen->filename, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (seen->fd < 0) {
+    g_printerr ("COWMAIL ERROR: %s: %s\n", seen->filename, g_strerror (errno));
+    return seen;
+  }
+  cowmail_seen_load_matched (seen);
+
+  struct stat st;
+  guchar header[16];
+  guint32 nstages = 0;
+  g_autofree guint64 *counts = NULL;
+  if (fstat (seen->fd, &st) < 0 || st.st_size == 0)
+    return seen;
+  if (pread (seen->fd, header, sizeof (header), 0) < (gssize) sizeof (header) ||
+      memcmp (header, COWMAIL_SEEN_MAGIC, 8) != 0)
+    goto invalid;
+  memcpy (&nstages, header + 8, sizeof (nstages));
+  nstages = GUINT32_FROM_LE (nstages);
+  if (nstages > COWMAIL_SEEN_STAGES_MAX)
+    goto invalid;
+
+  /* check the sizes of all stages against the file before mapping any */
+  guint64 total = COWMAIL_SEEN_HEADER_SIZE;
+  for (guint32 s = 0; s < nstages; s++) {
+    if ((guint64) COWMAIL_SEEN_STAGE_MIN << s > G_MAXSIZE / COWMAIL_SEEN_BITS)
+      goto invalid;
+    total += ((guint64) COWMAIL_SEEN_STAGE_MIN << s) * COWMAIL_SEEN_BITS / 8;
+  }
+  counts = g_new0 (guint64, MAX (nstages, 1));
+  if (total > (guint64) st.st_size ||
+      pread (seen->fd, counts, nstages * sizeof (guint64), 16) < (gssize) (nstages * sizeof (guint64)))
+    goto invalid;
+
+  for (guint32 s = 0; s < nstages; s++) {
+    cowmail_seen_stage *stage = cowmail_seen_stage_map (seen, FALSE);
+    if (!stage)
+      break;
+    stage->count = MIN (GUINT64_FROM_LE (counts[s]), stage->capacity);
+  }
+  return seen;
+
+invalid:
+  {
+    g_autofree gchar *fname = g_file_get_basename (file);
+    g_printerr ("COWMAIL ERROR: Invalid seen heads file, starting over: %s\n", fname);
+  }
+  /* the set only saves work, so an empty one is always safe */
+  if (ftruncate (seen->fd, 0) < 0)
+    g_printerr ("COWMAIL ERROR: %s: %s\n", seen->filename, g_strerror (errno));
+  return seen;
+}
+
+
+
+/* writes the stages and counts that changed, and appends the new matched keys */
+void
+cowmail_seen_store (cowmail_seen *seen)
+{
+  g_rw_lock_writer_lock (&seen->lock);
+  if (seen->fd < 0) {
+    g_rw_lock_writer_unlock (&seen->lock);
+    return;
+  }
+
+  if (seen->unstored->len > 0) {
+    g_autofree gchar *fname = g_strconcat (seen->filename, ".matched", NULL);
+    gint fd = open (fname, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    gboolean ok = fd >= 0;
+    for (guint i = 0; i < seen->unstored->len && ok; i++)
+      ok = write (fd, g_ptr_array_index (seen->unstored, i), COWMAIL_KEY_SIZE) == COWMAIL_KEY_SIZE;
+    if (ok && fdatasync (fd) == 0)
+      g_ptr_array_set_size (seen->unstored, 0);
+    else
+      g_printerr ("COWMAIL ERROR: %s: %s\n", fname, g_strerror (errno));
+    if (fd >= 0)
+      close (fd);
+  }
+
+  gboolean changed = FALSE;
+  for (guint s = 0; s < seen->stages->len; s++) {
+    cowmail_seen_stage *stage = g_ptr_array_index (seen->stages, s);
+    if (stage->dirty && msync (stage->bits, stage->size, MS_SYNC) == 0) {
+      stage->dirty = FALSE;
+      changed = TRUE;
+    }
+  }
+
+  if (changed) {
+    guint32 nstages = seen->stages->len;
+    gsize len = 16 + nstages * sizeof (guint64);
+    g_autofree guchar *header = g_malloc (len);
+    memcpy (header, COWMAIL_SEEN_MAGIC, 8);
+    guint32 lenstages = GUINT32_TO_LE (nstages);
+    memcpy (header + 8, &lenstages, sizeof (lenstages));
+    memset (header + 12, 0, 4);
+    for (guint32 s = 0; s < nstages; s++) {
+      guint64 count = GUINT64_TO_LE (((cowmail_seen_stage *) g_ptr_array_index (seen->stages, s))->count);
+      memcpy (header + 16 + s * sizeof (guint64), &count, sizeof (count));
+    }
+    if (pwrite (seen->fd, header, len, 0) != (gssize) len || fdatasync (seen->fd) < 0)
+      g_printerr ("COWMAIL ERROR: %s: %s\n", seen->filename, g_strerror (errno));
+  }
+  g_rw_lock_writer_unlock (&seen->lock);
+}
+
+
+
+void
+cowmail_seen_free (cowmail_seen *seen)
+{
+  g_ptr_array_unref (seen->stages);
+  g_ptr_array_unref (seen->unstored);
+  g_hash_table_unref (seen->matched);
+  if (seen->fd >= 0)
+    close (seen->fd);
+  g_rw_lock_clear (&seen->lock);
+  g_free (seen->filename);
+  g_free (seen);
+}
@@ -0,0 +1,103 @@
+/* cowmail-seen.h
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "libcowmail.h"
+
+/* filter bits per head and bits set per head, for a false positive rate of about 2^-22 */
+#define COWMAIL_SEEN_BITS      32
+#define COWMAIL_SEEN_HASHES    22
+/* number of heads the first filter stage holds, a power of two */
+#define COWMAIL_SEEN_STAGE_MIN 65536
+
+
+
+/**
+ * cowmail_seen_load:
+ * @file: file to keep the set in
+ *
+ * Loads the set of heads an identity has already scanned. It is a Bloom filter
+ * over the public key A at the start of each head that did not match, which
+ * grows by adding stages of twice the size, and an exact set of the keys of
+ * heads that matched. A head that is in the filter is skipped without any
+ * curve25519 operation. A false positive makes a new head look scanned, which
+ * happens for about one in four million new heads per stage.
+ *
+ * The stages are memory-mapped from @file, and the matched keys are appended to
+ * a file of the same name with the suffix ".matched".
+ *
+ * Returns: the set, empty if @file does not exist or is invalid
+ */
+cowmail_seen      *cowmail_seen_load       (GFile                 *file);
+
+/**
+ * cowmail_seen_store:
+ * @seen: the set
+ *
+ * Writes the stages that changed since the last call to the file the set was
+ * loaded from, and appends the new matched keys.
+ */
+void               cowmail_seen_store      (cowmail_seen          *seen);
+
+/**
+ * cowmail_seen_skip:
+ * @seen: the set
+ * @head: a message head
+ *
+ * Does not modify the set, so scan threads may call it concurrently while
+ * they hold cowmail_seen_read_lock().
+ *
+ * Returns: TRUE if the head was scanned before and did not match
+ */
+gboolean           cowmail_seen_skip       (cowmail_seen          *seen,
+                                            const guchar          *head);
+
+/**
+ * cowmail_seen_read_lock:
+ * @seen: the set
+ *
+ * Keeps cowmail_seen_add() from changing the set until
+ * cowmail_seen_read_unlock(). Any number of threads may hold the lock.
+ */
+void               cowmail_seen_read_lock  (cowmail_seen          *seen);
+
+/**
+ * cowmail_seen_read_unlock:
+ * @seen: the set
+ */
+void               cowmail_seen_read_unlock (cowmail_seen         *seen);
+
+/**
+ * cowmail_seen_add:
+ * @seen: the set
+ * @head: a message head that was scanned
+ * @matched: whether the head belongs to the identity
+ *
+ * Adds a scanned head to the set. Waits for the scans that hold
+ * cowmail_seen_read_lock(), so that scans of several servers can share the set.
+ */
+void               cowmail_seen_add        (cowmail_seen          *seen,
+                                            const guchar          *head,
+                                            gboolean               matched);
+
+/**
+ * cowmail_seen_free:
+ * @seen: the set
+ */
+void               cowmail_seen_free       (cowmail_seen          *seen);
@@ -0,0 +1,1288 @@
+/* cowmail-server.c
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cowmail-server.h"
+#include "cowmail-stamp.h"
+#include <errno.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifndef IPPROTO_SCTP
+#define IPPROTO_SCTP 132
+#endif
+
+#define COWMAIL_SERVER_EVENTS 256
+
+
+
+/*
+ * Reactors and connections.
+ */
+
+enum
+{
+  COWMAIL_HANDLE_WAKE,
+  COWMAIL_HANDLE_COMMIT,
+  COWMAIL_HANDLE_LISTENER,
+  COWMAIL_HANDLE_CONN,
+};
+
+enum
+{
+  COWMAIL_CONN_NEW,
+  COWMAIL_CONN_PUT,
+  COWMAIL_CONN_SESSION,
+  COWMAIL_CONN_DONE,
+};
+
+enum
+{
+  COWMAIL_REPLY_NONE,
+  COWMAIL_REPLY_LIST,
+  COWMAIL_REPLY_GET_MANY,
+};
+
+/* requests are queued for their turn per class */
+enum
+{
+  COWMAIL_CLASS_LIST,
+  COWMAIL_CLASS_GET,
+  COWMAIL_CLASS_PUT,
+  COWMAIL_CLASSES,
+};
+
+
+
+typedef struct _cowmail_reactor cowmail_reactor;
+
+
+
+/* every epoll registration points to a struct that starts with its kind */
+typedef struct
+{
+  gint     kind;
+  gint     fd;
+} cowmail_handle;
+
+
+
+typedef struct
+{
+  guchar  *data;
+  gsize    size;
+  gsize    start;
+  gsize    end;
+} cowmail_buffer;
+
+
+
+typedef struct
+{
+  cowmail_handle   handle;
+  cowmail_reactor *reactor;
+  gint             state;
+  guint32          events;
+  gboolean         eof;
+  /* destroyed, and freed once the events of the current batch are handled */
+  gboolean         dead;
+  guint16          version;
+  gboolean         stamps;
+
+  /* admission control, the source is unset for Unix sockets */
+  gboolean         remote;
+  guchar           source[COWMAIL_ADMISSION_ADDR_SIZE];
+  gint             klass;
+  GList           *queued;
+  /* the frame at the start of the input passed admission, or the rest of a refused one */
+  gboolean         checked;
+  gsize            discard;
+
+  /* monotonic time of the last event, for the idle timeout */
+  gint64           active;
+
+  /* replies wait for the store to commit the last PUT */
+  gboolean         committing;
+  guint64          commit_seq;
+  GList           *commit_link;
+
+  cowmail_buffer   in;
+  cowmail_buffer   out;
+
+  /* reply that is produced step by step as the socket drains */
+  gint             reply;
+  guint64          list_pos;
+  guint64          list_end;
+  guchar          *hashes;
+  guint            nhashes;
+  guint            hash_pos;
+} cowmail_conn;
+
+
+
+struct _cowmail_reactor
+{
+  cowmail_server  *server;
+  GThread         *thread;
+  gint             epfd;
+  cowmail_handle   wake;
+  cowmail_handle   commit;
+  cowmail_handle   listeners[2];
+  GPtrArray       *pool;
+  GHashTable      *conns;
+  GQueue           ready[COWMAIL_CLASSES];
+  GQueue           commits;
+  GList           *closing;
+  gint64           swept;
+};
+
+
+
+struct _cowmail_server
+{
+  guint16           port;
+  guint             nreactors;
+  cowmail_reactor  *reactors;
+  cowmail_store    *store;
+  gboolean          running;
+  guint8            difficulty;
+  cowmail_admission *admission;
+  gchar            *socket_path;
+  cowmail_handle    unix_listener;
+};
+
+
+
+static void
+cowmail_buffer_reserve (cowmail_reactor *reactor,
+                        cowmail_buffer  *buf,
+                        gsize            extra)
+{
+  if (!buf->data) {
+    if (extra <= COWMAIL_SERVER_BUFFER_SIZE && reactor->pool->len > 0) {
+      buf->data = g_ptr_array_steal_index_fast (reactor->pool, reactor->pool->len - 1);
+      buf->size = COWMAIL_SERVER_BUFFER_SIZE;
+    } else {
+      buf->size = MAX (extra, COWMAIL_SERVER_BUFFER_SIZE);
+      buf->data = g_malloc (buf->size);
+    }
+    buf->start = buf->end = 0;
+    return;
+  }
+
+  if (buf->end + extra <= buf->size)
+    return;
+
+  /* compact first, grow only if that is not enough */
+  memmove (buf->data, buf->data + buf->start, buf->end - buf->start);
+  buf->end -= buf->start;
+  buf->start = 0;
+  if (buf->end + extra > buf->size) {
+    buf->size = MAX (2 * buf->size, buf->end + extra);
+    buf->data = g_realloc (buf->data, buf->size);
+  }
+}
+
+
+
+static void
+cowmail_buffer_release (cowmail_reactor *reactor,
+                        cowmail_buffer  *buf)
+{
+  if (buf->size == COWMAIL_SERVER_BUFFER_SIZE && reactor->pool->len < COWMAIL_SERVER_POOL_MAX)
+    g_ptr_array_add (reactor->pool, buf->data);
+  else
+    g_free (buf->data);
+  memset (buf, 0, sizeof (cowmail_buffer));
+}
+
+
+
+static void
+cowmail_buffer_append (cowmail_reactor *reactor,
+                       cowmail_buffer  *buf,
+                       gconstpointer    data,
+                       gsize            len)
+{
+  cowmail_buffer_reserve (reactor, buf, len);
+  memcpy (buf->data + buf->end, data, len);
+  buf->end += len;
+}
+
+
+
+static void
+cowmail_conn_respond (cowmail_conn  *c,
+                      guchar         status,
+                      gconstpointer  payload,
+                      gsize          len)
+{
+  guchar header[COWMAIL_FRAME_HEADER_SIZE];
+  guint32 belen = GUINT32_TO_BE (len);
+  header[0] = status;
+  memcpy (header + 1, &belen, sizeof (belen));
+  cowmail_buffer_append (c->reactor, &c->out, header, sizeof (header));
+  if (len)
+    cowmail_buffer_append (c->reactor, &c->out, payload, len);
+}
+
+
+
+static void
+cowmail_conn_free (cowmail_conn *c)
+{
+  cowmail_admission_disconnect (c->reactor->server->admission);
+  close (c->handle.fd);
+  cowmail_buffer_release (c->reactor, &c->in);
+  cowmail_buffer_release (c->reactor, &c->out);
+  g_free (c->hashes);
+  g_free (c);
+}
+
+
+
+/* later events of the same epoll batch may still point to the connection, so it is freed after them */
+static void
+cowmail_conn_destroy (cowmail_conn *c)
+{
+  if (c->dead)
+    return;
+  c->dead = TRUE;
+  if (c->queued)
+    g_queue_delete_link (&c->reactor->ready[c->klass], c->queued);
+  c->queued = NULL;
+  if (c->commit_link)
+    g_queue_delete_link (&c->reactor->commits, c->commit_link);
+  c->commit_link = NULL;
+  epoll_ctl (c->reactor->epfd, EPOLL_CTL_DEL, c->handle.fd, NULL);
+  c->reactor->closing = g_list_prepend (c->reactor->closing, c);
+}
+
+
+
+static void
+cowmail_reactor_reap (cowmail_reactor *reactor)
+{
+  for (GList *l = reactor->closing; l; l = l->next)
+    g_hash_table_remove (reactor->conns, l->data);
+  g_clear_pointer (&reactor->closing, g_list_free);
+}
+
+
+
+static void
+cowmail_conn_watch (cowmail_conn *c,
+                    guint32       events)
+{
+  if (c->events == events)
+    return;
+
+  struct epoll_event ev = { .events = events, .data.ptr = c };
+  epoll_ctl (c->reactor->epfd, EPOLL_CTL_MOD, c->handle.fd, &ev);
+  c->events = events;
+}
+
+
+
+/* starts a LIST reply: the cursor after the last head, then the heads */
+static void
+cowmail_conn_list (cowmail_conn *c,
+                   guint64       cursor,
+                   guint32       limit,
+                   gboolean      framed,
+                   gboolean      with_cursor)
+{
+  /* a cursor past the end gets the end, so that the client notices a reset store */
+  guint64 count = cowmail_store_count (c->reactor->server->store);
+  cursor = MIN (cursor, count);
+  guint64 n = count - cursor;
+  if (limit)
+    n = MIN (n, limit);
+  /* the frame length is 32 bits, so a whole list is sent in pages the client follows with the cursor */
+  if (framed)
+    n = MIN (n, (G_MAXUINT32 - sizeof (guint64)) / COWMAIL_HEAD_SIZE);
+
+  if (framed)
+    cowmail_conn_respond (c, COWMAIL_STATUS_OK, NULL, sizeof (guint64) + n * COWMAIL_HEAD_SIZE);
+  /* the frame header announced the length, so write it before the cursor */
+  if (with_cursor) {
+    guint64 next = GUINT64_TO_BE (cursor + n);
+    cowmail_buffer_append (c->reactor, &c->out, &next, sizeof (next));
+  }
+
+  c->reply = COWMAIL_REPLY_LIST;
+  c->list_pos = cursor;
+  c->list_end = cursor + n;
+}
+
+
+
+static void
+cowmail_conn_get (cowmail_conn *c,
+                  const guchar *hash,
+                  gboolean      framed)
+{
+  g_autoptr (GBytes) body = cowmail_store_get (c->reactor->server->store, hash);
+  gsize len = 0;
+  gconstpointer data = body ? g_bytes_get_data (body, &len) : NULL;
+
+  if (framed)
+    cowmail_conn_respond (c, body ? COWMAIL_STATUS_OK : COWMAIL_STATUS_NOT_FOUND, data, len);
+  else if (body)
+    cowmail_buffer_append (c->reactor, &c->out, data, len);
+}
+
+
+
+/* appends a message, the flush thread makes it durable */
+static gboolean
+cowmail_conn_put (cowmail_conn *c,
+                  const guchar *msg,
+                  gsize         len,
+                  guint64      *seq)
+{
+  g_autoptr (GError) error = NULL;
+  if (!cowmail_store_append (c->reactor->server->store, msg, len, seq, &error)) {
+    g_printerr ("COWMAIL ERROR: Cannot store message: %s\n", error->message);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+
+
+/* holds back the replies from here on until the store has committed seq */
+static void
+cowmail_conn_await (cowmail_conn *c,
+                    guint64       seq)
+{
+  if (cowmail_store_is_durable (c->reactor->server->store, seq, NULL))
+    return;
+  c->commit_seq = seq;
+  if (!c->committing) {
+    c->committing = TRUE;
+    g_queue_push_tail (&c->reactor->commits, c);
+    c->commit_link = g_queue_peek_tail_link (&c->reactor->commits);
+  }
+}
+
+
+
+/* version 1 clients only know BAD_REQUEST as an error */
+static void
+cowmail_conn_fail (cowmail_conn *c,
+                   guchar        status)
+{
+  cowmail_conn_respond (c, c->version >= 2 ? status : COWMAIL_STATUS_BAD_REQUEST, NULL, 0);
+}
+
+
+
+static gint
+cowmail_frame_class (guchar type)
+{
+  switch (type) {
+  case COWMAIL_FRAME_LIST:
+    return COWMAIL_CLASS_LIST;
+  case COWMAIL_FRAME_GET:
+  case COWMAIL_FRAME_GET_MANY:
+    return COWMAIL_CLASS_GET;
+  case COWMAIL_FRAME_PUT:
+    return COWMAIL_CLASS_PUT;
+  default:
+    return -1;
+  }
+}
+
+
+
+/*
+ * Whether a request may be served now: its source must have tokens left, and
+ * its class must not have too many connections waiting for their turn on this
+ * reactor already. cost counts the single requests of a GET_MANY.
+ */
+static gboolean
+cowmail_conn_admit (cowmail_conn *c,
+                    guchar        type,
+                    guint         cost)
+{
+  cowmail_reactor *reactor = c->reactor;
+  gint klass = cowmail_frame_class (type);
+  if (klass < 0)
+    return TRUE;
+  return g_queue_get_length (&reactor->ready[klass]) < COWMAIL_SERVER_QUEUE_MAX &&
+         cowmail_admission_request (reactor->server->admission, c->remote ? c->source : NULL, cost);
+}
+
+
+
+static void
+cowmail_conn_hello (cowmail_conn *c,
+                    const guchar *payload)
+{
+  guint16 version;
+  guint32 features;
+  memcpy (&version, payload, sizeof (version));
+  memcpy (&features, payload + sizeof (version), sizeof (features));
+  c->version = CLAMP (GUINT16_FROM_BE (version), 1, COWMAIL_PROTOCOL_VERSION);
+  features = GUINT32_FROM_BE (features) & COWMAIL_FEATURES;
+  /* stamps are only offered when they are required */
+  guint8 difficulty = c->reactor->server->difficulty;
+  if (!difficulty)
+    features &= ~COWMAIL_FEATURE_STAMP;
+  c->stamps = (features & COWMAIL_FEATURE_STAMP) != 0;
+
+  guchar hello[COWMAIL_HELLO_SIZE + 1];
+  version = GUINT16_TO_BE (c->version);
+  features = GUINT32_TO_BE (features);
+  memcpy (hello, &version, sizeof (version));
+  memcpy (hello + sizeof (version), &features, sizeof (features));
+  hello[COWMAIL_HELLO_SIZE] = difficulty;
+  cowmail_conn_respond (c, COWMAIL_STATUS_OK, hello, c->stamps ? sizeof (hello) : COWMAIL_HELLO_SIZE);
+}
+
+
+
+/* whether the payload of a PUT carries the stamp that the server asks for */
+static gboolean
+cowmail_conn_check_stamp (cowmail_conn *c,
+                          const guchar *payload,
+                          gsize         len)
+{
+  guint difficulty = c->reactor->server->difficulty;
+  if (!difficulty)
+    return TRUE;
+  if (!c->stamps || len < COWMAIL_STAMP_SIZE + COWMAIL_HEAD_SIZE)
+    return FALSE;
+  return cowmail_stamp_verify (payload + COWMAIL_STAMP_SIZE, payload, difficulty);
+}
+
+
+
+/* drops a refused frame, including the part of its payload that has not arrived yet */
+static void
+cowmail_conn_refuse (cowmail_conn *c,
+                     guint32       len)
+{
+  gsize size = COWMAIL_FRAME_HEADER_SIZE + len;
+  gsize n = MIN (size, c->in.end - c->in.start);
+  c->in.start += n;
+  c->discard = size - n;
+}
+
+
+
+/*
+ * Admits the frame at the start of the input once its header, and for a PUT
+ * its stamp and head, have arrived, so that a refused request is not buffered.
+ * Returns FALSE while more input is needed.
+ */
+static gboolean
+cowmail_conn_check (cowmail_conn *c,
+                    guint32       len,
+                    gboolean     *refused)
+{
+  const guchar *frame = c->in.data + c->in.start;
+  gsize avail = c->in.end - c->in.start;
+  gboolean stamped = frame[0] == COWMAIL_FRAME_PUT && c->reactor->server->difficulty;
+  *refused = FALSE;
+  if (c->checked)
+    return TRUE;
+  if (stamped && avail < COWMAIL_FRAME_HEADER_SIZE + MIN (len, COWMAIL_STAMP_SIZE + COWMAIL_HEAD_SIZE))
+    return FALSE;
+
+  guint cost = frame[0] == COWMAIL_FRAME_GET_MANY ? 1 + len / COWMAIL_KEY_SIZE / COWMAIL_SERVER_GETS_PER_TOKEN : 1;
+  if (!cowmail_conn_admit (c, frame[0], cost)) {
+    cowmail_conn_fail (c, COWMAIL_STATUS_BUSY);
+    *refused = TRUE;
+  } else if (stamped && !cowmail_conn_check_stamp (c, frame + COWMAIL_FRAME_HEADER_SIZE, len)) {
+    cowmail_conn_fail (c, COWMAIL_STATUS_STAMP);
+    *refused = TRUE;
+  }
+  if (*refused)
+    cowmail_conn_refuse (c, len);
+  else
+    c->checked = TRUE;
+  return TRUE;
+}
+
+
+
+/* handles one complete request frame of a session, returns FALSE if none */
+static gboolean
+cowmail_conn_frame (cowmail_conn *c)
+{
+  if (c->discard) {
+    gsize n = MIN (c->discard, c->in.end - c->in.start);
+    c->in.start += n;
+    c->discard -= n;
+    if (c->discard)
+      return FALSE;
+  }
+  gsize avail = c->in.end - c->in.start;
+  if (avail < COWMAIL_FRAME_HEADER_SIZE)
+    return FALSE;
+
+  const guchar *frame = c->in.data + c->in.start;
+  guint32 len;
+  memcpy (&len, frame + 1, sizeof (len));
+  len = GUINT32_FROM_BE (len);
+  if (len > COWMAIL_SERVER_MAX_MSG) {
+    cowmail_conn_fail (c, COWMAIL_STATUS_TOO_LARGE);
+    c->state = COWMAIL_CONN_DONE;
+    return FALSE;
+  }
+  gboolean refused;
+  if (!cowmail_conn_check (c, len, &refused))
+    return FALSE;
+  if (refused)
+    return TRUE;
+  if (avail < COWMAIL_FRAME_HEADER_SIZE + len)
+    return FALSE;
+
+  const guchar *payload = frame + COWMAIL_FRAME_HEADER_SIZE;
+  switch (frame[0]) {
+  case COWMAIL_FRAME_HELLO:
+    if (len == COWMAIL_HELLO_SIZE)
+      cowmail_conn_hello (c, payload);
+    else
+      cowmail_conn_fail (c, COWMAIL_STATUS_BAD_REQUEST);
+    break;
+  case COWMAIL_FRAME_PUT: {
+    guint64 seq;
+    if (cowmail_conn_put (c, payload + (c->stamps ? COWMAIL_STAMP_SIZE : 0),
+                          len - (c->stamps ? COWMAIL_STAMP_SIZE : 0), &seq)) {
+      cowmail_conn_respond (c, COWMAIL_STATUS_OK, NULL, 0);
+      cowmail_conn_await (c, seq);
+    } else {
+      cowmail_conn_fail (c, COWMAIL_STATUS_SERVER_ERROR);
+    }
+    break;
+  }
+  case COWMAIL_FRAME_LIST:
+    if (len == sizeof (guint64) + sizeof (guint32)) {
+      guint64 cursor;
+      guint32 limit;
+      memcpy (&cursor, payload, sizeof (cursor));
+      memcpy (&limit, payload + sizeof (cursor), sizeof (limit));
+      cowmail_conn_list (c, GUINT64_FROM_BE (cursor), GUINT32_FROM_BE (limit), TRUE, TRUE);
+    } else {
+      cowmail_conn_fail (c, COWMAIL_STATUS_BAD_REQUEST);
+    }
+    break;
+  case COWMAIL_FRAME_GET:
+    if (len == COWMAIL_KEY_SIZE)
+      cowmail_conn_get (c, payload, TRUE);
+    else
+      cowmail_conn_fail (c, COWMAIL_STATUS_BAD_REQUEST);
+    break;
+  case COWMAIL_FRAME_GET_MANY:
+    if (len % COWMAIL_KEY_SIZE == 0 && len / COWMAIL_KEY_SIZE <= COWMAIL_GET_MANY_MAX) {
+      g_free (c->hashes);
+      c->hashes = g_malloc (MAX (len, 1));
+      memcpy (c->hashes, payload, len);
+      c->nhashes = len / COWMAIL_KEY_SIZE;
+      c->hash_pos = 0;
+      c->reply = COWMAIL_REPLY_GET_MANY;
+    } else {
+      cowmail_conn_fail (c, COWMAIL_STATUS_BAD_REQUEST);
+    }
+    break;
+  default:
+    cowmail_conn_fail (c, COWMAIL_STATUS_UNSUPPORTED);
+  }
+
+  c->in.start += COWMAIL_FRAME_HEADER_SIZE + len;
+  c->checked = FALSE;
+  return TRUE;
+}
+
+
+
+/* produces the next piece of output, returns FALSE if there is nothing to do */
+static gboolean
+cowmail_conn_produce (cowmail_conn *c)
+{
+  switch (c->reply) {
+  case COWMAIL_REPLY_LIST: {
+    gsize n = MIN (c->list_end - c->list_pos, COWMAIL_SERVER_BUFFER_SIZE / COWMAIL_HEAD_SIZE);
+    cowmail_buffer_reserve (c->reactor, &c->out, n * COWMAIL_HEAD_SIZE);
+    gsize got = cowmail_store_read_heads (c->reactor->server->store, c->list_pos, n, c->out.data + c->out.end);
+    c->out.end += got * COWMAIL_HEAD_SIZE;
+    c->list_pos += n;
+    /* the store never shrinks, so got < n does not happen */
+    if (c->list_pos >= c->list_end)
+      c->reply = COWMAIL_REPLY_NONE;
+    return TRUE;
+  }
+  case COWMAIL_REPLY_GET_MANY:
+    cowmail_conn_get (c, c->hashes + c->hash_pos * COWMAIL_KEY_SIZE, TRUE);
+    if (++c->hash_pos == c->nhashes)
+      c->reply = COWMAIL_REPLY_NONE;
+    return TRUE;
+  default:
+    /* only further PUTs join the commit that the replies wait for */
+    if (c->committing && !c->discard && (c->in.start == c->in.end || c->in.data[c->in.start] != COWMAIL_FRAME_PUT))
+      return FALSE;
+    return c->state == COWMAIL_CONN_SESSION && cowmail_conn_frame (c);
+  }
+}
+
+
+
+/* writes as much output as the socket takes, returns FALSE on error */
+static gboolean
+cowmail_conn_flush (cowmail_conn *c)
+{
+  while (c->out.start < c->out.end) {
+    gssize n = send (c->handle.fd, c->out.data + c->out.start, c->out.end - c->out.start, MSG_NOSIGNAL);
+    if (n > 0)
+      c->out.start += n;
+    else if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return TRUE;
+    else if (errno != EINTR)
+      return FALSE;
+  }
+  cowmail_buffer_release (c->reactor, &c->out);
+  return TRUE;
+}
+
+
+
+/* the class of what the connection does next: its current reply, or its next request */
+static gint
+cowmail_conn_class (cowmail_conn *c)
+{
+  if (c->reply == COWMAIL_REPLY_LIST)
+    return COWMAIL_CLASS_LIST;
+  if (c->reply == COWMAIL_REPLY_GET_MANY)
+    return COWMAIL_CLASS_GET;
+  gint klass = c->in.start < c->in.end ? cowmail_frame_class (c->in.data[c->in.start]) : -1;
+  return klass >= 0 ? klass : COWMAIL_CLASS_GET;
+}
+
+
+
+/* queues a connection that used up its quantum, without watching it until its turn */
+static void
+cowmail_conn_enqueue (cowmail_conn *c)
+{
+  c->klass = cowmail_conn_class (c);
+  g_queue_push_tail (&c->reactor->ready[c->klass], c);
+  c->queued = g_queue_peek_tail_link (&c->reactor->ready[c->klass]);
+  cowmail_conn_watch (c, 0);
+}
+
+
+
+static void
+cowmail_conn_run (cowmail_conn *c)
+{
+  gsize budget = COWMAIL_SERVER_QUANTUM;
+  gboolean more = TRUE;
+  while (more) {
+    while ((more = cowmail_conn_produce (c)) && c->out.end - c->out.start < COWMAIL_SERVER_HIGH_WATER);
+    if (c->committing) {
+      cowmail_conn_watch (c, c->eof ? 0 : EPOLLIN);
+      return;
+    }
+    gsize produced = c->out.end - c->out.start;
+    if (!cowmail_conn_flush (c)) {
+      cowmail_conn_destroy (c);
+      return;
+    }
+    if (c->out.start < c->out.end) {
+      cowmail_conn_watch (c, EPOLLOUT);
+      return;
+    }
+    /* give the other connections a turn, so that one long reply cannot hold up the reactor */
+    budget -= MIN (budget, produced);
+    if (more && budget == 0) {
+      cowmail_conn_enqueue (c);
+      return;
+    }
+  }
+
+  if (c->state == COWMAIL_CONN_DONE || c->eof) {
+    cowmail_conn_destroy (c);
+    return;
+  }
+  if (c->in.start == c->in.end)
+    cowmail_buffer_release (c->reactor, &c->in);
+  cowmail_conn_watch (c, EPOLLIN);
+}
+
+
+
+/* the SESSION byte and the header of HELLO, which is the first frame of every session */
+#define COWMAIL_SESSION_START_SIZE (1 + COWMAIL_FRAME_HEADER_SIZE + COWMAIL_HELLO_SIZE)
+
+static gboolean
+cowmail_conn_is_session (const guchar *data,
+                         gsize         len)
+{
+  static const guchar start[1 + COWMAIL_FRAME_HEADER_SIZE] = {
+    COWMAIL_CMD_SESSION, COWMAIL_FRAME_HELLO, 0, 0, 0, COWMAIL_HELLO_SIZE
+  };
+  return memcmp (data, start, MIN (len, sizeof (start))) == 0;
+}
+
+
+
+/* a one-shot PUT has no stamp and no status, so a refused one is closed before its body is buffered */
+static void
+cowmail_conn_start_put (cowmail_conn *c)
+{
+  if (!c->reactor->server->difficulty && cowmail_conn_admit (c, COWMAIL_FRAME_PUT, 1)) {
+    c->state = COWMAIL_CONN_PUT;
+  } else {
+    c->in.start = c->in.end;
+    c->state = COWMAIL_CONN_DONE;
+  }
+}
+
+
+
+/*
+ * Classifies the first request of a connection. One-shot requests rely on the
+ * first read returning exactly the first message, which SCTP guarantees and
+ * stream sockets deliver for the short writes of the clients. A session needs
+ * the SESSION byte and a whole HELLO header, so that a one-shot PUT starting
+ * with 0x02 is stored rather than taken for a session.
+ */
+static void
+cowmail_conn_detect (cowmail_conn *c)
+{
+  const guchar *data = c->in.data + c->in.start;
+  gsize len = c->in.end - c->in.start;
+
+  /* refused one-shot requests are closed, since there is no status to send */
+  if (len == 1 && data[0] == COWMAIL_CMD_LIST) {
+    if (cowmail_conn_admit (c, COWMAIL_FRAME_LIST, 1))
+      cowmail_conn_list (c, 0, 0, FALSE, FALSE);
+    c->state = COWMAIL_CONN_DONE;
+  } else if (len == COWMAIL_LIST_SINCE_SIZE && data[0] == COWMAIL_CMD_LIST_SINCE) {
+    guint64 cursor;
+    guint32 limit;
+    memcpy (&cursor, data + 1, sizeof (cursor));
+    memcpy (&limit, data + 1 + sizeof (cursor), sizeof (limit));
+    if (cowmail_conn_admit (c, COWMAIL_FRAME_LIST, 1))
+      cowmail_conn_list (c, GUINT64_FROM_BE (cursor), GUINT32_FROM_BE (limit), FALSE, TRUE);
+    c->state = COWMAIL_CONN_DONE;
+  } else if (cowmail_conn_is_session (data, len)) {
+    /* wait for the whole HELLO, a PUT that starts like one ends with EOF */
+    if (len < COWMAIL_SESSION_START_SIZE)
+      return;
+    c->in.start++;
+    c->state = COWMAIL_CONN_SESSION;
+    return;
+  } else if (len == COWMAIL_KEY_SIZE) {
+    if (cowmail_conn_admit (c, COWMAIL_FRAME_GET, 1))
+      cowmail_conn_get (c, data, FALSE);
+    c->state = COWMAIL_CONN_DONE;
+  } else {
+    cowmail_conn_start_put (c);
+    return;
+  }
+  c->in.start = c->in.end;
+}
+
+
+
+static void
+cowmail_conn_on_readable (cowmail_conn *c)
+{
+  for (;;) {
+    cowmail_buffer_reserve (c->reactor, &c->in, COWMAIL_SERVER_BUFFER_SIZE / 4);
+    gssize n = recv (c->handle.fd, c->in.data + c->in.end, c->in.size - c->in.end, 0);
+    if (n > 0) {
+      c->in.end += n;
+      if (c->state == COWMAIL_CONN_NEW)
+        cowmail_conn_detect (c);
+      if (c->in.end - c->in.start > COWMAIL_SERVER_MAX_MSG + COWMAIL_FRAME_HEADER_SIZE) {
+        cowmail_conn_destroy (c);
+        return;
+      }
+      /* leave the rest of a session to the next wakeup after replying */
+      if (c->state != COWMAIL_CONN_PUT)
+        break;
+    } else if (n == 0) {
+      c->eof = TRUE;
+      break;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    } else if (errno != EINTR) {
+      cowmail_conn_destroy (c);
+      return;
+    }
+  }
+
+  /* a one-shot PUT is complete when the client closes its side */
+  if (c->state == COWMAIL_CONN_NEW && c->eof && c->in.end > c->in.start)
+    cowmail_conn_start_put (c);
+  if (c->state == COWMAIL_CONN_PUT && c->eof) {
+    guint64 seq;
+    cowmail_conn_put (c, c->in.data + c->in.start, c->in.end - c->in.start, &seq);
+    c->state = COWMAIL_CONN_DONE;
+  }
+  if (c->state == COWMAIL_CONN_PUT)
+    return;
+  cowmail_conn_run (c);
+}
+
+
+
+static void
+cowmail_reactor_accept (cowmail_reactor *reactor,
+                        cowmail_handle  *listener)
+{
+  for (;;) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof (addr);
+    gint fd = accept4 (listener->fd, (struct sockaddr *) &addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      /* EAGAIN, or out of descriptors: try again on the next wakeup */
+      return;
+    }
+    /* over the connection cap, before the connection costs any memory */
+    if (!cowmail_admission_connect (reactor->server->admission)) {
+      close (fd);
+      continue;
+    }
+
+    cowmail_conn *c = g_new0 (cowmail_conn, 1);
+    c->handle.kind = COWMAIL_HANDLE_CONN;
+    c->handle.fd = fd;
+    c->reactor = reactor;
+    c->state = COWMAIL_CONN_NEW;
+    c->events = EPOLLIN;
+    c->active = g_get_monotonic_time ();
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    if (epoll_ctl (reactor->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      cowmail_admission_disconnect (reactor->server->admission);
+      close (fd);
+      g_free (c);
+      continue;
+    }
+    /* the TCP and SCTP listeners are dual-stack, so IPv4 sources come mapped */
+    if (addr.ss_family == AF_INET6) {
+      memcpy (c->source, &((struct sockaddr_in6 *) &addr)->sin6_addr, sizeof (c->source));
+      c->remote = TRUE;
+    }
+    g_hash_table_add (reactor->conns, c);
+  }
+}
+
+
+
+/* runs one connection of each class for a quantum, so that the classes share the reactor fairly */
+static gboolean
+cowmail_reactor_serve (cowmail_reactor *reactor)
+{
+  gboolean waiting = FALSE;
+  for (guint k = 0; k < COWMAIL_CLASSES; k++) {
+    cowmail_conn *c = g_queue_pop_head (&reactor->ready[k]);
+    if (c) {
+      c->queued = NULL;
+      cowmail_conn_run (c);
+    }
+  }
+  for (guint k = 0; k < COWMAIL_CLASSES; k++)
+    waiting = waiting || !g_queue_is_empty (&reactor->ready[k]);
+  return waiting;
+}
+
+
+
+/* sends the replies that waited for a commit, or drops their connections if it failed */
+static void
+cowmail_reactor_commit (cowmail_reactor *reactor)
+{
+  guint64 n;
+  if (read (reactor->commit.fd, &n, sizeof (n)) < 0 && errno != EAGAIN)
+    g_printerr ("COWMAIL ERROR: Cannot read commit event: %s\n", g_strerror (errno));
+
+  GList *next;
+  for (GList *l = reactor->commits.head; l; l = next) {
+    next = l->next;
+    cowmail_conn *c = l->data;
+    g_autoptr (GError) error = NULL;
+    if (cowmail_store_is_durable (reactor->server->store, c->commit_seq, &error)) {
+      g_queue_delete_link (&reactor->commits, l);
+      c->commit_link = NULL;
+      c->committing = FALSE;
+      cowmail_conn_run (c);
+    } else if (error) {
+      /* without a reply, the client puts the messages again */
+      cowmail_conn_destroy (c);
+    }
+  }
+}
+
+
+
+/* closes the connections that sent or took nothing for COWMAIL_SERVER_IDLE_TIMEOUT */
+static void
+cowmail_reactor_sweep (cowmail_reactor *reactor)
+{
+  gint64 now = g_get_monotonic_time ();
+  if (now - reactor->swept < G_USEC_PER_SEC)
+    return;
+  reactor->swept = now;
+
+  GHashTableIter iter;
+  cowmail_conn *c;
+  g_hash_table_iter_init (&iter, reactor->conns);
+  /* connections waiting for their turn or for a commit are held up by the server */
+  while (g_hash_table_iter_next (&iter, (gpointer *) &c, NULL))
+    if (!c->queued && !c->committing && now - c->active > COWMAIL_SERVER_IDLE_TIMEOUT * G_USEC_PER_SEC)
+      cowmail_conn_destroy (c);
+}
+
+
+
+static gpointer
+cowmail_reactor_run (gpointer data)
+{
+  cowmail_reactor *reactor = data;
+  struct epoll_event events[COWMAIL_SERVER_EVENTS];
+  gboolean waiting = FALSE;
+
+  for (;;) {
+    /* new requests are picked up between the turns of the queued ones */
+    gint n = epoll_wait (reactor->epfd, events, COWMAIL_SERVER_EVENTS, waiting ? 0 : 1000);
+    if (n < 0 && errno != EINTR)
+      break;
+
+    for (gint i = 0; i < n; i++) {
+      cowmail_handle *handle = events[i].data.ptr;
+      switch (handle->kind) {
+      case COWMAIL_HANDLE_WAKE:
+        return NULL;
+      case COWMAIL_HANDLE_COMMIT:
+        cowmail_reactor_commit (reactor);
+        break;
+      case COWMAIL_HANDLE_LISTENER:
+        cowmail_reactor_accept (reactor, handle);
+        break;
+      default: {
+        cowmail_conn *c = (cowmail_conn *) handle;
+        if (c->dead)
+          break;
+        c->active = g_get_monotonic_time ();
+        if (events[i].events & EPOLLIN)
+          cowmail_conn_on_readable (c);
+        else if (events[i].events & EPOLLOUT)
+          cowmail_conn_run (c);
+        else
+          cowmail_conn_destroy (c);
+      }
+      }
+    }
+    waiting = cowmail_reactor_serve (reactor);
+    cowmail_reactor_sweep (reactor);
+    cowmail_reactor_reap (reactor);
+  }
+  return NULL;
+}
+
+
+
+static gint
+cowmail_listen (gint      protocol,
+                guint16   port,
+                GError  **error)
+{
+  gint fd = socket (AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, protocol);
+  if (fd < 0) {
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno), "socket: %s", g_strerror (errno));
+    return -1;
+  }
+
+  gint on = 1, off = 0;
+  setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+  setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof (on));
+  setsockopt (fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof (off));
+  if (protocol == IPPROTO_TCP) {
+    /* accepted sockets inherit TCP_NODELAY */
+    gint qlen = COWMAIL_FASTOPEN_QUEUE;
+    setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+    setsockopt (fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof (qlen));
+  }
+
+  struct sockaddr_in6 addr = { .sin6_family = AF_INET6, .sin6_port = htons (port), .sin6_addr = IN6ADDR_ANY_INIT };
+  if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0 || listen (fd, SOMAXCONN) < 0) {
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno), "bind: %s", g_strerror (errno));
+    close (fd);
+    return -1;
+  }
+  return fd;
+}
+
+
+
+/* one socket for all reactors, since SO_REUSEPORT does not apply to Unix sockets */
+static gint
+cowmail_listen_unix (const gchar  *path,
+                     GError      **error)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen (path) >= sizeof (addr.sun_path)) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FILENAME_TOO_LONG, "Socket path too long: %s", path);
+    return -1;
+  }
+  g_strlcpy (addr.sun_path, path, sizeof (addr.sun_path));
+
+  gint fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno), "socket: %s", g_strerror (errno));
+    return -1;
+  }
+  /* a socket left behind by a server that did not stop cleanly */
+  unlink (path);
+  if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0 || listen (fd, SOMAXCONN) < 0) {
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno), "bind %s: %s", path, g_strerror (errno));
+    close (fd);
+    return -1;
+  }
+  return fd;
+}
+
+
+
+static guint16
+cowmail_listen_port (gint fd)
+{
+  struct sockaddr_in6 addr;
+  socklen_t len = sizeof (addr);
+  getsockname (fd, (struct sockaddr *) &addr, &len);
+  return ntohs (addr.sin6_port);
+}
+
+
+
+cowmail_server *
+cowmail_server_new (cowmail_store *store,
+                    guint16        port,
+                    guint          threads)
+{
+  cowmail_server *server = g_new0 (cowmail_server, 1);
+  server->port = port;
+  server->nreactors = threads ? threads : g_get_num_processors ();
+  server->reactors = g_new0 (cowmail_reactor, server->nreactors);
+  server->store = store;
+  cowmail_admission_limits limits = { 0 };
+  server->admission = cowmail_admission_new (&limits);
+  for (guint i = 0; i < server->nreactors; i++) {
+    cowmail_reactor *reactor = &server->reactors[i];
+    reactor->server = server;
+    reactor->epfd = -1;
+    reactor->wake.fd = -1;
+    reactor->commit.fd = -1;
+    for (guint k = 0; k < COWMAIL_CLASSES; k++)
+      g_queue_init (&reactor->ready[k]);
+    g_queue_init (&reactor->commits);
+    reactor->wake.kind = COWMAIL_HANDLE_WAKE;
+    reactor->commit.kind = COWMAIL_HANDLE_COMMIT;
+    for (guint l = 0; l < G_N_ELEMENTS (reactor->listeners); l++) {
+      reactor->listeners[l].kind = COWMAIL_HANDLE_LISTENER;
+      reactor->listeners[l].fd = -1;
+    }
+  }
+  server->unix_listener.kind = COWMAIL_HANDLE_LISTENER;
+  server->unix_listener.fd = -1;
+  return server;
+}
+
+
+
+void
+cowmail_server_set_socket (cowmail_server *server,
+                           const gchar    *path)
+{
+  g_free (server->socket_path);
+  server->socket_path = g_strdup (path);
+}
+
+
+
+void
+cowmail_server_set_difficulty (cowmail_server *server,
+                               guint           bits)
+{
+  g_return_if_fail (bits <= COWMAIL_STAMP_MAX_BITS);
+  server->difficulty = bits;
+}
+
+
+
+void
+cowmail_server_set_limits (cowmail_server                 *server,
+                           const cowmail_admission_limits *limits)
+{
+  cowmail_admission_free (server->admission);
+  server->admission = cowmail_admission_new (limits);
+}
+
+
+
+/* called on the flush thread of the store */
+static void
+cowmail_server_on_commit (gpointer userdata)
+{
+  cowmail_server *server = userdata;
+  for (guint i = 0; i < server->nreactors; i++) {
+    guint64 one = 1;
+    if (write (server->reactors[i].commit.fd, &one, sizeof (one)) < 0)
+      g_printerr ("COWMAIL ERROR: Cannot wake reactor: %s\n", g_strerror (errno));
+  }
+}
+
+
+
+gboolean
+cowmail_server_start (cowmail_server  *server,
+                      GError         **error)
+{
+  gint protocols[] = { IPPROTO_TCP, IPPROTO_SCTP };
+
+  if (server->socket_path) {
+    server->unix_listener.fd = cowmail_listen_unix (server->socket_path, error);
+    if (server->unix_listener.fd < 0)
+      return FALSE;
+  }
+
+  for (guint i = 0; i < server->nreactors; i++) {
+    cowmail_reactor *reactor = &server->reactors[i];
+    reactor->epfd = epoll_create1 (EPOLL_CLOEXEC);
+    reactor->wake.fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &reactor->wake };
+    epoll_ctl (reactor->epfd, EPOLL_CTL_ADD, reactor->wake.fd, &ev);
+    reactor->commit.fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ev.data.ptr = &reactor->commit;
+    epoll_ctl (reactor->epfd, EPOLL_CTL_ADD, reactor->commit.fd, &ev);
+
+    for (guint l = 0; l < G_N_ELEMENTS (protocols); l++) {
+      g_autoptr (GError) lerror = NULL;
+      gint fd = cowmail_listen (protocols[l], server->port, &lerror);
+      if (fd < 0 && protocols[l] == IPPROTO_SCTP) {
+        if (i == 0)
+          g_printerr ("COWMAIL WARNING: No SCTP: %s\n", lerror->message);
+        continue;
+      }
+      if (fd < 0) {
+        g_propagate_error (error, g_steal_pointer (&lerror));
+        cowmail_server_stop (server);
+        return FALSE;
+      }
+      /* all listeners share the port the first one got */
+      if (server->port == 0)
+        server->port = cowmail_listen_port (fd);
+
+      reactor->listeners[l].fd = fd;
+      ev.data.ptr = &reactor->listeners[l];
+      epoll_ctl (reactor->epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    /* wake only one reactor per connection on the shared socket */
+    if (server->unix_listener.fd >= 0) {
+      struct epoll_event uev = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = &server->unix_listener };
+      epoll_ctl (reactor->epfd, EPOLL_CTL_ADD, server->unix_listener.fd, &uev);
+    }
+
+    reactor->pool = g_ptr_array_new_with_free_func (g_free);
+    reactor->conns = g_hash_table_new_full (NULL, NULL, (GDestroyNotify) cowmail_conn_free, NULL);
+  }
+
+  cowmail_store_set_commit_func (server->store, cowmail_server_on_commit, server);
+  for (guint i = 0; i < server->nreactors; i++)
+    server->reactors[i].thread = g_thread_new ("cowmail-reactor", cowmail_reactor_run, &server->reactors[i]);
+  server->running = TRUE;
+  return TRUE;
+}
+
+
+
+guint16
+cowmail_server_get_port (cowmail_server *server)
+{
+  return server->port;
+}
+
+
+
+void
+cowmail_server_stop (cowmail_server *server)
+{
+  cowmail_store_set_commit_func (server->store, NULL, NULL);
+  for (guint i = 0; i < server->nreactors; i++) {
+    cowmail_reactor *reactor = &server->reactors[i];
+    if (reactor->thread) {
+      guint64 one = 1;
+      if (write (reactor->wake.fd, &one, sizeof (one)) < 0)
+        g_printerr ("COWMAIL ERROR: Cannot wake reactor: %s\n", g_strerror (errno));
+      g_thread_join (reactor->thread);
+      reactor->thread = NULL;
+    }
+
+    /* connections return their buffers to the pool, so free the pool last */
+    for (guint k = 0; k < COWMAIL_CLASSES; k++)
+      g_queue_clear (&reactor->ready[k]);
+    g_queue_clear (&reactor->commits);
+    /* the table still holds the connections that were closing */
+    g_clear_pointer (&reactor->closing, g_list_free);
+    g_clear_pointer (&reactor->conns, g_hash_table_unref);
+    g_clear_pointer (&reactor->pool, g_ptr_array_unref);
+    for (guint l = 0; l < G_N_ELEMENTS (reactor->listeners); l++) {
+      if (reactor->listeners[l].fd >= 0)
+        close (reactor->listeners[l].fd);
+      reactor->listeners[l].fd = -1;
+    }
+    if (reactor->wake.fd >= 0)
+      close (reactor->wake.fd);
+    if (reactor->commit.fd >= 0)
+      close (reactor->commit.fd);
+    if (reactor->epfd >= 0)
+      close (reactor->epfd);
+    reactor->wake.fd = reactor->commit.fd = reactor->epfd = -1;
+  }
+  if (server->unix_listener.fd >= 0) {
+    close (server->unix_listener.fd);
+    unlink (server->socket_path);
+    server->unix_listener.fd = -1;
+  }
+  server->running = FALSE;
+}
+
+
+
+void
+cowmail_server_free (cowmail_server *server)
+{
+  cowmail_server_stop (server);
+  cowmail_admission_free (server->admission);
+  g_free (server->socket_path);
+  g_free (server->reactors);
+  g_free (server);
+}
@@ -0,0 +1,155 @@
+/* cowmail-server.h
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "cowmail-store.h"
+#include "cowmail-transport.h"
+#include "cowmail-admission.h"
+
+/* size of the pooled per-connection buffers */
+#define COWMAIL_SERVER_BUFFER_SIZE 65536
+/* stop producing replies while this much output is waiting for the socket */
+#define COWMAIL_SERVER_HIGH_WATER  COWMAIL_SERVER_BUFFER_SIZE
+/* maximum size of a message or request frame */
+#define COWMAIL_SERVER_MAX_MSG     COWMAIL_FRAME_MAX
+/* maximum number of idle buffers kept per reactor */
+#define COWMAIL_SERVER_POOL_MAX    1024
+/* bytes a connection may send before the connections queued behind it get a turn */
+#define COWMAIL_SERVER_QUANTUM     (4 * COWMAIL_SERVER_BUFFER_SIZE)
+/* connections per class and reactor waiting for a turn before requests are refused as busy */
+#define COWMAIL_SERVER_QUEUE_MAX   64
+/* hashes of a GET_MANY that count as one request for the rate limits */
+#define COWMAIL_SERVER_GETS_PER_TOKEN 64
+/* seconds a connection may send and take nothing before it is closed */
+#define COWMAIL_SERVER_IDLE_TIMEOUT 60
+
+
+
+typedef struct _cowmail_server cowmail_server;
+
+
+
+/**
+ * cowmail_server_new:
+ * @store: message store, must outlive the server
+ * @port: port to listen on, 0 for any free port
+ * @threads: number of reactor threads, 0 for one per processor
+ *
+ * Creates a Cowmail server that keeps its messages in @store.
+ *
+ * Each reactor thread has its own epoll instance and its own non-blocking TCP
+ * and SCTP listeners on the same port (SO_REUSEPORT), so the kernel spreads the
+ * connections over the threads and no state is shared but the store. The TCP
+ * listeners set TCP_NODELAY and accept Fast Open.
+ *
+ * A PUT is appended to the store on the reactor thread and acknowledged once
+ * the flush thread of the store has committed it, so no reactor waits for the
+ * disk. Until then, the connection only takes further PUTs into that commit.
+ * Connections that send and take nothing for COWMAIL_SERVER_IDLE_TIMEOUT
+ * seconds are closed.
+ *
+ * Returns: the server
+ */
+cowmail_server    *cowmail_server_new      (cowmail_store         *store,
+                                            guint16                port,
+                                            guint                  threads);
+
+/**
+ * cowmail_server_set_socket:
+ * @server: the server
+ * @path: (nullable): path of a Unix domain socket to listen on as well
+ *
+ * All reactors share the Unix socket listener. Call this before
+ * cowmail_server_start().
+ */
+void               cowmail_server_set_socket (cowmail_server      *server,
+                                              const gchar         *path);
+
+/**
+ * cowmail_server_set_difficulty:
+ * @server: the server
+ * @bits: leading zero bits a stamp must have, 0 for no stamps
+ *
+ * Requires a proof-of-work stamp on every PUT, see cowmail-stamp.h, at most
+ * COWMAIL_STAMP_MAX_BITS. PUTs without a good stamp are refused once the
+ * stamp and the head have arrived, before the body is buffered, and one-shot
+ * PUTs, which cannot carry a stamp, are closed after their first read. Call
+ * this before cowmail_server_start().
+ */
+void               cowmail_server_set_difficulty (cowmail_server  *server,
+                                                  guint            bits);
+
+/**
+ * cowmail_server_set_limits:
+ * @server: the server
+ * @limits: the limits, see cowmail_admission_new()
+ *
+ * Limits the connections and the requests per source. Requests over a limit
+ * are refused with status BUSY as soon as their frame header has arrived, and
+ * the rest of the frame is discarded as it arrives instead of being buffered.
+ * One-shot requests, which have no status, are closed, a one-shot PUT as soon
+ * as its first read is classified. Connections over the cap are closed as
+ * soon as they are accepted.
+ *
+ * Independent of the limits, a connection with a long reply yields to the
+ * others after COWMAIL_SERVER_QUANTUM bytes. The waiting connections take
+ * turns by class, LIST, GET and PUT, so that a flood of one kind of request
+ * cannot hold up the others, and requests of a class that has
+ * COWMAIL_SERVER_QUEUE_MAX connections waiting are refused as busy. Call this
+ * before cowmail_server_start().
+ */
+void               cowmail_server_set_limits (cowmail_server                 *server,
+                                              const cowmail_admission_limits *limits);
+
+/**
+ * cowmail_server_start:
+ * @server: the server
+ * @error: return location for an error
+ *
+ * Binds the listeners and starts the reactor threads. SCTP is skipped with a
+ * warning if the system does not support it.
+ *
+ * Returns: TRUE on success
+ */
+gboolean           cowmail_server_start    (cowmail_server        *server,
+                                            GError               **error);
+
+/**
+ * cowmail_server_get_port:
+ * @server: the server
+ *
+ * Returns: the port the server listens on, after cowmail_server_start()
+ */
+guint16            cowmail_server_get_port (cowmail_server        *server);
+
+/**
+ * cowmail_server_stop:
+ * @server: the server
+ *
+ * Stops the reactor threads and closes all connections.
+ */
+void               cowmail_server_stop     (cowmail_server        *server);
+
+/**
+ * cowmail_server_free:
+ * @server: the server
+ *
+ * Stops the server if needed and frees it. The store is not closed.
+ */
+void               cowmail_server_free     (cowmail_server        *server);
@@ -0,0 +1,190 @@
+/* cowmail-stamp.c
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cowmail-stamp.h"
+#include <gnutls/crypto.h>
+#include <nettle/sha2.h>
+
+
+
+typedef struct
+{
+  GMutex            mutex;
+  GCond             cond;
+  guint             pending;
+  gint              found;
+  guchar            stamp[COWMAIL_STAMP_SIZE];
+  GCancellable     *cancellable;
+} cowmail_stamp_job;
+
+
+
+typedef struct
+{
+  cowmail_stamp_job *job;
+  struct sha256_ctx  midstate;
+  guint              bits;
+  guint64            nonce;
+} cowmail_stamp_worker_data;
+
+
+
+/* leading zero bits of a digest, looking at every byte */
+static guint
+cowmail_stamp_zeros (const guchar *digest)
+{
+  guint zeros = 0;
+  guint counting = 1;
+  for (guint i = 0; i < SHA256_DIGEST_SIZE; i++) {
+    zeros += counting * (7 - g_bit_nth_msf (digest[i], -1));
+    counting &= digest[i] == 0;
+  }
+  return zeros;
+}
+
+
+
+static void
+cowmail_stamp_search (cowmail_stamp_worker_data *data)
+{
+  cowmail_stamp_job *job = data->job;
+  /* the first 32 bits of the digest decide for any difficulty up to 32 */
+  guint32 limit = data->bits ? 1u << (32 - data->bits) : 0;
+  guint64 nonce = data->nonce;
+
+  while (!g_atomic_int_get (&job->found) && !g_cancellable_is_cancelled (job->cancellable)) {
+    for (guint i = 0; i < COWMAIL_STAMP_BATCH; i++, nonce++) {
+      guint64 lenonce = GUINT64_TO_LE (nonce);
+      struct sha256_ctx ctx = data->midstate;
+      guchar digest[SHA256_DIGEST_SIZE];
+      sha256_update (&ctx, sizeof (lenonce), (const guint8 *) &lenonce);
+      sha256_digest (&ctx, sizeof (digest), digest);
+
+      guint32 word;
+      memcpy (&word, digest, sizeof (word));
+      if (limit && GUINT32_FROM_BE (word) >= limit)
+        continue;
+      g_mutex_lock (&job->mutex);
+      if (!job->found)
+        memcpy (job->stamp, &lenonce, COWMAIL_STAMP_SIZE);
+      g_atomic_int_set (&job->found, TRUE);
+      g_mutex_unlock (&job->mutex);
+      return;
+    }
+  }
+}
+
+
+
+static void
+cowmail_stamp_worker (gpointer data,
+                      gpointer userdata)
+{
+  cowmail_stamp_worker_data *worker = data;
+  cowmail_stamp_job *job = worker->job;
+  (void) userdata;
+
+  cowmail_stamp_search (worker);
+
+  g_mutex_lock (&job->mutex);
+  if (--job->pending == 0)
+    g_cond_signal (&job->cond);
+  g_mutex_unlock (&job->mutex);
+}
+
+
+
+/* a pool of its own, so that a send does not wait for scans or the other way round */
+static GThreadPool *
+cowmail_stamp_pool (void)
+{
+  static gsize initialized = 0;
+  static GThreadPool *pool = NULL;
+
+  if (g_once_init_enter (&initialized)) {
+    pool = g_thread_pool_new (cowmail_stamp_worker, NULL, g_get_num_processors (), FALSE, NULL);
+    g_once_init_leave (&initialized, 1);
+  }
+  return pool;
+}
+
+
+
+gboolean
+cowmail_stamp_solve (const guchar *head,
+                     guint         bits,
+                     guchar       *stamp,
+                     GCancellable *cancellable)
+{
+  g_return_val_if_fail (bits <= COWMAIL_STAMP_MAX_BITS, FALSE);
+
+  cowmail_stamp_job job = { 0 };
+  g_mutex_init (&job.mutex);
+  g_cond_init (&job.cond);
+  job.cancellable = cancellable;
+
+  /* every thread hashes the last 16 bytes of the head and the nonce in one block */
+  struct sha256_ctx midstate;
+  sha256_init (&midstate);
+  sha256_update (&midstate, COWMAIL_HEAD_SIZE, head);
+
+  /* each thread walks its own part of the nonces from a random start */
+  guint64 start;
+  gnutls_rnd (GNUTLS_RND_NONCE, &start, sizeof (start));
+  guint nthreads = g_get_num_processors ();
+  g_autofree cowmail_stamp_worker_data *workers = g_new (cowmail_stamp_worker_data, nthreads);
+  for (guint t = 0; t < nthreads; t++) {
+    workers[t].job = &job;
+    workers[t].midstate = midstate;
+    workers[t].bits = bits;
+    workers[t].nonce = start + ((guint64) t << 48);
+  }
+
+  job.pending = nthreads - 1;
+  GThreadPool *pool = cowmail_stamp_pool ();
+  for (guint t = 1; t < nthreads; t++)
+    g_thread_pool_push (pool, &workers[t], NULL);
+  cowmail_stamp_search (&workers[0]);
+
+  g_mutex_lock (&job.mutex);
+  while (job.pending > 0)
+    g_cond_wait (&job.cond, &job.mutex);
+  g_mutex_unlock (&job.mutex);
+  g_cond_clear (&job.cond);
+  g_mutex_clear (&job.mutex);
+
+  if (job.found)
+    memcpy (stamp, job.stamp, COWMAIL_STAMP_SIZE);
+  return job.found;
+}
+
+
+
+gboolean
+cowmail_stamp_verify (const guchar *head,
+                      const guchar *stamp,
+                      guint         bits)
+{
+  struct sha256_ctx ctx;
+  guchar digest[SHA256_DIGEST_SIZE];
+  sha256_init (&ctx);
+  sha256_update (&ctx, COWMAIL_HEAD_SIZE, head);
+  sha256_update (&ctx, COWMAIL_STAMP_SIZE, stamp);
+  sha256_digest (&ctx, sizeof (digest), digest);
+  return cowmail_stamp_zeros (digest) >= bits;
+}
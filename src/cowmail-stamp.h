@@ -0,0 +1,72 @@
+/* cowmail-stamp.h
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "libcowmail.h"
+
+/* size of a stamp, a nonce in little endian */
+#define COWMAIL_STAMP_SIZE     8
+/* highest difficulty a server may ask for, about a second on a desktop */
+#define COWMAIL_STAMP_MAX_BITS 28
+/* nonces a solver thread tries between looking for the result of the others */
+#define COWMAIL_STAMP_BATCH    4096
+
+
+
+/*
+ * A stamp is proof of work bound to the head of one message: a nonce such
+ * that SHA-256 (head | nonce) starts with at least as many zero bits as the
+ * server asks for. Each try costs the solver one SHA-256 compression, since
+ * the state after the first 64 bytes of the head is computed once, and the
+ * server checks a stamp with one hash of 88 bytes.
+ */
+
+
+
+/**
+ * cowmail_stamp_solve:
+ * @head: the head of the message, COWMAIL_HEAD_SIZE bytes
+ * @bits: the difficulty, at most COWMAIL_STAMP_MAX_BITS
+ * @stamp: return location for COWMAIL_STAMP_SIZE bytes of stamp
+ * @cancellable: (nullable): a #GCancellable
+ *
+ * Searches for a stamp on all processors, starting from a random nonce.
+ * A difficulty of n bits takes 2^n tries on average.
+ *
+ * Returns: TRUE if a stamp was found, FALSE if @cancellable was cancelled
+ */
+gboolean           cowmail_stamp_solve     (const guchar          *head,
+                                            guint                  bits,
+                                            guchar                *stamp,
+                                            GCancellable          *cancellable);
+
+/**
+ * cowmail_stamp_verify:
+ * @head: the head of the message, COWMAIL_HEAD_SIZE bytes
+ * @stamp: COWMAIL_STAMP_SIZE bytes of stamp
+ * @bits: the difficulty
+ *
+ * Checks a stamp in the same time whatever the stamp is, so that the cost of
+ * a bad PUT to the server does not depend on how close it came.
+ *
+ * Returns: TRUE if @stamp meets the difficulty for @head
+ */
+gboolean           cowmail_stamp_verify    (const guchar          *head,
+                                            const guchar          *stamp,
+                                            guint                  bits);
@@ -0,0 +1,585 @@
+/* cowmail-store.c
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cowmail-store.h"
+#include "cowmail-index.h"
+#include <gnutls/crypto.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* number of location records read at once when opening a store */
+#define COWMAIL_STORE_LOC_BATCH 4096
+/* delay before a failed sync is tried again, in microseconds */
+#define COWMAIL_STORE_RETRY     G_USEC_PER_SEC
+
+
+
+struct _cowmail_store
+{
+  gchar      *path;
+  gint        heads_fd;
+  gint        locs_fd;
+  gboolean    sync;
+
+  /* appends, protected by write_mutex */
+  GMutex      write_mutex;
+  guint64     written;
+  guint32     segment;
+  guint64     segment_end;
+
+  /* group commit on the flush thread, protected by sync_mutex */
+  GMutex      sync_mutex;
+  GCond       flush_cond;
+  GCond       commit_cond;
+  GThread    *flusher;
+  gboolean    stop;
+  guint32     synced_segment;
+  guint64     failed;
+  cowmail_store_commit_func commit_func;
+  gpointer                  commit_data;
+
+  /* state shared with readers, protected by lock */
+  GRWLock     lock;
+  GArray        *segments;
+  cowmail_index *index;
+  guint64        visible;
+};
+
+
+
+static void
+cowmail_store_loc_encode (const cowmail_index_entry *loc,
+                          guchar                    *rec)
+{
+  guint32 segment = GUINT32_TO_LE (loc->segment);
+  guint32 length = GUINT32_TO_LE (loc->length);
+  guint64 offset = GUINT64_TO_LE (loc->offset);
+  memcpy (rec, loc->hash, COWMAIL_KEY_SIZE);
+  memcpy (rec + COWMAIL_KEY_SIZE, &segment, sizeof (segment));
+  memcpy (rec + COWMAIL_KEY_SIZE + 4, &length, sizeof (length));
+  memcpy (rec + COWMAIL_KEY_SIZE + 8, &offset, sizeof (offset));
+}
+
+
+
+static void
+cowmail_store_loc_decode (cowmail_index_entry *loc,
+                          const guchar        *rec)
+{
+  memcpy (loc->hash, rec, COWMAIL_KEY_SIZE);
+  memcpy (&loc->segment, rec + COWMAIL_KEY_SIZE, sizeof (loc->segment));
+  memcpy (&loc->length, rec + COWMAIL_KEY_SIZE + 4, sizeof (loc->length));
+  memcpy (&loc->offset, rec + COWMAIL_KEY_SIZE + 8, sizeof (loc->offset));
+  loc->segment = GUINT32_FROM_LE (loc->segment);
+  loc->length = GUINT32_FROM_LE (loc->length);
+  loc->offset = GUINT64_FROM_LE (loc->offset);
+}
+
+
+
+static gboolean
+cowmail_store_pwrite (gint           fd,
+                      gconstpointer  data,
+                      gsize          len,
+                      guint64        offset,
+                      GError       **error)
+{
+  while (len > 0) {
+    gssize n = pwrite (fd, data, len, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno), "write: %s", g_strerror (errno));
+      return FALSE;
+    }
+    data = (const guchar *) data + n;
+    len -= n;
+    offset += n;
+  }
+  return TRUE;
+}
+
+
+
+static gsize
+cowmail_store_pread (gint      fd,
+                     gpointer  data,
+                     gsize     len,
+                     guint64   offset)
+{
+  gsize done = 0;
+  while (done < len) {
+    gssize n = pread (fd, (guchar *) data + done, len - done, offset + done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  return done;
+}
+
+
+
+static gint
+cowmail_store_open_file (const gchar  *path,
+                         const gchar  *name,
+                         GError      **error)
+{
+  g_autofree gchar *fname = g_build_filename (path, name, NULL);
+  gint fd = open (fname, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0)
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno), "%s: %s", fname, g_strerror (errno));
+  return fd;
+}
+
+
+
+static gboolean
+cowmail_store_open_segment (cowmail_store  *store,
+                            guint32         segment,
+                            GError        **error)
+{
+  g_autofree gchar *name = g_strdup_printf ("body.%08u", segment);
+  gint fd = cowmail_store_open_file (store->path, name, error);
+  if (fd < 0)
+    return FALSE;
+  g_rw_lock_writer_lock (&store->lock);
+  g_array_append_val (store->segments, fd);
+  g_rw_lock_writer_unlock (&store->lock);
+  return TRUE;
+}
+
+
+
+/* opens the body segments that exist, or creates the first one */
+static gboolean
+cowmail_store_open_segments (cowmail_store  *store,
+                             GError        **error)
+{
+  for (guint32 s = 0; ; s++) {
+    g_autofree gchar *name = g_strdup_printf ("body.%08u", s);
+    g_autofree gchar *fname = g_build_filename (store->path, name, NULL);
+    if (!g_file_test (fname, G_FILE_TEST_EXISTS))
+      break;
+    if (!cowmail_store_open_segment (store, s, error))
+      return FALSE;
+  }
+  if (store->segments->len == 0 && !cowmail_store_open_segment (store, 0, error))
+    return FALSE;
+
+  /* append after whatever the last segment contains, torn bodies included */
+  struct stat st;
+  store->segment = store->segments->len - 1;
+  fstat (g_array_index (store->segments, gint, store->segment), &st);
+  store->segment_end = st.st_size;
+  return TRUE;
+}
+
+
+
+/*
+ * Cuts off records that were torn by a crash, i.e. heads without a location,
+ * locations without a head and locations beyond the end of their segment.
+ * Records are only appended, so only the last ones can be torn.
+ */
+static gboolean
+cowmail_store_recover (cowmail_store  *store,
+                       GError        **error)
+{
+  struct stat hst, lst;
+  fstat (store->heads_fd, &hst);
+  fstat (store->locs_fd, &lst);
+  guint64 count = MIN (hst.st_size / COWMAIL_HEAD_SIZE, lst.st_size / COWMAIL_STORE_LOC_SIZE);
+
+  while (count > 0) {
+    guchar rec[COWMAIL_STORE_LOC_SIZE];
+    cowmail_index_entry loc;
+    struct stat sst;
+    if (cowmail_store_pread (store->locs_fd, rec, sizeof (rec), (count - 1) * COWMAIL_STORE_LOC_SIZE) < sizeof (rec))
+      break;
+    cowmail_store_loc_decode (&loc, rec);
+    if (loc.segment < store->segments->len &&
+        fstat (g_array_index (store->segments, gint, loc.segment), &sst) == 0 &&
+        loc.offset + loc.length <= (guint64) sst.st_size)
+      break;
+    count--;
+  }
+  if (count < (guint64) hst.st_size / COWMAIL_HEAD_SIZE || count < (guint64) lst.st_size / COWMAIL_STORE_LOC_SIZE)
+    g_printerr ("COWMAIL WARNING: Store truncated to %" G_GUINT64_FORMAT " messages.\n", count);
+
+  if (ftruncate (store->heads_fd, count * COWMAIL_HEAD_SIZE) < 0 ||
+      ftruncate (store->locs_fd, count * COWMAIL_STORE_LOC_SIZE) < 0) {
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno), "truncate: %s", g_strerror (errno));
+    return FALSE;
+  }
+  store->written = store->visible = count;
+  store->synced_segment = store->segment;
+  return TRUE;
+}
+
+
+
+/* brings the index up to date with the location records */
+static gboolean
+cowmail_store_reindex (cowmail_store  *store,
+                       GError        **error)
+{
+  guint64 count = store->written;
+  if (cowmail_index_records (store->index) > count && !cowmail_index_reset (store->index, error))
+    return FALSE;
+
+  g_autofree guchar *recs = g_malloc (COWMAIL_STORE_LOC_SIZE * COWMAIL_STORE_LOC_BATCH);
+  for (guint64 i = cowmail_index_records (store->index); i < count; ) {
+    gsize n = MIN (count - i, COWMAIL_STORE_LOC_BATCH);
+    if (cowmail_store_pread (store->locs_fd, recs, n * COWMAIL_STORE_LOC_SIZE, i * COWMAIL_STORE_LOC_SIZE)
+        < n * COWMAIL_STORE_LOC_SIZE) {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Cannot read location records");
+      return FALSE;
+    }
+    for (gsize r = 0; r < n; r++, i++) {
+      cowmail_index_entry loc;
+      cowmail_store_loc_decode (&loc, recs + r * COWMAIL_STORE_LOC_SIZE);
+      if (!cowmail_index_insert (store->index, &loc, error))
+        return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+
+
+/*
+ * Makes everything written so far durable and visible, then wakes the waiting
+ * puts and calls the commit function. Puts that come in during a sync share
+ * the next one.
+ */
+static gpointer
+cowmail_store_flush (gpointer data)
+{
+  cowmail_store *store = data;
+
+  g_mutex_lock (&store->sync_mutex);
+  while (!store->stop) {
+    g_mutex_lock (&store->write_mutex);
+    guint64 target = store->written;
+    guint32 segment = store->segment;
+    g_mutex_unlock (&store->write_mutex);
+    if (target <= cowmail_store_count (store)) {
+      g_cond_wait (&store->flush_cond, &store->sync_mutex);
+      continue;
+    }
+
+    /* bodies first, then locations and heads */
+    g_mutex_unlock (&store->sync_mutex);
+    gboolean ok = TRUE;
+    for (guint32 s = store->synced_segment; s <= segment && ok; s++) {
+      g_rw_lock_reader_lock (&store->lock);
+      gint fd = g_array_index (store->segments, gint, s);
+      g_rw_lock_reader_unlock (&store->lock);
+      ok = fdatasync (fd) == 0;
+    }
+    ok = ok && fdatasync (store->locs_fd) == 0 && fdatasync (store->heads_fd) == 0;
+    gint errsv = errno;
+    g_mutex_lock (&store->sync_mutex);
+
+    if (ok) {
+      store->synced_segment = segment;
+      g_rw_lock_writer_lock (&store->lock);
+      store->visible = MAX (store->visible, target);
+      g_rw_lock_writer_unlock (&store->lock);
+    } else {
+      g_printerr ("COWMAIL ERROR: Cannot sync store: %s\n", g_strerror (errsv));
+      store->failed = MAX (store->failed, target);
+    }
+    g_cond_broadcast (&store->commit_cond);
+    if (store->commit_func)
+      store->commit_func (store->commit_data);
+    if (!ok)
+      g_cond_wait_until (&store->flush_cond, &store->sync_mutex, g_get_monotonic_time () + COWMAIL_STORE_RETRY);
+  }
+  g_mutex_unlock (&store->sync_mutex);
+  return NULL;
+}
+
+
+
+cowmail_store *
+cowmail_store_open (const gchar  *path,
+                    GError      **error)
+{
+  if (g_mkdir_with_parents (path, 0700) < 0) {
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno), "%s: %s", path, g_strerror (errno));
+    return NULL;
+  }
+
+  cowmail_store *store = g_new0 (cowmail_store, 1);
+  store->path = g_strdup (path);
+  store->sync = TRUE;
+  store->locs_fd = -1;
+  g_mutex_init (&store->write_mutex);
+  g_mutex_init (&store->sync_mutex);
+  g_cond_init (&store->flush_cond);
+  g_cond_init (&store->commit_cond);
+  g_rw_lock_init (&store->lock);
+  store->segments = g_array_new (FALSE, FALSE, sizeof (gint));
+  g_autofree gchar *index = g_build_filename (path, "index", NULL);
+
+  if ((store->heads_fd = cowmail_store_open_file (path, "heads", error)) < 0 ||
+      (store->locs_fd = cowmail_store_open_file (path, "locs", error)) < 0 ||
+      !cowmail_store_open_segments (store, error) ||
+      !cowmail_store_recover (store, error) ||
+      !(store->index = cowmail_index_open (index, error)) ||
+      !cowmail_store_reindex (store, error)) {
+    cowmail_store_close (store);
+    return NULL;
+  }
+  store->flusher = g_thread_new ("cowmail-flush", cowmail_store_flush, store);
+  return store;
+}
+
+
+
+void
+cowmail_store_close (cowmail_store *store)
+{
+  if (store->flusher) {
+    g_mutex_lock (&store->sync_mutex);
+    store->stop = TRUE;
+    g_cond_signal (&store->flush_cond);
+    g_mutex_unlock (&store->sync_mutex);
+    g_thread_join (store->flusher);
+  }
+
+  for (guint i = 0; i < store->segments->len; i++)
+    close (g_array_index (store->segments, gint, i));
+  if (store->heads_fd >= 0)
+    close (store->heads_fd);
+  if (store->locs_fd >= 0)
+    close (store->locs_fd);
+
+  g_array_unref (store->segments);
+  if (store->index)
+    cowmail_index_close (store->index);
+  g_rw_lock_clear (&store->lock);
+  g_cond_clear (&store->commit_cond);
+  g_cond_clear (&store->flush_cond);
+  g_mutex_clear (&store->sync_mutex);
+  g_mutex_clear (&store->write_mutex);
+  g_free (store->path);
+  g_free (store);
+}
+
+
+
+void
+cowmail_store_set_sync (cowmail_store *store,
+                        gboolean       sync)
+{
+  store->sync = sync;
+}
+
+
+
+void
+cowmail_store_set_commit_func (cowmail_store             *store,
+                               cowmail_store_commit_func  func,
+                               gpointer                   userdata)
+{
+  g_mutex_lock (&store->sync_mutex);
+  store->commit_func = func;
+  store->commit_data = userdata;
+  g_mutex_unlock (&store->sync_mutex);
+}
+
+
+
+gboolean
+cowmail_store_append (cowmail_store  *store,
+                      const guchar   *msg,
+                      gsize           len,
+                      guint64        *seq,
+                      GError        **error)
+{
+  if (len < COWMAIL_HEAD_SIZE + COWMAIL_TAG_SIZE || len - COWMAIL_HEAD_SIZE > G_MAXUINT32) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Invalid message size");
+    return FALSE;
+  }
+
+  cowmail_index_entry loc;
+  loc.length = len - COWMAIL_HEAD_SIZE;
+  gnutls_hash_fast (GNUTLS_DIG_SHA256, msg + COWMAIL_HEAD_SIZE, loc.length, loc.hash);
+
+  g_mutex_lock (&store->write_mutex);
+
+  /* a replayed message is stored already, and durable once everything appended so far is */
+  cowmail_index_entry found;
+  g_rw_lock_reader_lock (&store->lock);
+  gboolean replay = store->written > 0 && cowmail_index_lookup (store->index, loc.hash, &found);
+  g_rw_lock_reader_unlock (&store->lock);
+  if (replay) {
+    *seq = store->written - 1;
+    g_mutex_unlock (&store->write_mutex);
+    return TRUE;
+  }
+
+  if (store->segment_end > 0 && store->segment_end + loc.length > COWMAIL_STORE_SEGMENT_SIZE) {
+    if (!cowmail_store_open_segment (store, store->segment + 1, error)) {
+      g_mutex_unlock (&store->write_mutex);
+      return FALSE;
+    }
+    store->segment++;
+    store->segment_end = 0;
+  }
+  loc.segment = store->segment;
+  loc.offset = store->segment_end;
+
+  g_rw_lock_reader_lock (&store->lock);
+  gint fd = g_array_index (store->segments, gint, loc.segment);
+  g_rw_lock_reader_unlock (&store->lock);
+
+  guchar rec[COWMAIL_STORE_LOC_SIZE];
+  cowmail_store_loc_encode (&loc, rec);
+  *seq = store->written;
+  if (!cowmail_store_pwrite (fd, msg + COWMAIL_HEAD_SIZE, loc.length, loc.offset, error) ||
+      !cowmail_store_pwrite (store->locs_fd, rec, sizeof (rec), *seq * COWMAIL_STORE_LOC_SIZE, error) ||
+      !cowmail_store_pwrite (store->heads_fd, msg, COWMAIL_HEAD_SIZE, *seq * COWMAIL_HEAD_SIZE, error)) {
+    g_mutex_unlock (&store->write_mutex);
+    return FALSE;
+  }
+  store->segment_end += loc.length;
+  store->written++;
+
+  /* the location record is the truth, a broken index is rebuilt from it on the next open */
+  g_autoptr (GError) ierror = NULL;
+  g_rw_lock_writer_lock (&store->lock);
+  if (!cowmail_index_insert (store->index, &loc, &ierror))
+    g_printerr ("COWMAIL ERROR: Cannot index message: %s\n", ierror->message);
+  if (!store->sync)
+    store->visible = store->written;
+  g_rw_lock_writer_unlock (&store->lock);
+  g_mutex_unlock (&store->write_mutex);
+
+  if (store->sync) {
+    g_mutex_lock (&store->sync_mutex);
+    g_cond_signal (&store->flush_cond);
+    g_mutex_unlock (&store->sync_mutex);
+  }
+  return TRUE;
+}
+
+
+
+/* like cowmail_store_is_durable(), with the sync mutex held */
+static gboolean
+cowmail_store_check (cowmail_store  *store,
+                     guint64         seq,
+                     GError        **error)
+{
+  if (seq < cowmail_store_count (store))
+    return TRUE;
+  if (seq < store->failed)
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Cannot sync store");
+  return FALSE;
+}
+
+
+
+gboolean
+cowmail_store_is_durable (cowmail_store  *store,
+                          guint64         seq,
+                          GError        **error)
+{
+  g_mutex_lock (&store->sync_mutex);
+  gboolean ok = cowmail_store_check (store, seq, error);
+  g_mutex_unlock (&store->sync_mutex);
+  return ok;
+}
+
+
+
+gboolean
+cowmail_store_put (cowmail_store  *store,
+                   const guchar   *msg,
+                   gsize           len,
+                   GError        **error)
+{
+  guint64 seq;
+  if (!cowmail_store_append (store, msg, len, &seq, error))
+    return FALSE;
+
+  gboolean ok;
+  g_autoptr (GError) serror = NULL;
+  g_mutex_lock (&store->sync_mutex);
+  while (!(ok = cowmail_store_check (store, seq, &serror)) && !serror)
+    g_cond_wait (&store->commit_cond, &store->sync_mutex);
+  g_mutex_unlock (&store->sync_mutex);
+  if (serror)
+    g_propagate_error (error, g_steal_pointer (&serror));
+  return ok;
+}
+
+
+
+guint64
+cowmail_store_count (cowmail_store *store)
+{
+  g_rw_lock_reader_lock (&store->lock);
+  guint64 n = store->visible;
+  g_rw_lock_reader_unlock (&store->lock);
+  return n;
+}
+
+
+
+gsize
+cowmail_store_read_heads (cowmail_store *store,
+                          guint64        first,
+                          gsize          n,
+                          guchar        *heads)
+{
+  guint64 count = cowmail_store_count (store);
+  n = first < count ? MIN (n, count - first) : 0;
+  return cowmail_store_pread (store->heads_fd, heads, n * COWMAIL_HEAD_SIZE, first * COWMAIL_HEAD_SIZE) / COWMAIL_HEAD_SIZE;
+}
+
+
+
+GBytes *
+cowmail_store_get (cowmail_store *store,
+                   const guchar  *hash)
+{
+  cowmail_index_entry loc;
+  gint fd = -1;
+
+  g_rw_lock_reader_lock (&store->lock);
+  if (cowmail_index_lookup (store->index, hash, &loc) && loc.segment < store->segments->len)
+    fd = g_array_index (store->segments, gint, loc.segment);
+  g_rw_lock_reader_unlock (&store->lock);
+  if (fd < 0)
+    return NULL;
+
+  guchar *body = g_malloc (MAX (loc.length, 1));
+  if (cowmail_store_pread (fd, body, loc.length, loc.offset) < loc.length) {
+    g_free (body);
+    return NULL;
+  }
+  return g_bytes_new_take (body, loc.length);
+}
@@ -0,0 +1,187 @@
+/* cowmail-store.h
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "libcowmail.h"
+
+/* a new body segment is started when the current one would exceed this */
+#define COWMAIL_STORE_SEGMENT_SIZE (256 * 1024 * 1024)
+
+/*
+ * Size of a location record: body hash (32), segment (4), length (4) and
+ * offset (8), integers in little endian. Record i belongs to head i.
+ */
+#define COWMAIL_STORE_LOC_SIZE     48
+
+
+
+typedef struct _cowmail_store cowmail_store;
+
+/**
+ * cowmail_store_commit_func:
+ * @userdata: user data
+ *
+ * Called on the flush thread after a commit, whether it succeeded or not.
+ */
+typedef void     (*cowmail_store_commit_func) (gpointer             userdata);
+
+
+
+/**
+ * cowmail_store_open:
+ * @path: directory of the store, created if needed
+ * @error: return location for an error
+ *
+ * Opens an append-only message store. It consists of:
+ * - heads: all heads as densely packed 80 byte records, so that a LIST is one
+ *   sequential read and the sequence number of a head is its record number
+ * - locs: one location record per head, see COWMAIL_STORE_LOC_SIZE
+ * - body.NNNNNNNN: the bodies, appended to segments of at most
+ *   COWMAIL_STORE_SEGMENT_SIZE bytes
+ * - index: a memory-mapped hash table from body hash to location, see
+ *   cowmail_index_open(), rebuilt from locs if it is missing or stale
+ *
+ * Records torn by a crash are cut off when the store is opened. A flush thread
+ * makes appended messages durable, see cowmail_store_append().
+ *
+ * Returns: the store, or NULL on error
+ */
+cowmail_store     *cowmail_store_open      (const gchar           *path,
+                                            GError               **error);
+
+/**
+ * cowmail_store_close:
+ * @store: the store
+ *
+ * Stops the flush thread, closes the store and frees it.
+ */
+void               cowmail_store_close     (cowmail_store         *store);
+
+/**
+ * cowmail_store_set_sync:
+ * @store: the store
+ * @sync: whether cowmail_store_put() waits for the data to reach the disk
+ *
+ * Syncing is on by default. Concurrent puts share one sync. Without syncing,
+ * appended heads are visible at once.
+ */
+void               cowmail_store_set_sync  (cowmail_store         *store,
+                                            gboolean               sync);
+
+/**
+ * cowmail_store_set_commit_func:
+ * @store: the store
+ * @func: (nullable): function to call after every commit
+ * @userdata: user data for @func
+ *
+ * Once this returns, the previous function is not called any more.
+ */
+void               cowmail_store_set_commit_func (cowmail_store             *store,
+                                                  cowmail_store_commit_func  func,
+                                                  gpointer                   userdata);
+
+/**
+ * cowmail_store_append:
+ * @store: the store
+ * @msg: head and body of a message, as sent with PUT
+ * @len: length of @msg
+ * @seq: return location for the sequence number of the head
+ * @error: return location for an error
+ *
+ * Appends the body to the current segment and the head to the head file
+ * without waiting for the disk. The flush thread syncs everything appended
+ * since its last commit in one go, makes the heads visible to LIST and calls
+ * the commit function; cowmail_store_is_durable() tells the outcome.
+ *
+ * A message whose body is stored already is not appended again, so that a
+ * replayed PUT takes no space; @seq is then the last appended head.
+ *
+ * Returns: TRUE on success
+ */
+gboolean           cowmail_store_append    (cowmail_store         *store,
+                                            const guchar          *msg,
+                                            gsize                  len,
+                                            guint64               *seq,
+                                            GError               **error);
+
+/**
+ * cowmail_store_is_durable:
+ * @store: the store
+ * @seq: sequence number from cowmail_store_append()
+ * @error: return location for an error
+ *
+ * Returns: TRUE if the head is on disk and visible, FALSE with @error set if
+ * its commit failed, and FALSE without error while it is not committed yet
+ */
+gboolean           cowmail_store_is_durable (cowmail_store        *store,
+                                             guint64               seq,
+                                             GError              **error);
+
+/**
+ * cowmail_store_put:
+ * @store: the store
+ * @msg: head and body of a message, as sent with PUT
+ * @len: length of @msg
+ * @error: return location for an error
+ *
+ * Like cowmail_store_append(), but waits until the message is durable.
+ *
+ * Returns: TRUE on success
+ */
+gboolean           cowmail_store_put       (cowmail_store         *store,
+                                            const guchar          *msg,
+                                            gsize                  len,
+                                            GError               **error);
+
+/**
+ * cowmail_store_count:
+ * @store: the store
+ *
+ * Returns: the number of heads visible to LIST, which is also the cursor after
+ * the last head
+ */
+guint64            cowmail_store_count     (cowmail_store         *store);
+
+/**
+ * cowmail_store_read_heads:
+ * @store: the store
+ * @first: sequence number of the first head
+ * @n: maximum number of heads
+ * @heads: buffer for @n heads
+ *
+ * Reads consecutive heads.
+ *
+ * Returns: the number of heads read
+ */
+gsize              cowmail_store_read_heads (cowmail_store        *store,
+                                             guint64               first,
+                                             gsize                 n,
+                                             guchar               *heads);
+
+/**
+ * cowmail_store_get:
+ * @store: the store
+ * @hash: SHA-256 of the body
+ *
+ * Reads the body with the given hash.
+ *
+ * Returns: the body, or NULL if there is none
+ */
+GBytes            *cowmail_store_get       (cowmail_store         *store,
+                                            const guchar          *hash);
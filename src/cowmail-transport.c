@@ -0,0 +1,185 @@
+/* cowmail-transport.c
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cowmail-transport.h"
+#include "libcowmail.h"
+#include <gio/gunixsocketaddress.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+
+
+/* transports that worked last per host, for automatic selection */
+static GMutex known_lock;
+static GHashTable *known = NULL;
+
+
+
+cowmail_transport
+cowmail_transport_parse (const gchar  *uri,
+                         gchar       **address)
+{
+  if (g_str_has_prefix (uri, "unix:")) {
+    const gchar *path = uri + strlen ("unix:");
+    /* accept unix:///path as well as unix:/path */
+    if (g_str_has_prefix (path, "//"))
+      path += 2;
+    *address = g_strdup (path);
+    return COWMAIL_TRANSPORT_UNIX;
+  }
+  if (g_str_has_prefix (uri, "tcp://")) {
+    *address = g_strdup (uri + strlen ("tcp://"));
+    return COWMAIL_TRANSPORT_TCP;
+  }
+  if (g_str_has_prefix (uri, "sctp://")) {
+    *address = g_strdup (uri + strlen ("sctp://"));
+    return COWMAIL_TRANSPORT_SCTP;
+  }
+  *address = g_strdup (uri);
+  return COWMAIL_TRANSPORT_AUTO;
+}
+
+
+
+gchar *
+cowmail_transport_default_socket (void)
+{
+  return g_build_filename (g_get_user_runtime_dir (), COWMAIL_SOCKET_NAME, NULL);
+}
+
+
+
+/* only a server on this machine that listens on the default port can own the default socket */
+static gboolean
+cowmail_transport_is_local (const gchar *address)
+{
+  g_autoptr (GSocketConnectable) connectable = g_network_address_parse (address, COWMAIL_DEFAULT_PORT, NULL);
+  if (!connectable || g_network_address_get_port (G_NETWORK_ADDRESS (connectable)) != COWMAIL_DEFAULT_PORT)
+    return FALSE;
+
+  const gchar *host = g_network_address_get_hostname (G_NETWORK_ADDRESS (connectable));
+  if (g_ascii_strcasecmp (host, "localhost") == 0)
+    return TRUE;
+  g_autoptr (GInetAddress) inet = g_inet_address_new_from_string (host);
+  return inet && g_inet_address_get_is_loopback (inet);
+}
+
+
+
+/* sets the TCP options on the socket before it connects */
+static void
+on_tcp_event (GSocketClient      *client,
+              GSocketClientEvent  event,
+              GSocketConnectable *connectable,
+              GIOStream          *connection,
+              gpointer            userdata)
+{
+  gboolean fastopen = GPOINTER_TO_INT (userdata);
+  (void) client;
+  (void) connectable;
+
+  if (event != G_SOCKET_CLIENT_CONNECTING)
+    return;
+  GSocket *socket = g_socket_connection_get_socket (G_SOCKET_CONNECTION (connection));
+  g_socket_set_option (socket, IPPROTO_TCP, TCP_NODELAY, 1, NULL);
+#ifdef TCP_FASTOPEN_CONNECT
+  /* the SYN waits for the first write and carries it, so errors show up there */
+  if (fastopen)
+    g_socket_set_option (socket, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1, NULL);
+#else
+  (void) fastopen;
+#endif
+}
+
+
+
+static GSocketConnection *
+cowmail_transport_connect_one (cowmail_transport   transport,
+                               const gchar        *address,
+                               gboolean            fastopen,
+                               GCancellable       *cancellable,
+                               GError            **error)
+{
+  g_autoptr (GSocketClient) client = g_socket_client_new ();
+
+  if (transport == COWMAIL_TRANSPORT_UNIX) {
+    g_autoptr (GSocketAddress) unix_address = g_unix_socket_address_new (address);
+    return g_socket_client_connect (client, G_SOCKET_CONNECTABLE (unix_address), cancellable, error);
+  }
+
+  if (transport == COWMAIL_TRANSPORT_SCTP) {
+    g_socket_client_set_protocol (client, G_SOCKET_PROTOCOL_SCTP);
+  } else {
+    g_socket_client_set_protocol (client, G_SOCKET_PROTOCOL_TCP);
+    g_signal_connect (client, "event", G_CALLBACK (on_tcp_event), GINT_TO_POINTER (fastopen));
+  }
+  return g_socket_client_connect_to_host (client, address, COWMAIL_DEFAULT_PORT, cancellable, error);
+}
+
+
+
+GSocketConnection *
+cowmail_transport_connect (const gchar   *uri,
+                           GCancellable  *cancellable,
+                           GError       **error)
+{
+  g_autofree gchar *address = NULL;
+  cowmail_transport transport = cowmail_transport_parse (uri, &address);
+  if (transport != COWMAIL_TRANSPORT_AUTO)
+    return cowmail_transport_connect_one (transport, address, transport == COWMAIL_TRANSPORT_TCP,
+                                          cancellable, error);
+
+  g_mutex_lock (&known_lock);
+  if (!known)
+    known = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  cowmail_transport last = GPOINTER_TO_INT (g_hash_table_lookup (known, address));
+  g_mutex_unlock (&known_lock);
+
+  g_autofree gchar *path = cowmail_transport_is_local (address) ? cowmail_transport_default_socket () : NULL;
+  cowmail_transport order[] = { last, COWMAIL_TRANSPORT_UNIX, COWMAIL_TRANSPORT_TCP, COWMAIL_TRANSPORT_SCTP };
+  g_autoptr (GError) lerror = NULL;
+
+  for (guint t = 0; t < G_N_ELEMENTS (order); t++) {
+    if (order[t] == COWMAIL_TRANSPORT_AUTO || (t > 0 && order[t] == last))
+      continue;
+    if (order[t] == COWMAIL_TRANSPORT_UNIX && (!path || !g_file_test (path, G_FILE_TEST_EXISTS)))
+      continue;
+
+    /* without Fast Open, so that a host without TCP fails here and not on the first write */
+    g_clear_error (&lerror);
+    GSocketConnection *connection = cowmail_transport_connect_one (order[t], order[t] == COWMAIL_TRANSPORT_UNIX ? path : address,
+                                                                   FALSE, cancellable, &lerror);
+    if (connection) {
+      g_mutex_lock (&known_lock);
+      g_hash_table_replace (known, g_strdup (address), GINT_TO_POINTER (order[t]));
+      g_mutex_unlock (&known_lock);
+      return connection;
+    }
+    if (g_error_matches (lerror, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      break;
+  }
+
+  g_mutex_lock (&known_lock);
+  g_hash_table_remove (known, address);
+  g_mutex_unlock (&known_lock);
+  if (lerror)
+    g_propagate_error (error, g_steal_pointer (&lerror));
+  else
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "No transport for %s", uri);
+  return NULL;
+}
@@ -0,0 +1,84 @@
+/* cowmail-transport.h
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+/* file name of the Unix domain socket of a local server in the user runtime directory */
+#define COWMAIL_SOCKET_NAME "cowmail.sock"
+/* pending Fast Open connections a TCP listener accepts */
+#define COWMAIL_FASTOPEN_QUEUE 256
+
+
+
+/*
+ * A server is given as one of
+ *
+ *   unix:PATH            a Unix domain socket
+ *   tcp://HOST[:PORT]    TCP with TCP_NODELAY and Fast Open
+ *   sctp://HOST[:PORT]   SCTP
+ *   HOST[:PORT]          the first of these that connects, in the order
+ *                        Unix socket (loopback hosts on the default port
+ *                        only), TCP, SCTP
+ *
+ * The port defaults to COWMAIL_DEFAULT_PORT.
+ */
+typedef enum
+{
+  COWMAIL_TRANSPORT_AUTO,
+  COWMAIL_TRANSPORT_UNIX,
+  COWMAIL_TRANSPORT_TCP,
+  COWMAIL_TRANSPORT_SCTP,
+} cowmail_transport;
+
+
+
+/**
+ * cowmail_transport_parse:
+ * @uri: the server
+ * @address: return location for the socket path or the host and port
+ *
+ * Returns: the transport that @uri asks for
+ */
+cowmail_transport  cowmail_transport_parse (const gchar           *uri,
+                                            gchar                **address);
+
+/**
+ * cowmail_transport_connect:
+ * @uri: the server
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for an error
+ *
+ * Connects with the transport that @uri asks for. With automatic selection
+ * the transport that worked last for the host is tried first, so only the
+ * first connection to a host pays for the fallback.
+ *
+ * Returns: the connection, or NULL with @error set
+ */
+GSocketConnection *cowmail_transport_connect (const gchar         *uri,
+                                              GCancellable        *cancellable,
+                                              GError             **error);
+
+/**
+ * cowmail_transport_default_socket:
+ *
+ * Returns: the path of the Unix domain socket a local server listens on by
+ * default
+ */
+gchar             *cowmail_transport_default_socket (void);
@@ -29,14 +29,49 @@ struct _CowmailWindow
   GtkAboutDialog       *dg_about;
   GtkListBox           *lb_messages;
 
-  cowmail_id           *id;
+  GList                *ids;
   GList                *contacts;
+  GHashTable           *cursors;
+  cowmail_outbox       *outbox;
+  cowmail_mailbox      *mailbox;
+
+  /* the running update, if any */
+  GCancellable         *cancellable;
+  guint                 update_pending;
+  GHashTable           *update_hashes;
 };
 
 G_DEFINE_TYPE (CowmailWindow, cowmail_window, GTK_TYPE_APPLICATION_WINDOW)
 
 
 
+/* the update of one server, which runs concurrently with those of the others */
+typedef struct
+{
+  CowmailWindow *window;
+  gchar         *server;
+  GList         *tickets;
+  guint64        next;
+  guint64        failed;
+} cowmail_window_poll;
+
+
+
+/* the servers in the entry, separated by commas or spaces */
+static gchar **
+cowmail_window_get_servers (CowmailWindow *self)
+{
+  g_auto (GStrv) parts = g_strsplit_set (gtk_entry_get_text (self->en_server), ", \t", -1);
+  GPtrArray *servers = g_ptr_array_new ();
+  for (guint i = 0; parts[i]; i++)
+    if (*parts[i])
+      g_ptr_array_add (servers, g_strdup (parts[i]));
+  g_ptr_array_add (servers, NULL);
+  return (gchar **) g_ptr_array_free (servers, FALSE);
+}
+
+
+
 static void
 on_bn_new_clicked (GtkButton     *button,
                    CowmailWindow *self)
@@ -44,13 +79,137 @@ on_bn_new_clicked (GtkButton     *button,
   GTK_IS_BUTTON (button);
   COWMAIL_IS_WINDOW (self);
 
-  CowmailWriteWindow *win = cowmail_write_window_new (gtk_entry_get_text (self->en_server),
-                                                      self->contacts);
+  /* new messages go to the first server */
+  g_auto (GStrv) servers = cowmail_window_get_servers (self);
+  CowmailWriteWindow *win = cowmail_write_window_new (servers[0] ? servers[0] : "localhost",
+                                                      self->contacts,
+                                                      self->outbox);
   gtk_window_present (GTK_WINDOW (win));
 }
 
 
 
+static GFile *
+cowmail_window_seen_file (cowmail_id *id)
+{
+  g_autofree gchar *fp = cowmail_id_fingerprint (id);
+  g_autofree gchar *seenpath = g_strjoin ("/", g_get_user_data_dir (), "cowmail", "seen", fp, NULL);
+  return g_file_new_for_path (seenpath);
+}
+
+
+
+static void
+cowmail_window_store_cursors (CowmailWindow *self)
+{
+  g_autofree gchar *cursorpath = g_strjoin ("/", g_get_user_config_dir (), "cowmail", "cursors.conf", NULL);
+  g_autoptr (GFile) cursorfile = g_file_new_for_path (cursorpath);
+  cowmail_cursors_store (cursorfile, self->cursors);
+
+  for (GList *idl = self->ids; idl; idl = idl->next)
+    cowmail_seen_store (((cowmail_id *) idl->data)->seen);
+}
+
+
+
+/* ends the update of one server, and the whole update with the last one */
+static void
+cowmail_window_poll_done (cowmail_window_poll *poll,
+                          GError              *error)
+{
+  CowmailWindow *self = poll->window;
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_BUSY))
+    g_printerr ("COWMAIL ERROR UPDATE %s: Server busy, the next update tries again.\n", poll->server);
+  else if (error && !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    g_printerr ("COWMAIL ERROR UPDATE %s: %s\n", poll->server, error->message);
+
+  /* only get what arrived since this update next time, but not past a message the server did not get to */
+  if (!error)
+    for (GList *idl = self->ids; idl; idl = idl->next)
+      cowmail_cursor_set (self->cursors, poll->server, idl->data, MIN (poll->next, poll->failed));
+
+  g_list_free_full (poll->tickets, g_free);
+  g_free (poll->server);
+  g_free (poll);
+
+  if (--self->update_pending > 0)
+    return;
+  cowmail_window_store_cursors (self);
+  g_clear_pointer (&self->update_hashes, g_hash_table_unref);
+  g_clear_object (&self->cancellable);
+  g_object_unref (self);
+}
+
+
+
+static void
+on_get_done (GObject       *source,
+             GAsyncResult  *result,
+             gpointer       userdata)
+{
+  (void) source;
+  cowmail_window_poll *poll = userdata;
+  CowmailWindow *self = poll->window;
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GPtrArray) msgs = cowmail_get_finish (result, &error);
+
+  /*
+   * Remember the first message that the server did not get to, so that the
+   * next update lists it again. A message that came back missing or broken
+   * stays that way, so it must not hold up the cursor.
+   */
+  GList *t = poll->tickets;
+  for (guint i = 0; t; i++, t = t->next) {
+    const gchar *msg = msgs && i < msgs->len ? g_ptr_array_index (msgs, i) : NULL;
+    if (msg) {
+      cowmail_mailbox_add (self->mailbox, t->data, msg);
+      gtk_list_box_prepend (self->lb_messages, GTK_WIDGET (cowmail_msg_row_new (msg)));
+    } else if (!msgs || i >= msgs->len) {
+      poll->failed = MIN (poll->failed, ((cowmail_ticket *) t->data)->seq);
+    }
+  }
+  if (msgs)
+    gtk_widget_show_all (GTK_WIDGET (self->lb_messages));
+  cowmail_window_poll_done (poll, error);
+}
+
+
+
+static void
+on_list_done (GObject       *source,
+              GAsyncResult  *result,
+              gpointer       userdata)
+{
+  (void) source;
+  cowmail_window_poll *poll = userdata;
+  CowmailWindow *self = poll->window;
+  g_autoptr (GError) error = NULL;
+  GList *tickets = cowmail_list_finish (result, &poll->next, &error);
+
+  /*
+   * Messages in the mailbox are not fetched again, and a message that
+   * several servers hold is fetched only from the one that listed it first.
+   */
+  for (GList *t = tickets; t; t = t->next) {
+    cowmail_ticket *ticket = t->data;
+    if (cowmail_mailbox_contains (self->mailbox, ticket->hash) ||
+        !g_hash_table_add (self->update_hashes, g_bytes_new (ticket->hash, COWMAIL_KEY_SIZE)))
+      g_free (ticket);
+    else
+      poll->tickets = g_list_prepend (poll->tickets, ticket);
+  }
+  g_list_free (tickets);
+  poll->tickets = g_list_reverse (poll->tickets);
+
+  if (error || !poll->tickets) {
+    cowmail_window_poll_done (poll, error);
+    return;
+  }
+  cowmail_get_async (poll->server, poll->tickets, self->cancellable, on_get_done, poll);
+}
+
+
+
 static void
 on_bn_update_clicked (GtkButton     *button,
                       CowmailWindow *self)
@@ -58,16 +217,65 @@ on_bn_update_clicked (GtkButton     *button,
   GTK_IS_BUTTON (button);
   COWMAIL_IS_WINDOW (self);
 
-  GList *heads = cowmail_list (gtk_entry_get_text (self->en_server), self->id);
-  for (GList *h = heads; h; h = h->next) {
-    g_autofree gchar *msg = cowmail_get (gtk_entry_get_text (self->en_server), h->data);
-    if (msg) {
-      CowmailMsgRow *row = cowmail_msg_row_new (msg);
-      gtk_list_box_prepend (self->lb_messages, GTK_WIDGET (row));
-      gtk_widget_show_all (GTK_WIDGET (self->lb_messages));
-    }
+  /* a second click cancels the running update */
+  if (self->cancellable) {
+    g_cancellable_cancel (self->cancellable);
+    return;
   }
-  gtk_widget_show_all (GTK_WIDGET (self->lb_messages));
+
+  g_auto (GStrv) servers = cowmail_window_get_servers (self);
+  if (!servers[0])
+    return;
+  self->cancellable = g_cancellable_new ();
+  self->update_hashes = g_hash_table_new_full (g_bytes_hash, g_bytes_equal, (GDestroyNotify) g_bytes_unref, NULL);
+  self->update_pending = g_strv_length (servers);
+  g_object_ref (self);
+
+  /* all servers at once, so that the update takes as long as the slowest one */
+  for (guint i = 0; servers[i]; i++) {
+    cowmail_window_poll *poll = g_new0 (cowmail_window_poll, 1);
+    poll->window = self;
+    poll->server = g_strdup (servers[i]);
+    poll->failed = G_MAXUINT64;
+
+    /* keep the heads, so that identities added later find older messages without the network */
+    g_autoptr (GError) error = NULL;
+    if (!cowmail_client_open_head_cache (cowmail_client_lookup (poll->server), &error))
+      g_printerr ("COWMAIL ERROR HEAD CACHE: %s\n", error->message);
+
+    /* only get what arrived since the last update */
+    guint64 cursor = G_MAXUINT64;
+    for (GList *idl = self->ids; idl; idl = idl->next)
+      cursor = MIN (cursor, cowmail_cursor_get (self->cursors, poll->server, idl->data));
+    poll->next = cursor;
+
+    cowmail_list_async (poll->server, self->ids, cursor, 0, self->cancellable, on_list_done, poll);
+  }
+}
+
+
+
+/* a server rejected a queued message for good, so tell the user instead of retrying */
+static void
+on_outbox_failed (const gchar   *server,
+                  guchar         status,
+                  CowmailWindow *self)
+{
+  GtkWidget *dialog = gtk_message_dialog_new (GTK_WINDOW (self), GTK_DIALOG_DESTROY_WITH_PARENT,
+                                              GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE,
+                                              "A message could not be sent to %s", server);
+  gtk_message_dialog_format_secondary_text (GTK_MESSAGE_DIALOG (dialog), "%s.", cowmail_status_message (status));
+  g_signal_connect_swapped (dialog, "response", G_CALLBACK (gtk_widget_destroy), dialog);
+  gtk_widget_show (dialog);
+}
+
+
+
+static void
+on_mailbox_msg (const gchar   *msg,
+                CowmailWindow *self)
+{
+  gtk_list_box_prepend (self->lb_messages, GTK_WIDGET (cowmail_msg_row_new (msg)));
 }
 
 
@@ -92,8 +300,10 @@ on_bn_test_clicked (GtkButton     *button,
   GTK_IS_BUTTON (button);
   COWMAIL_IS_WINDOW (self);
 
-  cowmail_crypto_test (self->id);
-  cowmail_protocol_test (gtk_entry_get_text (self->en_server));
+  g_auto (GStrv) servers = cowmail_window_get_servers (self);
+  cowmail_crypto_test (self->ids->data);
+  if (servers[0])
+    cowmail_protocol_test (servers[0]);
 }
 
 
@@ -168,19 +378,37 @@ cowmail_window_init (CowmailWindow *self)
   g_autoptr (GFile) ctfile = g_file_new_for_path (ctpath);
   GList *ctlist = cowmail_ids_load (ctfile);
 
-  if (idlist) {
-    self->id = idlist->data;
-  } else {
+  if (!idlist) {
     g_printerr ("COWMAIL INFO: Creating new ID.\n");
-    self->id = cowmail_id_generate ("me");
-    cowmail_id *contact = cowmail_id_to_contact (self->id);
+    cowmail_id *id = cowmail_id_generate ("me");
+    cowmail_id *contact = cowmail_id_to_contact (id);
 
     ctlist = g_list_prepend (ctlist, contact);
-    idlist = g_list_append (NULL, self->id);
+    idlist = g_list_append (NULL, id);
     cowmail_ids_store (idfile, idlist);
     cowmail_ids_store (ctfile, ctlist);
   }
 
+  g_autofree gchar *cursorpath = g_strjoin ("/", g_get_user_config_dir (), "cowmail", "cursors.conf", NULL);
+  g_autoptr (GFile) cursorfile = g_file_new_for_path (cursorpath);
+
+  g_autofree gchar *outboxpath = g_strjoin ("/", g_get_user_data_dir (), "cowmail", "outbox", NULL);
+  g_autoptr (GFile) outboxdir = g_file_new_for_path (outboxpath);
+  self->outbox = cowmail_outbox_new (outboxdir);
+  cowmail_outbox_set_failed_func (self->outbox, (cowmail_outbox_failed_func) on_outbox_failed, self);
+
+  for (GList *idl = idlist; idl; idl = idl->next) {
+    g_autoptr (GFile) seenfile = cowmail_window_seen_file (idl->data);
+    ((cowmail_id *) idl->data)->seen = cowmail_seen_load (seenfile);
+  }
+
+  self->ids = idlist;
   self->contacts = ctlist;
-  g_list_free (idlist);
+  self->cursors = cowmail_cursors_load (cursorfile);
+
+  g_autofree gchar *mailboxpath = g_strjoin ("/", g_get_user_data_dir (), "cowmail", "mailbox", NULL);
+  g_autoptr (GFile) mailboxdir = g_file_new_for_path (mailboxpath);
+  self->mailbox = cowmail_mailbox_new (mailboxdir, self->ids);
+  cowmail_mailbox_foreach (self->mailbox, (cowmail_mailbox_func) on_mailbox_msg, self);
+  gtk_widget_show_all (GTK_WIDGET (self->lb_messages));
 }
@@ -20,6 +20,9 @@
 
 #include <gtk/gtk.h>
 #include "libcowmail.h"
+#include "cowmail-mailbox.h"
+#include "cowmail-seen.h"
+#include "cowmail-client.h"
 #include "cowmail-write-window.h"
 #include "cowmail-contact-window.h"
 #include "cowmail-msg-row.h"
@@ -20,14 +20,15 @@
 
 struct _CowmailWriteWindow
 {
-  GtkWindow      parent_instance;
-  GtkHeaderBar  *header_bar;
-  GtkTextBuffer *tb_message;
+  GtkWindow       parent_instance;
+  GtkHeaderBar   *header_bar;
+  GtkTextBuffer  *tb_message;
 
-  const gchar   *hostname;
+  gchar          *hostname;
+  cowmail_outbox *outbox;
 
-  GtkComboBox   *cb_contacts;
-  GtkListStore  *ls_contacts;
+  GtkComboBox    *cb_contacts;
+  GtkListStore   *ls_contacts;
 };
 
 G_DEFINE_TYPE (CowmailWriteWindow, cowmail_write_window, GTK_TYPE_WINDOW)
@@ -35,11 +36,14 @@ G_DEFINE_TYPE (CowmailWriteWindow, cowmail_write_window, GTK_TYPE_WINDOW)
 
 
 CowmailWriteWindow *
-cowmail_write_window_new (const gchar *hostname,
-                  GList       *contacts)
+cowmail_write_window_new (const gchar    *hostname,
+                          GList          *contacts,
+                          cowmail_outbox *outbox)
 {
   CowmailWriteWindow *self = g_object_new (COWMAIL_TYPE_WRITE_WINDOW, NULL);
-  self->hostname = hostname;
+  /* the server entry of the main window may change while this window is open */
+  self->hostname = g_strdup (hostname);
+  self->outbox = outbox;
   for (GList *c = contacts; c; c = c->next) {
     cowmail_id *id = c->data;
     gtk_list_store_insert_with_values (self->ls_contacts, NULL, 0,
@@ -71,7 +75,7 @@ on_bn_send_clicked (GtkButton          *button,
   gtk_tree_model_get_value (gtk_combo_box_get_model (self->cb_contacts), &iter, 1, &value);
 
   cowmail_id *id = (cowmail_id *) g_value_get_pointer (&value);
-  cowmail_put (self->hostname, msg, id);
+  cowmail_outbox_put (self->outbox, self->hostname, msg, id);
   g_value_unset (&value);
 
   gtk_window_close (GTK_WINDOW (self));
@@ -79,11 +83,24 @@ on_bn_send_clicked (GtkButton          *button,
 
 
 
+static void
+cowmail_write_window_finalize (GObject *object)
+{
+  CowmailWriteWindow *self = COWMAIL_WRITE_WINDOW (object);
+  g_free (self->hostname);
+  G_OBJECT_CLASS (cowmail_write_window_parent_class)->finalize (object);
+}
+
+
+
 static void
 cowmail_write_window_class_init (CowmailWriteWindowClass *klass)
 {
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
   GtkWidgetClass *widget_class = GTK_WIDGET_CLASS (klass);
 
+  object_class->finalize = cowmail_write_window_finalize;
+
   gtk_widget_class_set_template_from_resource (widget_class, "/ch/verbuecheln/cowmail/cowmail-write-window.ui");
   gtk_widget_class_bind_template_child (widget_class, CowmailWriteWindow, header_bar);
   gtk_widget_class_bind_template_child (widget_class, CowmailWriteWindow, tb_message);
@@ -20,6 +20,7 @@
 
 #include <gtk/gtk.h>
 #include "libcowmail.h"
+#include "cowmail-outbox.h"
 
 G_BEGIN_DECLS
 
@@ -31,12 +32,14 @@ G_DECLARE_FINAL_TYPE (CowmailWriteWindow, cowmail_write_window, COWMAIL, WRITE_W
  * cowmail_write_window_new:
  * @server: server to send message to, may include port (default: 1337)
  * @contacts: potential recipients
+ * @outbox: outbox to queue the message in
  *
  * Allocates a write window for writing a new message.
  *
  * Returns: newly allocated write window
  */
-CowmailWriteWindow *cowmail_write_window_new (const gchar *server,
-                                              GList       *contacts);
+CowmailWriteWindow *cowmail_write_window_new (const gchar    *server,
+                                              GList          *contacts,
+                                              cowmail_outbox *outbox);
 
 G_END_DECLS
@@ -0,0 +1,117 @@
+/* cowmaild.c
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glib-unix.h>
+
+#include "cowmail-config.h"
+#include "cowmail-server.h"
+#include "cowmail-stamp.h"
+
+static gint port = COWMAIL_DEFAULT_PORT;
+static gint threads = 0;
+static gchar *data_dir = NULL;
+static gboolean no_sync = FALSE;
+static gchar *socket_path = NULL;
+static gint stamp_bits = 0;
+static gint max_conns = 0;
+static gdouble addr_rate = 0;
+static gdouble prefix_rate = 0;
+
+static GOptionEntry entries[] =
+{
+  { "port", 'p', 0, G_OPTION_ARG_INT, &port, "Port to listen on (default: 1337)", "PORT" },
+  { "threads", 't', 0, G_OPTION_ARG_INT, &threads, "Number of reactor threads (default: one per processor)", "N" },
+  { "data-dir", 'd', 0, G_OPTION_ARG_FILENAME, &data_dir, "Directory of the message store (default: ~/.local/share/cowmaild)", "DIR" },
+  { "no-sync", 0, 0, G_OPTION_ARG_NONE, &no_sync, "Do not wait for messages to reach the disk", NULL },
+  { "socket", 's', 0, G_OPTION_ARG_FILENAME, &socket_path, "Unix domain socket to listen on, empty for none (default: $XDG_RUNTIME_DIR/cowmail.sock)", "PATH" },
+  { "stamp-bits", 0, 0, G_OPTION_ARG_INT, &stamp_bits, "Proof of work required per message in bits, up to 28 (default: 0, none)", "BITS" },
+  { "max-conns", 0, 0, G_OPTION_ARG_INT, &max_conns, "Maximum number of concurrent connections (default: 0, no limit)", "N" },
+  { "rate", 0, 0, G_OPTION_ARG_DOUBLE, &addr_rate, "Requests per second per source address (default: 0, no limit)", "RATE" },
+  { "prefix-rate", 0, 0, G_OPTION_ARG_DOUBLE, &prefix_rate, "Requests per second per /24 or /48 network (default: 0, no limit)", "RATE" },
+  { NULL }
+};
+
+static gboolean
+on_signal (gpointer loop)
+{
+  g_main_loop_quit (loop);
+  return G_SOURCE_REMOVE;
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GOptionContext) context = g_option_context_new ("- Cowmail server");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_printerr ("%s\n", error->message);
+    return 1;
+  }
+  if (port < 0 || port > G_MAXUINT16 || threads < 0) {
+    g_printerr ("Invalid port or number of threads.\n");
+    return 1;
+  }
+  if (stamp_bits < 0 || stamp_bits > COWMAIL_STAMP_MAX_BITS) {
+    g_printerr ("Invalid stamp difficulty.\n");
+    return 1;
+  }
+  if (max_conns < 0 || addr_rate < 0 || prefix_rate < 0) {
+    g_printerr ("Invalid connection or rate limit.\n");
+    return 1;
+  }
+
+  if (!data_dir)
+    data_dir = g_build_filename (g_get_user_data_dir (), "cowmaild", NULL);
+  cowmail_store *store = cowmail_store_open (data_dir, &error);
+  if (!store) {
+    g_printerr ("COWMAIL ERROR: %s\n", error->message);
+    return 1;
+  }
+  cowmail_store_set_sync (store, !no_sync);
+
+  cowmail_server *server = cowmail_server_new (store, port, threads);
+  cowmail_server_set_difficulty (server, stamp_bits);
+  cowmail_admission_limits limits = { max_conns, addr_rate, prefix_rate };
+  cowmail_server_set_limits (server, &limits);
+  if (!socket_path)
+    socket_path = cowmail_transport_default_socket ();
+  if (*socket_path)
+    cowmail_server_set_socket (server, socket_path);
+  if (!cowmail_server_start (server, &error)) {
+    g_printerr ("COWMAIL ERROR: %s\n", error->message);
+    cowmail_server_free (server);
+    cowmail_store_close (store);
+    return 1;
+  }
+  g_print ("cowmaild %s listening on port %u\n", PACKAGE_VERSION, cowmail_server_get_port (server));
+  if (*socket_path)
+    g_print ("cowmaild %s listening on %s\n", PACKAGE_VERSION, socket_path);
+
+  g_autoptr (GMainLoop) loop = g_main_loop_new (NULL, FALSE);
+  g_unix_signal_add (SIGINT, on_signal, loop);
+  g_unix_signal_add (SIGTERM, on_signal, loop);
+  g_main_loop_run (loop);
+
+  cowmail_server_free (server);
+  cowmail_store_close (store);
+  g_free (socket_path);
+  g_free (data_dir);
+  return 0;
+}
@@ -0,0 +1,147 @@
+/* libcowmail-private.h
+ *
+ * Copyright 2020 Stephan Verbücheln
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "libcowmail.h"
+#include "cowmail-head-cache.h"
+
+/*
+ * Internal functions of libcowmail, exposed for the benchmarks and for the
+ * other parts of the library.
+ */
+
+
+
+/**
+ * cowmail_encrypt_msg:
+ * @id: the recipient's cowmail identity
+ * @msg: the message
+ * @n: length of @msg
+ * @len: return location for the length of the result
+ *
+ * Returns: head and body of the encrypted message
+ */
+guchar            *cowmail_encrypt_msg     (const cowmail_id      *id,
+                                            const gchar           *msg,
+                                            gsize                  n,
+                                            gsize                 *len);
+
+/**
+ * cowmail_decrypt_head:
+ * @id: identity to try
+ * @head: a message head
+ *
+ * Returns: the ticket if the head belongs to @id, otherwise NULL
+ */
+cowmail_ticket    *cowmail_decrypt_head    (const cowmail_id      *id,
+                                            const guchar          *head);
+
+/**
+ * cowmail_decrypt_msg:
+ * @ticket: the header for the message
+ * @cmsg: the body
+ * @len: length of @cmsg
+ *
+ * Returns: the message, or NULL if it is not authentic or not text
+ */
+gchar             *cowmail_decrypt_msg     (cowmail_ticket        *ticket,
+                                            const guchar          *cmsg,
+                                            gsize                  len);
+
+/**
+ * cowmail_scan_heads:
+ * @ids: identities to try
+ * @heads: consecutive heads
+ * @n: number of heads
+ *
+ * Trial-decrypts the heads on all processors. The sequence number of each
+ * ticket is the index of its head in @heads.
+ *
+ * Returns: the tickets of the matching heads, last head first
+ */
+GList             *cowmail_scan_heads      (GList                 *ids,
+                                            const guchar          *heads,
+                                            gsize                  n);
+
+/**
+ * cowmail_session_connect:
+ * @hostname: the server
+ * @cancellable: (nullable): a #GCancellable for the requests of the session
+ * @error: return location for an error
+ *
+ * Like cowmail_session_open(), but reports the error to the caller.
+ *
+ * Returns: the session, or NULL with @error set
+ */
+cowmail_session   *cowmail_session_connect (const gchar           *hostname,
+                                            GCancellable          *cancellable,
+                                            GError               **error);
+
+/**
+ * cowmail_session_list_cached:
+ * @session: the session
+ * @ids: identities to get messages for
+ * @cursor: sequence number of the first header to get
+ * @limit: maximum number of headers to get, 0 for no limit
+ * @next: return location for the cursor to continue with
+ * @cache: (nullable): cache to append the received heads to
+ * @func: called for every header that belongs to one of the identities
+ * @userdata: user data for @func
+ *
+ * Like cowmail_session_list(), but also keeps the heads in @cache.
+ *
+ * Returns: the number of headers scanned
+ */
+gsize              cowmail_session_list_cached (cowmail_session   *session,
+                                                GList             *ids,
+                                                guint64            cursor,
+                                                guint32            limit,
+                                                guint64           *next,
+                                                cowmail_head_cache *cache,
+                                                cowmail_ticket_func func,
+                                                gpointer           userdata);
+
+/**
+ * cowmail_session_set_cancellable:
+ * @session: the session
+ * @cancellable: (nullable): a #GCancellable for the next requests
+ */
+void               cowmail_session_set_cancellable (cowmail_session *session,
+                                                    GCancellable    *cancellable);
+
+/**
+ * cowmail_session_take_error:
+ * @session: the session
+ *
+ * A status other than OK that refuses a LIST or GET_MANY is an error too,
+ * G_IO_ERROR_BUSY for BUSY and G_IO_ERROR_FAILED otherwise.
+ *
+ * Returns: (transfer full): the first error of the requests on @session, or
+ * NULL if all of them succeeded
+ */
+GError            *cowmail_session_take_error (cowmail_session    *session);
+
+/**
+ * cowmail_session_is_idle:
+ * @session: the session
+ *
+ * Returns: FALSE if the server closed the session or sent something unasked,
+ * so that it cannot be used for another request
+ */
+gboolean           cowmail_session_is_idle (cowmail_session       *session);
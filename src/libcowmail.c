@@ -16,7 +16,14 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "libcowmail.h"
+#include "libcowmail-private.h"
+#include "cowmail-seen.h"
+#include "cowmail-metrics.h"
+#include "cowmail-transport.h"
+#include "cowmail-client.h"
+#include "cowmail-head-cache.h"
+#include "cowmail-stamp.h"
+#include <sys/socket.h>
 #include <gnutls/crypto.h>
 #include <gnutls/abstract.h>
 #include <nettle/curve25519.h>
@@ -61,11 +68,64 @@ cowmail_id_to_contact (const cowmail_id *id)
 {
   cowmail_id *contact = cowmail_id_new (id->name);
   curve25519_mul_g (contact->key, id->key);
+  contact->features = COWMAIL_MSG_FEATURES;
   return contact;
 }
 
 
 
+gchar *
+cowmail_id_key_to_string (const cowmail_id *id)
+{
+  g_autofree gchar *key = g_base64_encode (id->key, COWMAIL_KEY_SIZE);
+  gchar *text = id->features ? g_strdup_printf ("%s:%x", key, id->features) : g_strdup (key);
+  memset (key, 0, strlen (key));
+  return text;
+}
+
+
+
+gboolean
+cowmail_id_key_from_string (const gchar *text,
+                            guchar      *key,
+                            guint32     *features)
+{
+  g_auto (GStrv) parts = g_strsplit (text, ":", 2);
+  gsize len = 0;
+  g_autofree guchar *raw = parts[0] ? g_base64_decode (parts[0], &len) : NULL;
+  gboolean ok = raw && len == COWMAIL_KEY_SIZE;
+
+  guint64 flags = 0;
+  if (ok && parts[1]) {
+    gchar *end;
+    flags = g_ascii_strtoull (parts[1], &end, 16);
+    ok = *parts[1] && !*end && flags <= G_MAXUINT32;
+  }
+  if (ok) {
+    memcpy (key, raw, COWMAIL_KEY_SIZE);
+    *features = flags;
+  }
+  if (raw)
+    memset (raw, 0, len);
+  return ok;
+}
+
+
+
+gchar *
+cowmail_id_fingerprint (const cowmail_id *id)
+{
+  guchar pkey[CURVE25519_SIZE];
+  curve25519_mul_g (pkey, id->key);
+
+  gchar *fp = g_malloc (2 * CURVE25519_SIZE + 1);
+  for (gsize i = 0; i < CURVE25519_SIZE; i++)
+    g_snprintf (fp + 2 * i, 3, "%02x", pkey[i]);
+  return fp;
+}
+
+
+
 void
 cowmail_id_free (cowmail_id *id)
 {
@@ -87,7 +147,7 @@ cowmail_ids_store (GFile *file,
   for (GList *idl = ids; idl; idl = idl->next) {
     cowmail_id *id = ((cowmail_id *) idl->data);
 
-    g_autofree gchar *key = g_base64_encode (id->key, COWMAIL_KEY_SIZE);
+    g_autofree gchar *key = cowmail_id_key_to_string (id);
     g_data_output_stream_put_string (dstream, key, NULL, &error);
     g_data_output_stream_put_byte (dstream, ' ', NULL, &error);
     memset (key, 0, strlen (key));
@@ -116,10 +176,11 @@ cowmail_ids_load (GFile *file)
   while ((line = g_data_input_stream_read_line_utf8 (dstream, NULL, NULL, &error))) {
     gchar **e = g_strsplit_set (line, " \n", 2);
     if (e[0] && e[1]) {
-      gsize len;
-      g_autofree guchar *key = g_base64_decode (e[0], &len);
-      if (key && len == COWMAIL_KEY_SIZE) {
+      guchar key[COWMAIL_KEY_SIZE];
+      guint32 features;
+      if (cowmail_id_key_from_string (e[0], key, &features)) {
         cowmail_id *id = cowmail_id_from_key (e[1], key);
+        id->features = features;
         ids = g_list_prepend (ids, id);
       } else {
         g_autofree gchar *fname = g_file_get_basename (file);
@@ -138,6 +199,86 @@ cowmail_ids_load (GFile *file)
 
 
 
+GHashTable *
+cowmail_cursors_load (GFile *file)
+{
+  GHashTable *cursors = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  g_autoptr (GFileInputStream) istream = g_file_read (file, NULL, NULL);
+  if (!istream)
+    return cursors;
+  g_autoptr (GDataInputStream) dstream = g_data_input_stream_new (G_INPUT_STREAM (istream));
+
+  gchar *line = NULL;
+  while ((line = g_data_input_stream_read_line_utf8 (dstream, NULL, NULL, NULL))) {
+    gchar **e = g_strsplit_set (line, " \n", 3);
+    if (e[0] && e[1] && e[2]) {
+      guint64 *cursor = g_new (guint64, 1);
+      *cursor = g_ascii_strtoull (e[1], NULL, 10);
+      g_hash_table_replace (cursors, g_strjoin (" ", e[0], e[2], NULL), cursor);
+    } else {
+      g_autofree gchar *fname = g_file_get_basename (file);
+      g_printerr ("COWMAIL ERROR: Invalid line in file: %s\n", fname);
+    }
+    g_strfreev (e);
+    g_free (line);
+  }
+  g_input_stream_close (G_INPUT_STREAM (istream), NULL, NULL);
+  return cursors;
+}
+
+
+
+void
+cowmail_cursors_store (GFile      *file,
+                       GHashTable *cursors)
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (GString) data = g_string_new (NULL);
+
+  GHashTableIter iter;
+  gpointer key, value;
+  g_hash_table_iter_init (&iter, cursors);
+  while (g_hash_table_iter_next (&iter, &key, &value)) {
+    gchar **e = g_strsplit (key, " ", 2);
+    g_string_append_printf (data, "%s %" G_GUINT64_FORMAT " %s\n", e[0], *((guint64 *) value), e[1]);
+    g_strfreev (e);
+  }
+
+  if (!g_file_replace_contents (file, data->str, data->len, NULL, FALSE, G_FILE_CREATE_NONE, NULL, NULL, &error))
+    g_printerr ("COWMAIL ERROR: %s\n", error->message);
+}
+
+
+
+guint64
+cowmail_cursor_get (GHashTable       *cursors,
+                    const gchar      *server,
+                    const cowmail_id *id)
+{
+  g_autofree gchar *fp = cowmail_id_fingerprint (id);
+  g_autofree gchar *key = g_strjoin (" ", fp, server, NULL);
+  guint64 *cursor = g_hash_table_lookup (cursors, key);
+  return cursor ? *cursor : 0;
+}
+
+
+
+void
+cowmail_cursor_set (GHashTable       *cursors,
+                    const gchar      *server,
+                    const cowmail_id *id,
+                    guint64           cursor)
+{
+  guint64 *value = g_new (guint64, 1);
+  *value = cursor;
+  gchar *fp = cowmail_id_fingerprint (id);
+  g_hash_table_replace (cursors, g_strjoin (" ", fp, server, NULL), value);
+  g_free (fp);
+}
+
+
+
 static void
 cowmail_encrypt (const guchar *secret,
                  const guchar *iv,
@@ -192,12 +333,92 @@ cowmail_decrypt (const guchar *secret,
 
 
 
-static guchar *
+/*
+ * The nonce of chunk i is the base nonce with i XORed into its last 8 bytes,
+ * and 0x80 XORed into its first byte unless it is the final chunk. A message
+ * of one chunk thus uses the base nonce itself, as before chunking.
+ */
+static void
+cowmail_chunk_nonce (const guchar *base,
+                     guint64       index,
+                     gboolean      final,
+                     guchar       *nonce)
+{
+  memcpy (nonce, base, COWMAIL_TAG_SIZE);
+  for (gint b = 0; b < 8; b++)
+    nonce[COWMAIL_TAG_SIZE - 1 - b] ^= (index >> (8 * b)) & 0xff;
+  if (!final)
+    nonce[0] ^= 0x80;
+}
+
+
+
+static gsize
+cowmail_body_size (gsize n)
+{
+  gsize chunks = MAX ((n + COWMAIL_CHUNK_SIZE - 1) / COWMAIL_CHUNK_SIZE, 1);
+  return n + chunks * COWMAIL_TAG_SIZE;
+}
+
+
+
+static void
+cowmail_encrypt_body (const guchar *secret,
+                      const guchar *base,
+                      gsize         n,
+                      guchar       *crypto,
+                      const guchar *clear)
+{
+  guint64 index = 0;
+  do {
+    gsize m = MIN (n, COWMAIL_CHUNK_SIZE);
+    guchar nonce[COWMAIL_TAG_SIZE];
+    cowmail_chunk_nonce (base, index++, m == n, nonce);
+    cowmail_encrypt (secret, nonce, m, crypto, clear);
+    crypto += m + COWMAIL_TAG_SIZE;
+    clear += m;
+    n -= m;
+  } while (n > 0);
+}
+
+
+
+/* decrypts a whole body into clear, which has room for len bytes */
+static gboolean
+cowmail_decrypt_body (const guchar *secret,
+                      const guchar *base,
+                      gsize         len,
+                      guchar       *clear,
+                      const guchar *crypto,
+                      gsize        *n)
+{
+  guint64 index = 0;
+  *n = 0;
+  do {
+    gsize m = MIN (len, COWMAIL_CHUNK_SIZE + COWMAIL_TAG_SIZE);
+    guchar nonce[COWMAIL_TAG_SIZE];
+    if (m < COWMAIL_TAG_SIZE)
+      return FALSE;
+    cowmail_chunk_nonce (base, index++, m == len, nonce);
+    if (!cowmail_decrypt (secret, nonce, m - COWMAIL_TAG_SIZE, clear + *n, crypto))
+      return FALSE;
+    *n += m - COWMAIL_TAG_SIZE;
+    crypto += m;
+    len -= m;
+  } while (len > 0);
+  return TRUE;
+}
+
+
+
+guchar *
 cowmail_encrypt_msg (const cowmail_id *id,
                      const gchar      *msg,
-                     gsize             n)
+                     gsize             n,
+                     gsize            *len)
 {
-  guchar *result = g_malloc0 (COWMAIL_HEAD_SIZE + COWMAIL_TAG_SIZE + n);
+  *len = COWMAIL_HEAD_SIZE + cowmail_body_size (n);
+  guchar *result = g_malloc0 (*len);
   guchar *pkey = result;
   guchar *chash = result + COWMAIL_KEY_SIZE;
   guchar *cmsg = result + COWMAIL_HEAD_SIZE;
@@ -212,24 +433,120 @@ cowmail_encrypt_msg (const cowmail_id *id,
   curve25519_mul (secret, skey, id->key);
 
   /* encrypt payload */
-  cowmail_encrypt (secret, pkey + COWMAIL_TAG_SIZE, n, cmsg, (guchar *) msg);
+  cowmail_encrypt_body (secret, pkey + COWMAIL_TAG_SIZE, n, cmsg, (guchar *) msg);
 
   /* compute message hash */
   guchar hash[COWMAIL_KEY_SIZE];
-  gnutls_hash_fast (GNUTLS_DIG_SHA256, cmsg, n + COWMAIL_TAG_SIZE, hash);
+  gnutls_hash_fast (GNUTLS_DIG_SHA256, cmsg, *len - COWMAIL_HEAD_SIZE, hash);
 
   /* encrypt message hash */
   cowmail_encrypt (secret, pkey, COWMAIL_KEY_SIZE, chash, hash);
 
   /* clear secrets from memory */
   memset (skey, 0, CURVE25519_SIZE);
+  memset (secret, 0, CURVE25519_SIZE);
 
   return result;
 }
 
 
 
-static cowmail_ticket *
+/* runs a whole buffer through a converter after skip bytes of room, giving up beyond max bytes */
+static guchar *
+cowmail_convert (GConverter   *converter,
+                 const guchar *in,
+                 gsize         n,
+                 gsize         skip,
+                 gsize         max,
+                 gsize        *len)
+{
+  gsize size = MIN (MAX (2 * n, 4096), max);
+  guchar *out = g_malloc (size);
+  gsize fill = skip;
+
+  while (TRUE) {
+    g_autoptr (GError) error = NULL;
+    gsize read, written;
+    GConverterResult result = g_converter_convert (converter, in, n, out + fill, size - fill,
+                                                   G_CONVERTER_INPUT_AT_END, &read, &written, &error);
+    in += read;
+    n -= read;
+    fill += written;
+    if (result == G_CONVERTER_FINISHED)
+      break;
+    if (result == G_CONVERTER_ERROR && !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE))
+      goto fail;
+    if (result == G_CONVERTER_ERROR || fill == size) {
+      if (size >= max)
+        goto fail;
+      size = MIN (2 * size, max);
+      out = g_realloc (out, size);
+    }
+  }
+  *len = fill;
+  return out;
+
+fail:
+  g_free (out);
+  return NULL;
+}
+
+
+
+/* encrypts a NUL-terminated text, compressed if the recipient reads that and it pays off */
+static guchar *
+cowmail_encrypt_text (const cowmail_id *id,
+                      const gchar      *msg,
+                      gsize            *len)
+{
+  gsize n = strlen (msg) + 1;
+  if (!(id->features & COWMAIL_MSG_DEFLATE) || n < COWMAIL_COMPRESS_MIN)
+    return cowmail_encrypt_msg (id, msg, n, len);
+
+  gsize marker = sizeof (COWMAIL_MSG_DEFLATE_MARKER) - 1;
+  g_autoptr (GZlibCompressor) compressor = g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, -1);
+  gsize zlen;
+  g_autofree guchar *zmsg = cowmail_convert (G_CONVERTER (compressor), (const guchar *) msg, n, marker, n - 1, &zlen);
+  if (!zmsg)
+    return cowmail_encrypt_msg (id, msg, n, len);
+  memcpy (zmsg, COWMAIL_MSG_DEFLATE_MARKER, marker);
+  guchar *cryptotext = cowmail_encrypt_msg (id, (const gchar *) zmsg, zlen, len);
+  memset (zmsg, 0, zlen);
+  return cryptotext;
+}
+
+
+
+/* undoes the compression of cowmail_encrypt_text(), taking over the decrypted text */
+static gchar *
+cowmail_decompress_text (guchar *msg,
+                         gsize   n)
+{
+  gsize marker = sizeof (COWMAIL_MSG_DEFLATE_MARKER) - 1;
+  if (n < marker || memcmp (msg, COWMAIL_MSG_DEFLATE_MARKER, marker) != 0) {
+    g_printerr ("COWMAIL ERROR: Unknown message encoding.\n");
+    g_free (msg);
+    return NULL;
+  }
+
+  g_autoptr (GZlibDecompressor) decompressor = g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW);
+  gsize len;
+  guchar *text = cowmail_convert (G_CONVERTER (decompressor), msg + marker, n - marker, 0,
+                                  COWMAIL_DECOMPRESS_MAX, &len);
+  memset (msg, 0, n);
+  g_free (msg);
+  if (text && (len == 0 || text[len - 1] != '\0')) {
+    memset (text, 0, len);
+    g_clear_pointer (&text, g_free);
+  }
+  if (!text)
+    g_printerr ("COWMAIL ERROR: Invalid compressed message.\n");
+  return (gchar *) text;
+}
+
+
+
+cowmail_ticket *
 cowmail_decrypt_head (const cowmail_id *id,
                       const guchar     *head)
 {
@@ -245,6 +562,8 @@ cowmail_decrypt_head (const cowmail_id *id,
   if (cowmail_decrypt (secret, pkey, COWMAIL_KEY_SIZE, ticket->hash, chash)) {
     memcpy (ticket->secret, secret, COWMAIL_KEY_SIZE);
     memcpy (ticket->nonce, pkey + COWMAIL_TAG_SIZE, COWMAIL_TAG_SIZE);
+    ticket->id = id;
+    ticket->seq = 0;
     return ticket;
   }
   g_free (ticket);
@@ -253,7 +572,7 @@ cowmail_decrypt_head (const cowmail_id *id,
 
 
 
-static gchar *
+gchar *
 cowmail_decrypt_msg (cowmail_ticket   *ticket,
                      const guchar     *cmsg,
                      gsize             len)
@@ -261,11 +580,18 @@ cowmail_decrypt_msg (cowmail_ticket   *ticket,
   if (len < COWMAIL_TAG_SIZE)
     return NULL;
 
-  gsize n = len - COWMAIL_TAG_SIZE;
-  guchar *msg = g_malloc (n);
+  gsize n;
+  guchar *msg = g_malloc (len);
 
-   if (cowmail_decrypt (ticket->secret, ticket->nonce, n, msg, cmsg))
-    return (gchar *) msg;
+  if (cowmail_decrypt_body (ticket->secret, ticket->nonce, len, msg, cmsg, &n)) {
+    /* a compressed text can end with a NUL byte too, so look for the marker first */
+    if (n > 1 && msg[0] == '\0')
+      return cowmail_decompress_text (msg, n);
+    if (n > 0 && msg[n - 1] == '\0')
+      return (gchar *) msg;
+  } else {
+    cowmail_metrics_auth_failure ();
+  }
 
   g_printerr ("COWMAIL ERROR: Auth tag missmatch.\n");
   g_free (msg);
@@ -274,84 +600,1749 @@ cowmail_decrypt_msg (cowmail_ticket   *ticket,
 
 
 
+GBytes *
+cowmail_msg_encrypt (const gchar      *msg,
+                     const cowmail_id *id)
+{
+  gsize len;
+  guchar *cryptotext = cowmail_encrypt_text (id, msg, &len);
+  return g_bytes_new_take (cryptotext, len);
+}
+
+
+
+/* reads up to one chunk, returns the number of bytes or -1 on error */
+static gssize
+cowmail_read_chunk (GInputStream  *istream,
+                    guchar        *buf,
+                    gsize          size,
+                    GCancellable  *cancellable,
+                    GError       **error)
+{
+  gsize n = 0;
+  if (!g_input_stream_read_all (istream, buf, size, &n, cancellable, error))
+    return -1;
+  return n;
+}
+
+
+
+gboolean
+cowmail_encrypt_stream (const cowmail_id  *id,
+                        GInputStream      *clear,
+                        GOutputStream     *body,
+                        guchar            *head,
+                        GCancellable      *cancellable,
+                        GError           **error)
+{
+  gboolean ok = FALSE;
+  guchar *pkey = head;
+  guchar *chash = head + COWMAIL_KEY_SIZE;
+
+  guchar skey[CURVE25519_SIZE];
+  guchar secret[CURVE25519_SIZE];
+  gnutls_rnd (GNUTLS_RND_KEY, skey, CURVE25519_SIZE);
+  curve25519_mul_g (pkey, skey);
+  curve25519_mul (secret, skey, id->key);
+  memset (skey, 0, CURVE25519_SIZE);
+
+  gnutls_hash_hd_t sha;
+  gnutls_hash_init (&sha, GNUTLS_DIG_SHA256);
+  g_autofree guchar *cur = g_malloc (COWMAIL_CHUNK_SIZE);
+  g_autofree guchar *next = g_malloc (COWMAIL_CHUNK_SIZE);
+  g_autofree guchar *crypto = g_malloc (COWMAIL_CHUNK_SIZE + COWMAIL_TAG_SIZE);
+
+  /* a chunk is final if nothing follows it, so read one chunk ahead */
+  gssize len = cowmail_read_chunk (clear, cur, COWMAIL_CHUNK_SIZE, cancellable, error);
+  for (guint64 index = 0; len >= 0; index++) {
+    gssize nlen = 0;
+    if (len == COWMAIL_CHUNK_SIZE && (nlen = cowmail_read_chunk (clear, next, COWMAIL_CHUNK_SIZE, cancellable, error)) < 0)
+      break;
+
+    guchar nonce[COWMAIL_TAG_SIZE];
+    cowmail_chunk_nonce (pkey + COWMAIL_TAG_SIZE, index, nlen == 0, nonce);
+    cowmail_encrypt (secret, nonce, len, crypto, cur);
+    gnutls_hash (sha, crypto, len + COWMAIL_TAG_SIZE);
+    if (!g_output_stream_write_all (body, crypto, len + COWMAIL_TAG_SIZE, NULL, cancellable, error))
+      break;
+
+    if (nlen == 0) {
+      ok = TRUE;
+      break;
+    }
+    guchar *tmp = cur;
+    cur = next;
+    next = tmp;
+    len = nlen;
+  }
+
+  guchar hash[COWMAIL_KEY_SIZE];
+  gnutls_hash_deinit (sha, hash);
+  if (ok)
+    cowmail_encrypt (secret, pkey, COWMAIL_KEY_SIZE, chash, hash);
+  memset (secret, 0, CURVE25519_SIZE);
+  return ok;
+}
+
+
+
+/* decrypts a body from a stream and counts the bytes read from it */
+static gboolean
+cowmail_decrypt_chunks (const cowmail_ticket  *ticket,
+                        GInputStream          *body,
+                        GOutputStream         *clear,
+                        guint64               *nread,
+                        GCancellable          *cancellable,
+                        GError               **error)
+{
+  gsize size = COWMAIL_CHUNK_SIZE + COWMAIL_TAG_SIZE;
+  g_autofree guchar *cur = g_malloc (size);
+  g_autofree guchar *next = g_malloc (size);
+  g_autofree guchar *msg = g_malloc (COWMAIL_CHUNK_SIZE);
+  gnutls_hash_hd_t sha;
+  gnutls_hash_init (&sha, GNUTLS_DIG_SHA256);
+  gboolean ok = FALSE;
+
+  gssize len = cowmail_read_chunk (body, cur, size, cancellable, error);
+  *nread = MAX (len, 0);
+  if (len == 0)
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "No such message");
+  for (guint64 index = 0; len > 0; index++) {
+    gssize nlen = 0;
+    if ((gsize) len == size && (nlen = cowmail_read_chunk (body, next, size, cancellable, error)) < 0)
+      break;
+    *nread += nlen;
+
+    guchar nonce[COWMAIL_TAG_SIZE];
+    cowmail_chunk_nonce (ticket->nonce, index, nlen == 0, nonce);
+    if (len < COWMAIL_TAG_SIZE || !cowmail_decrypt (ticket->secret, nonce, len - COWMAIL_TAG_SIZE, msg, cur)) {
+      cowmail_metrics_auth_failure ();
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Auth tag mismatch in chunk %" G_GUINT64_FORMAT, index);
+      break;
+    }
+    gnutls_hash (sha, cur, len);
+    if (!g_output_stream_write_all (clear, msg, len - COWMAIL_TAG_SIZE, NULL, cancellable, error))
+      break;
+
+    if (nlen == 0) {
+      ok = TRUE;
+      break;
+    }
+    guchar *tmp = cur;
+    cur = next;
+    next = tmp;
+    len = nlen;
+  }
+
+  /* the head names the body by its hash, so any other body is not the message */
+  guchar hash[COWMAIL_KEY_SIZE];
+  gnutls_hash_deinit (sha, hash);
+  if (ok && memcmp (hash, ticket->hash, COWMAIL_KEY_SIZE) != 0) {
+    cowmail_metrics_auth_failure ();
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Body does not match its hash");
+    ok = FALSE;
+  }
+  memset (msg, 0, COWMAIL_CHUNK_SIZE);
+  return ok;
+}
+
+
+
+gboolean
+cowmail_decrypt_stream (const cowmail_ticket  *ticket,
+                        GInputStream          *body,
+                        GOutputStream         *clear,
+                        GCancellable          *cancellable,
+                        GError               **error)
+{
+  guint64 nread;
+  return cowmail_decrypt_chunks (ticket, body, clear, &nread, cancellable, error);
+}
+
+
+
+/* connects to a server and records the setup time */
+static GSocketConnection *
+cowmail_connect (const gchar   *hostname,
+                 GCancellable  *cancellable,
+                 GError       **error)
+{
+  cowmail_metrics_init ();
+  gint64 start = g_get_monotonic_time ();
+  GSocketConnection *connection = cowmail_transport_connect (hostname, cancellable, error);
+  cowmail_metrics_connect (start, connection != NULL);
+  return connection;
+}
+
+
+
+/* closes with a reset, so that the server drops what it got instead of storing it as a PUT */
+static void
+cowmail_abort (GSocketConnection *connection)
+{
+  struct linger linger = { 1, 0 };
+  GSocket *socket = g_socket_connection_get_socket (connection);
+  setsockopt (g_socket_get_fd (socket), SOL_SOCKET, SO_LINGER, &linger, sizeof (linger));
+  g_io_stream_close (G_IO_STREAM (connection), NULL, NULL);
+}
+
+
+
+/* whether the server answers a one-shot LIST in time, which writes nothing to its store */
+static gboolean
+cowmail_probe_oneshot (const gchar   *hostname,
+                       GCancellable  *cancellable)
+{
+  g_autoptr (GSocketConnection) connection = cowmail_connect (hostname, cancellable, NULL);
+  if (!connection)
+    return FALSE;
+  g_socket_set_timeout (g_socket_connection_get_socket (connection), COWMAIL_HELLO_TIMEOUT);
+  GOutputStream *ostream = g_io_stream_get_output_stream (G_IO_STREAM (connection));
+  GInputStream *istream = g_io_stream_get_input_stream (G_IO_STREAM (connection));
+  guchar request = COWMAIL_CMD_LIST;
+  guchar head;
+  gssize n = -1;
+  if (g_output_stream_write_all (ostream, &request, 1, NULL, cancellable, NULL))
+    n = g_input_stream_read (istream, &head, 1, cancellable, NULL);
+  /* the first head, or the end of an empty store, is answer enough */
+  cowmail_abort (connection);
+  return n >= 0;
+}
+
+
+
+/* sends a one-shot PUT, which the server stores when we close our side */
+static gboolean
+cowmail_put_oneshot (const gchar   *hostname,
+                     const guchar  *msg,
+                     gsize          len,
+                     GCancellable  *cancellable,
+                     GError       **error)
+{
+  g_autoptr (GSocketConnection) connection = cowmail_connect (hostname, cancellable, error);
+  if (!connection)
+    return FALSE;
+  GOutputStream *ostream = g_io_stream_get_output_stream (G_IO_STREAM (connection));
+  gboolean ok = g_output_stream_write_all (ostream, msg, len, NULL, cancellable, error);
+  if (ok)
+    cowmail_metrics_bytes (0, len);
+  g_io_stream_close (G_IO_STREAM (connection), NULL, NULL);
+  return ok;
+}
+
+
+
 void
 cowmail_put (const gchar      *hostname,
              const gchar      *msg,
              const cowmail_id *id)
 {
   g_autoptr (GError) error = NULL;
-  gsize n = strlen (msg) + 1;
-  gsize len = COWMAIL_HEAD_SIZE + COWMAIL_TAG_SIZE + n;
-  g_autofree guchar *cryptotext = cowmail_encrypt_msg (id, msg, n);
+  gsize len;
+  g_autofree guchar *cryptotext = cowmail_encrypt_text (id, msg, &len);
 
-  g_autoptr (GSocketClient) client = g_socket_client_new ();
-  g_socket_client_set_protocol (client, G_SOCKET_PROTOCOL_SCTP);
-  g_autoptr (GSocketConnection) connection;
-  if ((connection = g_socket_client_connect_to_host (client, hostname, COWMAIL_DEFAULT_PORT, NULL, &error))) {
-    GOutputStream *ostream = g_io_stream_get_output_stream (G_IO_STREAM (connection));
-    g_output_stream_write (ostream, cryptotext, len, NULL, &error);
-    g_io_stream_close (G_IO_STREAM (connection), NULL, &error);
-  } else {
+  gint64 start = g_get_monotonic_time ();
+  gboolean ok = cowmail_put_oneshot (hostname, cryptotext, len, NULL, &error);
+  if (!ok)
     g_printerr ("COWMAIL ERROR PUT: %s\n", error->message);
+  cowmail_metrics_record (COWMAIL_METRICS_PUT, start, ok);
+}
+
+
+
+gboolean
+cowmail_put_stream (const gchar       *hostname,
+                    GInputStream      *clear,
+                    const cowmail_id  *id,
+                    GCancellable      *cancellable,
+                    GError           **error)
+{
+  /* the head holds the hash of the body, so stage the body in a file first */
+  GFileIOStream *tmpio = NULL;
+  g_autoptr (GFile) tmp = g_file_new_tmp ("cowmail-XXXXXX", &tmpio, error);
+  if (!tmp)
+    return FALSE;
+  g_autoptr (GFileIOStream) tmpstream = tmpio;
+
+  guchar head[COWMAIL_HEAD_SIZE];
+  gboolean ok = cowmail_encrypt_stream (id, clear, g_io_stream_get_output_stream (G_IO_STREAM (tmpstream)), head,
+                                        cancellable, error) &&
+                g_seekable_seek (G_SEEKABLE (tmpstream), 0, G_SEEK_SET, cancellable, error);
+
+  if (ok) {
+    gint64 start = g_get_monotonic_time ();
+    g_autoptr (GSocketConnection) connection = cowmail_connect (hostname, cancellable, error);
+    if (connection) {
+      GOutputStream *ostream = g_io_stream_get_output_stream (G_IO_STREAM (connection));
+      gssize spliced = -1;
+      ok = g_output_stream_write_all (ostream, head, COWMAIL_HEAD_SIZE, NULL, cancellable, error) &&
+           (spliced = g_output_stream_splice (ostream, g_io_stream_get_input_stream (G_IO_STREAM (tmpstream)),
+                                              G_OUTPUT_STREAM_SPLICE_NONE, cancellable, error)) >= 0 &&
+           g_io_stream_close (G_IO_STREAM (connection), cancellable, error);
+      if (spliced >= 0)
+        cowmail_metrics_bytes (0, COWMAIL_HEAD_SIZE + spliced);
+    } else {
+      ok = FALSE;
+    }
+    cowmail_metrics_record (COWMAIL_METRICS_PUT, start, ok);
   }
+
+  g_io_stream_close (G_IO_STREAM (tmpstream), NULL, NULL);
+  g_file_delete (tmp, NULL, NULL);
+  return ok;
 }
 
 
 
-GList *
-cowmail_list (const gchar      *hostname,
-              const cowmail_id *id)
+typedef struct
 {
-  g_autoptr (GError) error = NULL;
-  GList *hashes = NULL;
+  GMutex            mutex;
+  GCond             cond;
+  guint             pending;
+} cowmail_scan_job;
 
-  g_autoptr (GSocketClient) client = g_socket_client_new ();
-  g_socket_client_set_protocol (client, G_SOCKET_PROTOCOL_SCTP);
-  g_autoptr (GSocketConnection) connection = g_socket_client_connect_to_host (client, hostname, COWMAIL_DEFAULT_PORT, NULL, &error);
-  if (!error) {
-    GOutputStream *ostream = g_io_stream_get_output_stream (G_IO_STREAM (connection));
-    g_output_stream_write (ostream, "", 1, NULL, &error);
 
-    GInputStream *istream = g_io_stream_get_input_stream (G_IO_STREAM (connection));
-    guchar head[COWMAIL_HEAD_SIZE];
-    while (g_input_stream_read (istream, head, COWMAIL_HEAD_SIZE, NULL, &error) == COWMAIL_HEAD_SIZE) {
+
+typedef struct
+{
+  cowmail_scan_job *job;
+  GList            *ids;
+  const guchar     *heads;
+  gsize             first;
+  gsize             n;
+  GList            *tickets;
+  const cowmail_id **owners;
+  gsize             skipped;
+} cowmail_scan_slice;
+
+
+
+static void
+cowmail_scan_slice_run (cowmail_scan_slice *slice)
+{
+  /* scans of other servers may add to the seen sets meanwhile */
+  for (GList *idl = slice->ids; idl; idl = idl->next)
+    if (((cowmail_id *) idl->data)->seen)
+      cowmail_seen_read_lock (((cowmail_id *) idl->data)->seen);
+
+  for (gsize i = 0; i < slice->n; i++) {
+    const guchar *head = slice->heads + i * COWMAIL_HEAD_SIZE;
+    for (GList *idl = slice->ids; idl; idl = idl->next) {
+      const cowmail_id *id = idl->data;
+      if (id->seen && cowmail_seen_skip (id->seen, head)) {
+        slice->skipped++;
+        continue;
+      }
       cowmail_ticket *t = cowmail_decrypt_head (id, head);
-      if (t)
-        hashes = g_list_prepend (hashes, t);
+      if (t) {
+        t->seq = slice->first + i;
+        slice->tickets = g_list_prepend (slice->tickets, t);
+        slice->owners[i] = id;
+        break;
+      }
     }
-    g_io_stream_close (G_IO_STREAM (connection), NULL, NULL);
-  } else {
-    g_printerr ("COWMAIL ERROR LIST: %s\n", error->message);
   }
-  return hashes;
+
+  for (GList *idl = slice->ids; idl; idl = idl->next)
+    if (((cowmail_id *) idl->data)->seen)
+      cowmail_seen_read_unlock (((cowmail_id *) idl->data)->seen);
 }
 
 
 
-gchar *
-cowmail_get (const gchar      *hostname,
-             cowmail_ticket   *ticket)
+static void
+cowmail_scan_worker (gpointer data,
+                     gpointer userdata)
 {
-  g_autoptr (GError) error = NULL;
-  g_autoptr (GSocketClient) client = g_socket_client_new ();
-  g_socket_client_set_protocol (client, G_SOCKET_PROTOCOL_SCTP);
+  cowmail_scan_slice *slice = data;
+  cowmail_scan_job *job = slice->job;
+  (void) userdata;
 
-  gchar *message = NULL;
-  GSocketConnection *connection = g_socket_client_connect_to_host (client, hostname, COWMAIL_DEFAULT_PORT, NULL, &error);
-  if (!error) {
-    GOutputStream *ostream = g_io_stream_get_output_stream (G_IO_STREAM (connection));
-    GInputStream *istream = g_io_stream_get_input_stream (G_IO_STREAM (connection));
-    g_output_stream_write (ostream, ticket->hash, COWMAIL_KEY_SIZE, NULL, &error);
-    gsize len;
-    guchar response[65536];
-    if ((len = g_input_stream_read (istream, response, 65536, NULL, &error)) > COWMAIL_TAG_SIZE) {
-      message = cowmail_decrypt_msg (ticket, response, len);
-    }
-    g_io_stream_close (G_IO_STREAM (connection), NULL, &error);
-  } else {
-    g_printerr ("COWMAIL ERROR GET: %s\n", error->message);
+  cowmail_scan_slice_run (slice);
+
+  g_mutex_lock (&job->mutex);
+  if (--job->pending == 0)
+    g_cond_signal (&job->cond);
+  g_mutex_unlock (&job->mutex);
+}
+
+
+
+static GThreadPool *
+cowmail_scan_pool (void)
+{
+  static gsize initialized = 0;
+  static GThreadPool *pool = NULL;
+
+  if (g_once_init_enter (&initialized)) {
+    pool = g_thread_pool_new (cowmail_scan_worker, NULL, g_get_num_processors (), FALSE, NULL);
+    g_once_init_leave (&initialized, 1);
+  }
+  return pool;
+}
+
+
+
+/* adds the scanned heads to the seen sets, after the workers are done reading them */
+static void
+cowmail_scan_record (GList             *ids,
+                     const guchar      *heads,
+                     gsize              n,
+                     const cowmail_id **owners,
+                     gsize              skipped,
+                     gint64             start)
+{
+  gsize matched = 0;
+  for (gsize i = 0; i < n; i++)
+    matched += owners[i] != NULL;
+  cowmail_metrics_scan (n, skipped, matched, start);
+
+  for (GList *idl = ids; idl; idl = idl->next) {
+    cowmail_id *id = idl->data;
+    if (id->seen)
+      for (gsize i = 0; i < n; i++)
+        cowmail_seen_add (id->seen, heads + i * COWMAIL_HEAD_SIZE, owners[i] == id);
+  }
+}
+
+
+
+/*
+ * Trial-decrypts n consecutive heads with every identity, skipping heads an
+ * identity has seen before. The heads are split into one slice per processor;
+ * the calling thread scans the first slice itself while the shared worker pool
+ * scans the others. The result has the same order as a serial scan that
+ * prepends every match.
+ */
+GList *
+cowmail_scan_heads (GList        *ids,
+                    const guchar *heads,
+                    gsize         n)
+{
+  gint64 start = g_get_monotonic_time ();
+  g_autofree const cowmail_id **owners = g_new0 (const cowmail_id *, MAX (n, 1));
+  gsize nslices = MIN ((gsize) g_get_num_processors (), n / COWMAIL_SCAN_SLICE_MIN);
+  if (nslices < 2) {
+    cowmail_scan_slice slice = { NULL, ids, heads, 0, n, NULL, owners, 0 };
+    cowmail_scan_slice_run (&slice);
+    cowmail_scan_record (ids, heads, n, owners, slice.skipped, start);
+    return slice.tickets;
+  }
+
+  cowmail_scan_job job;
+  g_mutex_init (&job.mutex);
+  g_cond_init (&job.cond);
+  job.pending = nslices - 1;
+
+  g_autofree cowmail_scan_slice *slices = g_new0 (cowmail_scan_slice, nslices);
+  gsize per = n / nslices;
+  for (gsize s = 0; s < nslices; s++) {
+    slices[s].job = &job;
+    slices[s].ids = ids;
+    slices[s].heads = heads + s * per * COWMAIL_HEAD_SIZE;
+    slices[s].first = s * per;
+    slices[s].n = (s == nslices - 1) ? n - s * per : per;
+    slices[s].owners = owners + s * per;
   }
-  return (gchar *) message;
+
+  GThreadPool *pool = cowmail_scan_pool ();
+  for (gsize s = 1; s < nslices; s++)
+    g_thread_pool_push (pool, &slices[s], NULL);
+  cowmail_scan_slice_run (&slices[0]);
+
+  g_mutex_lock (&job.mutex);
+  while (job.pending > 0)
+    g_cond_wait (&job.cond, &job.mutex);
+  g_mutex_unlock (&job.mutex);
+  g_cond_clear (&job.cond);
+  g_mutex_clear (&job.mutex);
+  gsize skipped = 0;
+  for (gsize s = 0; s < nslices; s++)
+    skipped += slices[s].skipped;
+  cowmail_scan_record (ids, heads, n, owners, skipped, start);
+
+  /* later heads come first, as with a serial scan */
+  GList *tickets = NULL;
+  for (gsize s = 0; s < nslices; s++)
+    tickets = g_list_concat (slices[s].tickets, tickets);
+  return tickets;
+}
+
+
+
+/*
+ * Reads up to limit bytes of heads from a stream into a reusable batch buffer,
+ * reassembling heads that are split across reads. Every full batch, and the
+ * rest at the end, is scanned on all processors and the matches are passed to
+ * the callback in stream order before the next batch is read.
+ */
+static gsize
+cowmail_scan_stream (GInputStream         *istream,
+                     guint64               limit,
+                     GList                *ids,
+                     cowmail_head_cache   *cache,
+                     guint64               cursor,
+                     cowmail_ticket_func   func,
+                     gpointer              userdata,
+                     GCancellable         *cancellable,
+                     GError              **error)
+{
+  g_autoptr (GError) cerror = NULL;
+  gsize size = COWMAIL_HEAD_SIZE * COWMAIL_SCAN_BATCH;
+  g_autofree guchar *buf = g_malloc (size);
+  gsize fill = 0;
+  gsize total = 0;
+  gboolean eof = (limit == 0);
+
+  while (!eof) {
+    gssize len = g_input_stream_read (istream, buf + fill, MIN (size - fill, limit), cancellable, error);
+    if (len > 0) {
+      fill += len;
+      limit -= len;
+      cowmail_metrics_bytes (len, 0);
+    }
+    if (len <= 0 || limit == 0)
+      eof = TRUE;
+
+    if (fill == size || (eof && fill >= COWMAIL_HEAD_SIZE)) {
+      gsize n = fill / COWMAIL_HEAD_SIZE;
+      GList *tickets = g_list_reverse (cowmail_scan_heads (ids, buf, n));
+      for (GList *t = tickets; t; t = t->next) {
+        ((cowmail_ticket *) t->data)->seq += cursor + total;
+        func (t->data, userdata);
+      }
+      g_list_free (tickets);
+      if (cache && !cerror && !cowmail_head_cache_append (cache, cursor + total, buf, n, &cerror))
+        g_printerr ("COWMAIL ERROR HEAD CACHE: %s\n", cerror->message);
+
+      total += n;
+      fill -= n * COWMAIL_HEAD_SIZE;
+      memmove (buf, buf + n * COWMAIL_HEAD_SIZE, fill);
+    }
+  }
+
+  if (fill > 0)
+    g_printerr ("COWMAIL ERROR LIST: Truncated head at end of stream.\n");
+  return total;
+}
+
+
+
+gsize
+cowmail_list_foreach (const gchar         *hostname,
+                      GList               *ids,
+                      cowmail_ticket_func  func,
+                      gpointer             userdata)
+{
+  g_autoptr (GError) error = NULL;
+  gsize n = 0;
+
+  gint64 start = g_get_monotonic_time ();
+  g_autoptr (GSocketConnection) connection = cowmail_connect (hostname, NULL, &error);
+  if (!error) {
+    GOutputStream *ostream = g_io_stream_get_output_stream (G_IO_STREAM (connection));
+    guchar request = COWMAIL_CMD_LIST;
+    if (g_output_stream_write (ostream, &request, 1, NULL, &error) == 1)
+      cowmail_metrics_bytes (0, 1);
+
+    GInputStream *istream = g_io_stream_get_input_stream (G_IO_STREAM (connection));
+    n = cowmail_scan_stream (istream, G_MAXUINT64, ids, NULL, 0, func, userdata, NULL, &error);
+    if (error)
+      g_printerr ("COWMAIL ERROR LIST: %s\n", error->message);
+    g_io_stream_close (G_IO_STREAM (connection), NULL, NULL);
+  } else {
+    g_printerr ("COWMAIL ERROR LIST: %s\n", error->message);
+  }
+  cowmail_metrics_record (COWMAIL_METRICS_LIST, start, !error);
+  return n;
+}
+
+
+
+/* what servers answered HELLO with, until it is asked again */
+static GMutex hosts_lock;
+/* servers with sessions, which all know LIST_SINCE, and servers without sessions */
+static GHashTable *framed = NULL;
+static GHashTable *oneshot = NULL;
+
+
+
+static gboolean
+cowmail_hosts_contains (GHashTable  *hosts,
+                        const gchar *hostname)
+{
+  g_mutex_lock (&hosts_lock);
+  gint64 *until = hosts ? g_hash_table_lookup (hosts, hostname) : NULL;
+  /* the server may have been upgraded since */
+  gboolean found = until && *until > g_get_monotonic_time ();
+  if (until && !found)
+    g_hash_table_remove (hosts, hostname);
+  g_mutex_unlock (&hosts_lock);
+  return found;
+}
+
+
+
+static void
+cowmail_hosts_add (GHashTable  **hosts,
+                   const gchar  *hostname)
+{
+  gint64 *until = g_new (gint64, 1);
+  *until = g_get_monotonic_time () + COWMAIL_LEGACY_TTL * G_USEC_PER_SEC;
+  g_mutex_lock (&hosts_lock);
+  if (!*hosts)
+    *hosts = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_hash_table_insert (*hosts, g_strdup (hostname), until);
+  g_mutex_unlock (&hosts_lock);
+}
+
+
+
+/* the cursor for the next request, from the cursor the server sent after n heads */
+static guint64
+cowmail_list_next (guint64 cursor,
+                   guint64 server_cursor,
+                   gsize   n)
+{
+  if (server_cursor < cursor) {
+    g_printerr ("COWMAIL ERROR LIST: Server has %" G_GUINT64_FORMAT " heads, starting over.\n", server_cursor);
+    return 0;
+  }
+  if (server_cursor != cursor + n)
+    g_printerr ("COWMAIL ERROR LIST: Expected %" G_GUINT64_FORMAT " heads, got %" G_GSIZE_FORMAT ".\n",
+                server_cursor - cursor, n);
+  return server_cursor;
+}
+
+
+
+/* lists everything with LIST and skips the heads before the cursor */
+static gsize
+cowmail_list_skip (const gchar         *hostname,
+                   GList               *ids,
+                   guint64              cursor,
+                   guint64             *next,
+                   cowmail_ticket_func  func,
+                   gpointer             userdata,
+                   GError             **error)
+{
+  g_autoptr (GSocketConnection) connection = cowmail_connect (hostname, NULL, error);
+  if (!connection)
+    return 0;
+
+  gsize n = 0;
+  GOutputStream *ostream = g_io_stream_get_output_stream (G_IO_STREAM (connection));
+  guchar request = COWMAIL_CMD_LIST;
+  if (g_output_stream_write (ostream, &request, 1, NULL, error) == 1) {
+    cowmail_metrics_bytes (0, 1);
+    GInputStream *istream = g_io_stream_get_input_stream (G_IO_STREAM (connection));
+    guint64 skip = cursor * COWMAIL_HEAD_SIZE;
+    gssize len = 1;
+    while (skip > 0 && len > 0) {
+      len = g_input_stream_skip (istream, MIN (skip, COWMAIL_HEAD_SIZE * COWMAIL_SCAN_BATCH), NULL, error);
+      if (len > 0)
+        skip -= len;
+    }
+    if (skip == 0) {
+      n = cowmail_scan_stream (istream, G_MAXUINT64, ids, NULL, cursor, func, userdata, NULL, error);
+      *next = cursor + n;
+    } else if (len == 0) {
+      /* the server has fewer heads than the cursor: start over next time */
+      *next = 0;
+    }
+  }
+  g_io_stream_close (G_IO_STREAM (connection), NULL, NULL);
+  return n;
+}
+
+
+
+/* a server without sessions is older than LIST_SINCE too, so it gets LIST */
+static gsize
+cowmail_list_legacy (const gchar         *hostname,
+                     GList               *ids,
+                     guint64              cursor,
+                     guint64             *next,
+                     cowmail_ticket_func  func,
+                     gpointer             userdata)
+{
+  g_autoptr (GError) error = NULL;
+  *next = cursor;
+  gint64 start = g_get_monotonic_time ();
+  gsize n = cowmail_list_skip (hostname, ids, cursor, next, func, userdata, &error);
+  if (error)
+    g_printerr ("COWMAIL ERROR LIST: %s\n", error->message);
+  cowmail_metrics_record (COWMAIL_METRICS_LIST, start, !error);
+  return n;
+}
+
+
+
+gsize
+cowmail_list_since (const gchar         *hostname,
+                    GList               *ids,
+                    guint64              cursor,
+                    guint32              limit,
+                    guint64             *next,
+                    cowmail_ticket_func  func,
+                    gpointer             userdata)
+{
+  g_autoptr (GError) error = NULL;
+  gsize n = 0;
+  *next = cursor;
+
+  /* a server from before LIST_SINCE would store the request, so ask it for HELLO first */
+  if (!cowmail_hosts_contains (framed, hostname)) {
+    cowmail_session *session = cowmail_session_connect (hostname, NULL, &error);
+    if (!session) {
+      g_printerr ("COWMAIL ERROR LIST: %s\n", error->message);
+      return 0;
+    }
+    /* a session without connection uses LIST */
+    n = cowmail_session_list (session, ids, cursor, limit, next, func, userdata);
+    cowmail_session_close (session);
+    return n;
+  }
+
+  guchar request[COWMAIL_LIST_SINCE_SIZE];
+  request[0] = COWMAIL_CMD_LIST_SINCE;
+  guint64 becursor = GUINT64_TO_BE (cursor);
+  guint32 belimit = GUINT32_TO_BE (limit);
+  memcpy (request + 1, &becursor, sizeof (becursor));
+  memcpy (request + 1 + sizeof (becursor), &belimit, sizeof (belimit));
+
+  gint64 start = g_get_monotonic_time ();
+  g_autoptr (GSocketConnection) connection = cowmail_connect (hostname, NULL, &error);
+  if (!error) {
+    GOutputStream *ostream = g_io_stream_get_output_stream (G_IO_STREAM (connection));
+    if (g_output_stream_write_all (ostream, request, sizeof (request), NULL, NULL, &error))
+      cowmail_metrics_bytes (0, sizeof (request));
+
+    /* the reply starts with the cursor after the last head it contains */
+    GInputStream *istream = g_io_stream_get_input_stream (G_IO_STREAM (connection));
+    gsize len = 0;
+    if (!error && g_input_stream_read_all (istream, &becursor, sizeof (becursor), &len, NULL, &error)) {
+      if (len < sizeof (becursor))
+        g_set_error (&error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED, "Connection closed by server");
+    }
+    if (!error) {
+      cowmail_metrics_bytes (len, 0);
+      n = cowmail_scan_stream (istream, G_MAXUINT64, ids, NULL, cursor, func, userdata, NULL, &error);
+      *next = error ? cursor + n : cowmail_list_next (cursor, GUINT64_FROM_BE (becursor), n);
+    }
+    g_io_stream_close (G_IO_STREAM (connection), NULL, NULL);
+  }
+
+  if (error)
+    g_printerr ("COWMAIL ERROR LIST: %s\n", error->message);
+  cowmail_metrics_record (COWMAIL_METRICS_LIST, start, !error);
+  return n;
+}
+
+
+
+static void
+cowmail_list_collect (cowmail_ticket *ticket,
+                      gpointer        userdata)
+{
+  GList **hashes = userdata;
+  *hashes = g_list_prepend (*hashes, ticket);
+}
+
+
+
+GList *
+cowmail_list_ids (const gchar *hostname,
+                  GList       *ids)
+{
+  GList *hashes = NULL;
+  cowmail_list_foreach (hostname, ids, cowmail_list_collect, &hashes);
+  return hashes;
+}
+
+
+
+GList *
+cowmail_list (const gchar      *hostname,
+              const cowmail_id *id)
+{
+  GList ids = { (gpointer) id, NULL, NULL };
+  return cowmail_list_ids (hostname, &ids);
+}
+
+
+
+gboolean
+cowmail_get_stream (const gchar           *hostname,
+                    const cowmail_ticket  *ticket,
+                    GOutputStream         *clear,
+                    GCancellable          *cancellable,
+                    GError               **error)
+{
+  gint64 start = g_get_monotonic_time ();
+  g_autoptr (GSocketConnection) connection = cowmail_connect (hostname, cancellable, error);
+  if (!connection) {
+    cowmail_metrics_record (COWMAIL_METRICS_GET, start, FALSE);
+    return FALSE;
+  }
+
+  GOutputStream *ostream = g_io_stream_get_output_stream (G_IO_STREAM (connection));
+  GInputStream *istream = g_io_stream_get_input_stream (G_IO_STREAM (connection));
+  guint64 nread = 0;
+  gboolean ok = g_output_stream_write_all (ostream, ticket->hash, COWMAIL_KEY_SIZE, NULL, cancellable, error) &&
+                cowmail_decrypt_chunks (ticket, istream, clear, &nread, cancellable, error);
+  g_io_stream_close (G_IO_STREAM (connection), NULL, NULL);
+  cowmail_metrics_bytes (nread, COWMAIL_KEY_SIZE);
+  cowmail_metrics_record (COWMAIL_METRICS_GET, start, ok);
+  return ok;
+}
+
+
+
+/* fails with G_IO_ERROR_NOT_FOUND or G_IO_ERROR_INVALID_DATA for a message that cannot be had at all */
+static gchar *
+cowmail_get_text (const gchar           *hostname,
+                  const cowmail_ticket  *ticket,
+                  GCancellable          *cancellable,
+                  GError               **error)
+{
+  g_autoptr (GOutputStream) ostream = g_memory_output_stream_new_resizable ();
+  if (!cowmail_get_stream (hostname, ticket, ostream, cancellable, error))
+    return NULL;
+  GMemoryOutputStream *mstream = G_MEMORY_OUTPUT_STREAM (ostream);
+  g_output_stream_close (ostream, NULL, NULL);
+  gsize n = g_memory_output_stream_get_data_size (mstream);
+  gchar *message = g_memory_output_stream_steal_data (mstream);
+  /* as in cowmail_decrypt_msg(), the marker comes first */
+  if (n > 1 && message[0] == '\0')
+    message = cowmail_decompress_text ((guchar *) message, n);
+  else if (n == 0 || message[n - 1] != '\0')
+    g_clear_pointer (&message, g_free);
+  if (!message)
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Message is not text");
+  return message;
+}
+
+
+
+gchar *
+cowmail_get (const gchar      *hostname,
+             cowmail_ticket   *ticket)
+{
+  g_autoptr (GError) error = NULL;
+  gchar *message = cowmail_get_text (hostname, ticket, NULL, &error);
+  if (!message)
+    g_printerr ("COWMAIL ERROR GET: %s\n", error->message);
+  return message;
+}
+
+
+
+/* a session without connection sends one-shot requests to hostname */
+struct _cowmail_session
+{
+  gchar             *hostname;
+  GSocketConnection *connection;
+  GInputStream      *istream;
+  GOutputStream     *ostream;
+  GCancellable      *cancellable;
+  GError            *error;
+  guint16            version;
+  guint32            features;
+  guint8             difficulty;
+};
+
+
+
+void
+cowmail_session_close (cowmail_session *session)
+{
+  if (session->connection) {
+    g_io_stream_close (G_IO_STREAM (session->connection), NULL, NULL);
+    g_object_unref (session->connection);
+  }
+  g_clear_object (&session->cancellable);
+  g_clear_error (&session->error);
+  g_free (session->hostname);
+  g_free (session);
+}
+
+
+
+const gchar *
+cowmail_status_message (guchar status)
+{
+  switch (status) {
+  case COWMAIL_STATUS_OK:
+    return "OK";
+  case COWMAIL_STATUS_NOT_FOUND:
+    return "No such message";
+  case COWMAIL_STATUS_BAD_REQUEST:
+    return "Bad request";
+  case COWMAIL_STATUS_TOO_LARGE:
+    return "Request too large";
+  case COWMAIL_STATUS_UNSUPPORTED:
+    return "Request not supported by the server";
+  case COWMAIL_STATUS_SERVER_ERROR:
+    return "Server error";
+  case COWMAIL_STATUS_STAMP:
+    return "Stamp missing or too weak";
+  case COWMAIL_STATUS_BUSY:
+    return "Server busy, try again later";
+  case COWMAIL_STATUS_SENT:
+    return "Sent, but the server does not confirm it";
+  default:
+    return "Unknown server status";
+  }
+}
+
+
+
+/* sets the error for a status other than OK, BUSY apart so that callers can try again later */
+static void
+cowmail_status_set_error (GError **error,
+                          guchar   status)
+{
+  g_set_error (error, G_IO_ERROR, status == COWMAIL_STATUS_BUSY ? G_IO_ERROR_BUSY : G_IO_ERROR_FAILED,
+               "%s", cowmail_status_message (status));
+}
+
+
+
+/* reports an error and keeps the first one for the async functions */
+static void
+cowmail_session_fail (cowmail_session *session,
+                      const gchar     *request,
+                      const GError    *error)
+{
+  if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    g_printerr ("COWMAIL ERROR %s: %s\n", request, error->message);
+  if (!session->error)
+    session->error = g_error_copy (error);
+}
+
+
+
+/* sends a frame whose payload is prefix followed by payload */
+static gboolean
+cowmail_session_send_prefixed (cowmail_session  *session,
+                               guchar            type,
+                               const guchar     *prefix,
+                               gsize             plen,
+                               const guchar     *payload,
+                               gsize             len,
+                               GError          **error)
+{
+  /* one write per frame, so each request is a single SCTP message */
+  gsize size = COWMAIL_FRAME_HEADER_SIZE + plen + len;
+  g_autofree guchar *frame = g_malloc (size);
+  guint32 belen = GUINT32_TO_BE (plen + len);
+  frame[0] = type;
+  memcpy (frame + 1, &belen, sizeof (belen));
+  if (plen)
+    memcpy (frame + COWMAIL_FRAME_HEADER_SIZE, prefix, plen);
+  memcpy (frame + COWMAIL_FRAME_HEADER_SIZE + plen, payload, len);
+  if (!g_output_stream_write_all (session->ostream, frame, size, NULL, session->cancellable, error))
+    return FALSE;
+  cowmail_metrics_bytes (0, size);
+  return TRUE;
+}
+
+
+
+static gboolean
+cowmail_session_send (cowmail_session  *session,
+                      guchar            type,
+                      const guchar     *payload,
+                      gsize             len,
+                      GError          **error)
+{
+  return cowmail_session_send_prefixed (session, type, NULL, 0, payload, len, error);
+}
+
+
+
+/* sends a PUT frame, with a stamp if the server asks for one */
+static gboolean
+cowmail_session_send_put (cowmail_session  *session,
+                          const guchar     *msg,
+                          gsize             len,
+                          GError          **error)
+{
+  if (!(session->features & COWMAIL_FEATURE_STAMP))
+    return cowmail_session_send (session, COWMAIL_FRAME_PUT, msg, len, error);
+
+  if (len < COWMAIL_HEAD_SIZE || session->difficulty > COWMAIL_STAMP_MAX_BITS) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                 "The server asks for a stamp of %u bits", session->difficulty);
+    return FALSE;
+  }
+  guchar stamp[COWMAIL_STAMP_SIZE];
+  if (!cowmail_stamp_solve (msg, session->difficulty, stamp, session->cancellable)) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED, "Operation was cancelled");
+    return FALSE;
+  }
+  return cowmail_session_send_prefixed (session, COWMAIL_FRAME_PUT, stamp, sizeof (stamp), msg, len, error);
+}
+
+
+
+static gboolean
+cowmail_session_recv (cowmail_session  *session,
+                      guchar           *status,
+                      guint32          *len,
+                      GError          **error)
+{
+  guchar header[COWMAIL_FRAME_HEADER_SIZE];
+  gsize n = 0;
+  if (!g_input_stream_read_all (session->istream, header, sizeof (header), &n, session->cancellable, error))
+    return FALSE;
+  cowmail_metrics_bytes (n, 0);
+  if (n < sizeof (header)) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED, "Connection closed by server");
+    return FALSE;
+  }
+  *status = header[0];
+  memcpy (len, header + 1, sizeof (*len));
+  *len = GUINT32_FROM_BE (*len);
+  return TRUE;
+}
+
+
+
+/* drops a response payload without reading it into memory */
+static gboolean
+cowmail_session_skip_payload (cowmail_session  *session,
+                              guint32           len,
+                              GError          **error)
+{
+  while (len > 0) {
+    gssize n = g_input_stream_skip (session->istream, len, session->cancellable, error);
+    if (n < 0)
+      return FALSE;
+    if (n == 0) {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED, "Connection closed by server");
+      return FALSE;
+    }
+    cowmail_metrics_bytes (n, 0);
+    len -= n;
+  }
+  return TRUE;
+}
+
+
+
+static guchar *
+cowmail_session_recv_payload (cowmail_session  *session,
+                              guint32           len,
+                              GError          **error)
+{
+  if (len > COWMAIL_FRAME_MAX) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Response of %u bytes is too large", len);
+    return NULL;
+  }
+  guchar *payload = g_malloc (MAX (len, 1));
+  gsize n = 0;
+  if (!g_input_stream_read_all (session->istream, payload, len, &n, session->cancellable, error)) {
+    g_free (payload);
+    return NULL;
+  }
+  cowmail_metrics_bytes (n, 0);
+  if (n < len) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED, "Connection closed by server");
+    g_free (payload);
+    return NULL;
+  }
+  return payload;
+}
+
+
+
+/*
+ * Agrees on the protocol version. A server without HELLO rejects it like any
+ * unknown frame, which leaves the session usable as version 1.
+ */
+static gboolean
+cowmail_session_hello (cowmail_session  *session,
+                       GError          **error)
+{
+  guchar hello[COWMAIL_HELLO_SIZE];
+  guint16 version = GUINT16_TO_BE (COWMAIL_PROTOCOL_VERSION);
+  guint32 features = GUINT32_TO_BE (COWMAIL_FEATURES);
+  memcpy (hello, &version, sizeof (version));
+  memcpy (hello + sizeof (version), &features, sizeof (features));
+
+  guchar status;
+  guint32 len;
+  if (!cowmail_session_send (session, COWMAIL_FRAME_HELLO, hello, sizeof (hello), error) ||
+      !cowmail_session_recv (session, &status, &len, error))
+    return FALSE;
+  g_autofree guchar *payload = cowmail_session_recv_payload (session, len, error);
+  if (!payload)
+    return FALSE;
+
+  /* earlier servers over their connection cap closed the connection after this */
+  if (status == COWMAIL_STATUS_BUSY) {
+    cowmail_status_set_error (error, status);
+    return FALSE;
+  }
+  session->version = 1;
+  session->features = 0;
+  session->difficulty = 0;
+  if (status == COWMAIL_STATUS_OK && len >= COWMAIL_HELLO_SIZE) {
+    memcpy (&version, payload, sizeof (version));
+    memcpy (&features, payload + sizeof (version), sizeof (features));
+    session->version = MIN (GUINT16_FROM_BE (version), COWMAIL_PROTOCOL_VERSION);
+    session->features = GUINT32_FROM_BE (features) & COWMAIL_FEATURES;
+    /* the difficulty follows the features, a reply without it asks for no work */
+    if (len > COWMAIL_HELLO_SIZE)
+      session->difficulty = payload[COWMAIL_HELLO_SIZE];
+    else
+      session->features &= ~COWMAIL_FEATURE_STAMP;
+  }
+  return TRUE;
+}
+
+
+
+cowmail_session *
+cowmail_session_connect (const gchar   *hostname,
+                         GCancellable  *cancellable,
+                         GError       **error)
+{
+  cowmail_session *session = g_new0 (cowmail_session, 1);
+  session->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+  if (cowmail_hosts_contains (oneshot, hostname)) {
+    session->hostname = g_strdup (hostname);
+    return session;
+  }
+
+  GError *lerror = NULL;
+  session->connection = cowmail_connect (hostname, cancellable, &lerror);
+  if (session->connection) {
+    session->istream = g_io_stream_get_input_stream (G_IO_STREAM (session->connection));
+    session->ostream = g_io_stream_get_output_stream (G_IO_STREAM (session->connection));
+    /* a server without sessions takes the request for a one-shot PUT and waits for the rest */
+    GSocket *socket = g_socket_connection_get_socket (session->connection);
+    g_socket_set_timeout (socket, COWMAIL_HELLO_TIMEOUT);
+    guchar request = COWMAIL_CMD_SESSION;
+    if (g_output_stream_write_all (session->ostream, &request, 1, NULL, cancellable, &lerror) &&
+        cowmail_session_hello (session, &lerror)) {
+      g_socket_set_timeout (socket, 0);
+      cowmail_hosts_add (&framed, hostname);
+      return session;
+    }
+    /* a slow server is not a server without sessions, only one that answers one-shot requests is */
+    if (g_error_matches (lerror, G_IO_ERROR, G_IO_ERROR_TIMED_OUT)) {
+      cowmail_abort (session->connection);
+      g_clear_object (&session->connection);
+      if (cowmail_probe_oneshot (hostname, cancellable)) {
+        g_printerr ("COWMAIL ERROR SESSION: %s does not know sessions, using one-shot requests.\n", hostname);
+        g_clear_error (&lerror);
+        cowmail_hosts_add (&oneshot, hostname);
+        session->hostname = g_strdup (hostname);
+        return session;
+      }
+    }
+  }
+
+  g_propagate_error (error, lerror);
+  cowmail_session_close (session);
+  return NULL;
+}
+
+
+
+void
+cowmail_session_set_cancellable (cowmail_session *session,
+                                 GCancellable    *cancellable)
+{
+  g_clear_object (&session->cancellable);
+  session->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
+}
+
+
+
+GError *
+cowmail_session_take_error (cowmail_session *session)
+{
+  return g_steal_pointer (&session->error);
+}
+
+
+
+gboolean
+cowmail_session_is_idle (cowmail_session *session)
+{
+  if (!session->connection)
+    return TRUE;
+  /* the server sends nothing unasked, so anything readable is an EOF or an error */
+  GSocket *socket = g_socket_connection_get_socket (session->connection);
+  return g_socket_condition_check (socket, G_IO_IN | G_IO_HUP | G_IO_ERR) == 0;
+}
+
+
+
+cowmail_session *
+cowmail_session_open (const gchar *hostname)
+{
+  g_autoptr (GError) error = NULL;
+  cowmail_session *session = cowmail_session_connect (hostname, NULL, &error);
+  if (!session)
+    g_printerr ("COWMAIL ERROR SESSION: %s\n", error->message);
+  return session;
+}
+
+
+
+guint16
+cowmail_session_get_version (cowmail_session *session)
+{
+  return session->version;
+}
+
+
+
+guint32
+cowmail_session_get_features (cowmail_session *session)
+{
+  return session->features;
+}
+
+
+
+gboolean
+cowmail_session_put (cowmail_session  *session,
+                     const gchar      *msg,
+                     const cowmail_id *id)
+{
+  g_autoptr (GError) error = NULL;
+  gsize len;
+  g_autofree guchar *cryptotext = cowmail_encrypt_text (id, msg, &len);
+  gboolean ok = FALSE;
+
+  gint64 start = g_get_monotonic_time ();
+  guchar status;
+  guint32 rlen;
+  if (!session->connection) {
+    ok = cowmail_put_oneshot (session->hostname, cryptotext, len, session->cancellable, &error);
+  } else if (cowmail_session_send_put (session, cryptotext, len, &error) &&
+             cowmail_session_recv (session, &status, &rlen, &error)) {
+    g_autofree guchar *payload = cowmail_session_recv_payload (session, rlen, &error);
+    ok = payload && status == COWMAIL_STATUS_OK;
+    if (payload && !ok)
+      g_printerr ("COWMAIL ERROR PUT: %s.\n", cowmail_status_message (status));
+  }
+  if (error)
+    cowmail_session_fail (session, "PUT", error);
+  cowmail_metrics_record (COWMAIL_METRICS_PUT, start, ok);
+  return ok;
+}
+
+
+
+gsize
+cowmail_session_put_many (cowmail_session  *session,
+                          GBytes          **msgs,
+                          gsize             n,
+                          guchar           *status)
+{
+  g_autoptr (GError) error = NULL;
+  gsize nacked = 0;
+  gsize sent = 0;
+
+  gint64 start = g_get_monotonic_time ();
+  for (gsize i = 0; i < n; i++)
+    status[i] = COWMAIL_STATUS_SERVER_ERROR;
+
+  /* one-shot PUTs have no reply, so a sent message is not known to be stored */
+  for (gsize i = 0; i < n && !session->connection && !error; i++) {
+    gsize len;
+    const guchar *data = g_bytes_get_data (msgs[i], &len);
+    if (cowmail_put_oneshot (session->hostname, data, len, session->cancellable, &error))
+      status[i] = COWMAIL_STATUS_SENT;
+  }
+
+  /* keep up to COWMAIL_PUT_WINDOW messages in flight */
+  for (gsize i = 0; i < n && session->connection && !error; i++) {
+    for (; sent < n && sent < i + COWMAIL_PUT_WINDOW && !error; sent++) {
+      gsize len;
+      const guchar *data = g_bytes_get_data (msgs[sent], &len);
+      cowmail_session_send_put (session, data, len, &error);
+    }
+
+    guchar rstatus;
+    guint32 len;
+    if (!error && cowmail_session_recv (session, &rstatus, &len, &error)) {
+      g_autofree guchar *payload = cowmail_session_recv_payload (session, len, &error);
+      if (payload)
+        status[i] = rstatus;
+      if (payload && rstatus == COWMAIL_STATUS_OK)
+        nacked++;
+      /* the difficulty went up since HELLO, so a new session has to ask for it */
+      if (payload && rstatus == COWMAIL_STATUS_STAMP && !error)
+        cowmail_status_set_error (&error, rstatus);
+    }
+  }
+
+  /* no stamp the client may solve is good enough for this server */
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED))
+    for (gsize i = 0; i < n; i++)
+      if (status[i] == COWMAIL_STATUS_SERVER_ERROR)
+        status[i] = COWMAIL_STATUS_UNSUPPORTED;
+
+  if (error)
+    cowmail_session_fail (session, "PUT", error);
+  cowmail_metrics_record (COWMAIL_METRICS_PUT, start, !error);
+  return nacked;
+}
+
+
+
+gsize
+cowmail_session_list (cowmail_session     *session,
+                      GList               *ids,
+                      guint64              cursor,
+                      guint32              limit,
+                      guint64             *next,
+                      cowmail_ticket_func  func,
+                      gpointer             userdata)
+{
+  return cowmail_session_list_cached (session, ids, cursor, limit, next, NULL, func, userdata);
+}
+
+
+
+gsize
+cowmail_session_list_cached (cowmail_session     *session,
+                             GList               *ids,
+                             guint64              cursor,
+                             guint32              limit,
+                             guint64             *next,
+                             cowmail_head_cache  *cache,
+                             cowmail_ticket_func  func,
+                             gpointer             userdata)
+{
+  if (!session->connection)
+    return cowmail_list_legacy (session->hostname, ids, cursor, next, func, userdata);
+
+  g_autoptr (GError) error = NULL;
+  gboolean ok = FALSE;
+  gsize n = 0;
+  *next = cursor;
+
+  gint64 start = g_get_monotonic_time ();
+  guchar request[sizeof (guint64) + sizeof (guint32)];
+  guint64 becursor = GUINT64_TO_BE (cursor);
+  guint32 belimit = GUINT32_TO_BE (limit);
+  memcpy (request, &becursor, sizeof (becursor));
+  memcpy (request + sizeof (becursor), &belimit, sizeof (belimit));
+
+  guchar status;
+  guint32 len;
+  if (cowmail_session_send (session, COWMAIL_FRAME_LIST, request, sizeof (request), &error) &&
+      cowmail_session_recv (session, &status, &len, &error)) {
+    if (status == COWMAIL_STATUS_OK && len >= sizeof (becursor)) {
+      gsize rlen = 0;
+      if (g_input_stream_read_all (session->istream, &becursor, sizeof (becursor), &rlen, session->cancellable, &error) &&
+          rlen == sizeof (becursor)) {
+        cowmail_metrics_bytes (rlen, 0);
+        /* a server that has fewer messages than the cache lost them, so the cached heads are stale */
+        guint64 scursor = GUINT64_FROM_BE (becursor);
+        g_autoptr (GError) cerror = NULL;
+        if (cache && scursor < cursor && scursor < cowmail_head_cache_get_watermark (cache, NULL)) {
+          g_printerr ("COWMAIL ERROR LIST: The server has fewer messages than the cache, emptying it.\n");
+          if (!cowmail_head_cache_reset (cache, &cerror))
+            g_printerr ("COWMAIL ERROR LIST: %s\n", cerror->message);
+        }
+        n = cowmail_scan_stream (session->istream, len - sizeof (becursor), ids, cache, cursor, func, userdata,
+                                 session->cancellable, &error);
+        *next = error ? cursor + n : cowmail_list_next (cursor, scursor, n);
+        ok = !error;
+      }
+    } else {
+      cowmail_session_skip_payload (session, len, &error);
+      if (!error && status == COWMAIL_STATUS_OK)
+        g_set_error (&error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Invalid LIST response");
+      else if (!error)
+        cowmail_status_set_error (&error, status);
+    }
+  }
+  if (error)
+    cowmail_session_fail (session, "LIST", error);
+  cowmail_metrics_record (COWMAIL_METRICS_LIST, start, ok);
+  return n;
+}
+
+
+
+gchar *
+cowmail_session_get (cowmail_session *session,
+                     cowmail_ticket  *ticket)
+{
+  if (!session->connection)
+    return cowmail_get (session->hostname, ticket);
+
+  g_autoptr (GError) error = NULL;
+  gchar *message = NULL;
+
+  gint64 start = g_get_monotonic_time ();
+  guchar status;
+  guint32 len;
+  if (cowmail_session_send (session, COWMAIL_FRAME_GET, ticket->hash, COWMAIL_KEY_SIZE, &error) &&
+      cowmail_session_recv (session, &status, &len, &error)) {
+    g_autofree guchar *payload = cowmail_session_recv_payload (session, len, &error);
+    if (payload && status == COWMAIL_STATUS_OK)
+      message = cowmail_decrypt_msg (ticket, payload, len);
+  }
+  if (error)
+    cowmail_session_fail (session, "GET", error);
+  cowmail_metrics_record (COWMAIL_METRICS_GET, start, message != NULL);
+  return message;
+}
+
+
+
+/* sends one GET_MANY request for up to COWMAIL_GET_MANY_MAX tickets */
+static GList *
+cowmail_session_send_get_many (cowmail_session  *session,
+                               GList            *tickets,
+                               GError          **error)
+{
+  g_autofree guchar *hashes = g_malloc (COWMAIL_KEY_SIZE * COWMAIL_GET_MANY_MAX);
+  guint k = 0;
+  for (; tickets && k < COWMAIL_GET_MANY_MAX; tickets = tickets->next, k++)
+    memcpy (hashes + k * COWMAIL_KEY_SIZE, ((cowmail_ticket *) tickets->data)->hash, COWMAIL_KEY_SIZE);
+  cowmail_session_send (session, COWMAIL_FRAME_GET_MANY, hashes, k * COWMAIL_KEY_SIZE, error);
+  return tickets;
+}
+
+
+
+gsize
+cowmail_session_get_many (cowmail_session  *session,
+                          GList            *tickets,
+                          cowmail_msg_func  func,
+                          gpointer          userdata)
+{
+  gsize received = 0;
+  for (GList *t = tickets; t && !session->connection; t = t->next) {
+    g_autoptr (GError) gerror = NULL;
+    gchar *message = cowmail_get_text (session->hostname, t->data, session->cancellable, &gerror);
+    /* a missing or broken message is passed on like over a session, anything else ends the call */
+    if (!message && !g_error_matches (gerror, G_IO_ERROR, G_IO_ERROR_NOT_FOUND) &&
+        !g_error_matches (gerror, G_IO_ERROR, G_IO_ERROR_INVALID_DATA)) {
+      cowmail_session_fail (session, "GET", gerror);
+      break;
+    }
+    if (message)
+      received++;
+    func (t->data, message, userdata);
+  }
+  if (!session->connection)
+    return received;
+
+  g_autoptr (GError) error = NULL;
+  gint64 start = g_get_monotonic_time ();
+
+  /*
+   * Keep the next request in flight while reading the responses to the
+   * current one, so that up to 2 * COWMAIL_GET_MANY_MAX bodies arrive per
+   * round trip without both sides blocking on full buffers.
+   */
+  GList *unsent = tickets ? cowmail_session_send_get_many (session, tickets, &error) : NULL;
+  guint left = 0;
+  for (GList *t = tickets; t && !error; t = t->next) {
+    if (left == 0) {
+      if (unsent)
+        unsent = cowmail_session_send_get_many (session, unsent, &error);
+      left = COWMAIL_GET_MANY_MAX;
+    }
+    left--;
+
+    /* one response per hash, in request order */
+    guchar status;
+    guint32 len;
+    if (!cowmail_session_recv (session, &status, &len, &error))
+      break;
+    g_autofree guchar *payload = cowmail_session_recv_payload (session, len, &error);
+    if (!payload)
+      break;
+    /* a refused GET_MANY has one response for all of its hashes, so the rest would be out of step */
+    if (status != COWMAIL_STATUS_OK && status != COWMAIL_STATUS_NOT_FOUND) {
+      cowmail_status_set_error (&error, status);
+      break;
+    }
+    gchar *message = NULL;
+    if (status == COWMAIL_STATUS_OK)
+      message = cowmail_decrypt_msg (t->data, payload, len);
+    if (message)
+      received++;
+    func (t->data, message, userdata);
+  }
+
+  if (error)
+    cowmail_session_fail (session, "GET", error);
+  cowmail_metrics_record (COWMAIL_METRICS_GET, start, !error);
+  return received;
+}
+
+
+
+gsize
+cowmail_get_many (const gchar      *hostname,
+                  GList            *tickets,
+                  cowmail_msg_func  func,
+                  gpointer          userdata)
+{
+  g_autoptr (GError) error = NULL;
+  return cowmail_client_get_many (cowmail_client_lookup (hostname), tickets, func, userdata, NULL, &error);
+}
+
+
+
+/*
+ * Asynchronous requests. Each one runs on a worker thread of the GTask pool,
+ * over a session of the shared cowmail_client for the server, with the
+ * cancellable passed down to every read and write.
+ */
+
+typedef struct
+{
+  gchar   *hostname;
+  GBytes  *msg;
+  GList   *ids;
+  GList   *tickets;
+  guint64  cursor;
+  guint32  limit;
+  guint64  next;
+} cowmail_task_data;
+
+
+
+static void
+cowmail_task_data_free (cowmail_task_data *data)
+{
+  g_free (data->hostname);
+  if (data->msg)
+    g_bytes_unref (data->msg);
+  g_list_free (data->ids);
+  g_list_free (data->tickets);
+  g_free (data);
+}
+
+
+
+static GTask *
+cowmail_task_new (const gchar         *hostname,
+                  GCancellable        *cancellable,
+                  GAsyncReadyCallback  callback,
+                  gpointer             userdata,
+                  gpointer             tag,
+                  cowmail_task_data  **data)
+{
+  GTask *task = g_task_new (NULL, cancellable, callback, userdata);
+  g_task_set_source_tag (task, tag);
+  g_task_set_return_on_cancel (task, FALSE);
+  *data = g_new0 (cowmail_task_data, 1);
+  (*data)->hostname = g_strdup (hostname);
+  g_task_set_task_data (task, *data, (GDestroyNotify) cowmail_task_data_free);
+  return task;
+}
+
+
+
+/* returns the error of the request, if any, to the task */
+static gboolean
+cowmail_task_end (GTask  *task,
+                  GError *error)
+{
+  if (error || g_task_return_error_if_cancelled (task)) {
+    if (error)
+      g_task_return_error (task, error);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+
+
+static void
+cowmail_put_thread (GTask        *task,
+                    gpointer      source,
+                    gpointer      task_data,
+                    GCancellable *cancellable)
+{
+  (void) source;
+  cowmail_task_data *data = task_data;
+  GError *error = NULL;
+
+  guchar status;
+  cowmail_client_put_many (cowmail_client_lookup (data->hostname), &data->msg, 1, &status, cancellable, &error);
+  if (!cowmail_task_end (task, error))
+    return;
+  if (status == COWMAIL_STATUS_OK)
+    g_task_return_boolean (task, TRUE);
+  else
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED, "%s", cowmail_status_message (status));
+}
+
+
+
+void
+cowmail_put_async (const gchar         *hostname,
+                   const gchar         *msg,
+                   const cowmail_id    *id,
+                   GCancellable        *cancellable,
+                   GAsyncReadyCallback  callback,
+                   gpointer             userdata)
+{
+  cowmail_task_data *data;
+  g_autoptr (GTask) task = cowmail_task_new (hostname, cancellable, callback, userdata, cowmail_put_async, &data);
+  data->msg = cowmail_msg_encrypt (msg, id);
+  g_task_run_in_thread (task, cowmail_put_thread);
+}
+
+
+
+gboolean
+cowmail_put_finish (GAsyncResult  *result,
+                    GError       **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, NULL), FALSE);
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+
+
+static void
+cowmail_list_thread (GTask        *task,
+                     gpointer      source,
+                     gpointer      task_data,
+                     GCancellable *cancellable)
+{
+  (void) source;
+  cowmail_task_data *data = task_data;
+  GError *error = NULL;
+  cowmail_client *client = cowmail_client_lookup (data->hostname);
+
+  /* page through the heads, so that a cancel takes effect between pages too */
+  GList *tickets = NULL;
+  guint64 left = data->limit ? data->limit : G_MAXUINT64;
+  guint64 cursor = data->cursor;
+  guint64 next = cursor;
+  gsize n;
+  do {
+    guint32 page = MIN (left, COWMAIL_LIST_PAGE);
+    cursor = next;
+    n = cowmail_client_list (client, data->ids, cursor, page, &next, cowmail_list_collect, &tickets,
+                             cancellable, &error);
+    left -= n;
+  } while (n == COWMAIL_LIST_PAGE && left > 0 && !error && !g_cancellable_is_cancelled (cancellable));
+
+  /* the heads up to next were scanned, so a busy server only ends the list early */
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_BUSY) && next > data->cursor)
+    g_clear_error (&error);
+  if (!cowmail_task_end (task, error)) {
+    g_list_free_full (tickets, g_free);
+    return;
+  }
+  data->next = next;
+  g_task_return_pointer (task, g_list_reverse (tickets), NULL);
+}
+
+
+
+void
+cowmail_list_async (const gchar         *hostname,
+                    GList               *ids,
+                    guint64              cursor,
+                    guint32              limit,
+                    GCancellable        *cancellable,
+                    GAsyncReadyCallback  callback,
+                    gpointer             userdata)
+{
+  cowmail_task_data *data;
+  g_autoptr (GTask) task = cowmail_task_new (hostname, cancellable, callback, userdata, cowmail_list_async, &data);
+  data->ids = g_list_copy (ids);
+  data->cursor = data->next = cursor;
+  data->limit = limit;
+  g_task_run_in_thread (task, cowmail_list_thread);
+}
+
+
+
+GList *
+cowmail_list_finish (GAsyncResult  *result,
+                     guint64       *next,
+                     GError       **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+  cowmail_task_data *data = g_task_get_task_data (G_TASK (result));
+  if (next)
+    *next = data->next;
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+
+
+static void
+cowmail_get_collect (cowmail_ticket *ticket,
+                     gchar          *msg,
+                     gpointer        userdata)
+{
+  (void) ticket;
+  g_ptr_array_add (userdata, msg);
+}
+
+
+
+static void
+cowmail_get_thread (GTask        *task,
+                    gpointer      source,
+                    gpointer      task_data,
+                    GCancellable *cancellable)
+{
+  (void) source;
+  cowmail_task_data *data = task_data;
+  GError *error = NULL;
+
+  GPtrArray *msgs = g_ptr_array_new_with_free_func (g_free);
+  cowmail_client_get_many (cowmail_client_lookup (data->hostname), data->tickets, cowmail_get_collect, msgs,
+                           cancellable, &error);
+  /* the messages that arrived before the server got busy are kept, the rest stays NULL */
+  if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_BUSY) && msgs->len > 0)
+    g_clear_error (&error);
+  if (!cowmail_task_end (task, error)) {
+    g_ptr_array_unref (msgs);
+    return;
+  }
+  g_task_return_pointer (task, msgs, (GDestroyNotify) g_ptr_array_unref);
+}
+
+
+
+void
+cowmail_get_async (const gchar         *hostname,
+                   GList               *tickets,
+                   GCancellable        *cancellable,
+                   GAsyncReadyCallback  callback,
+                   gpointer             userdata)
+{
+  cowmail_task_data *data;
+  g_autoptr (GTask) task = cowmail_task_new (hostname, cancellable, callback, userdata, cowmail_get_async, &data);
+  data->tickets = g_list_copy (tickets);
+  g_task_run_in_thread (task, cowmail_get_thread);
+}
+
+
+
+GPtrArray *
+cowmail_get_finish (GAsyncResult  *result,
+                    GError       **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, NULL), NULL);
+  return g_task_propagate_pointer (G_TASK (result), error);
 }
 
 
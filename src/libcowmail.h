@@ -24,27 +24,210 @@
 #define COWMAIL_KEY_SIZE  32
 #define COWMAIL_HEAD_SIZE 80
 
+/* servers are given as URIs that select the transport, see cowmail-transport.h */
 #define COWMAIL_DEFAULT_PORT 1337
 
+/*
+ * A body is a sequence of chunks, each of at most COWMAIL_CHUNK_SIZE bytes of
+ * plaintext encrypted with AES-256-GCM and followed by its own tag, so that
+ * every full chunk is 64 KiB on the wire. The chunk index and a final-chunk
+ * flag are mixed into the nonce, so chunks cannot be reordered, dropped or
+ * appended. A body of one chunk is the same as before chunking.
+ */
+#define COWMAIL_CHUNK_SIZE 65520
+
+/*
+ * One-shot requests. Anything that is not a command below and not a 32 byte
+ * hash (GET) is a message (PUT). The server classifies a request by its first
+ * read, which over TCP and Unix sockets holds the whole first write of a short
+ * request as well as it does over SCTP.
+ *
+ * LIST:       0x00
+ *             replies with all heads
+ * LIST_SINCE: 0x01 | cursor (8 bytes) | limit (4 bytes), big endian
+ *             replies with the cursor after the last head sent (8 bytes),
+ *             followed by at most limit heads (0: no limit) starting with
+ *             sequence number cursor. A cursor past the last head, as after
+ *             the store was reset, is answered with the number of heads.
+ *
+ * A server from before LIST_SINCE would store the request as a message, so a
+ * client only sends it to servers that answered a session HELLO, since all
+ * servers with sessions know LIST_SINCE, and sends LIST to the others.
+ */
+#define COWMAIL_CMD_LIST        0x00
+#define COWMAIL_CMD_LIST_SINCE  0x01
+#define COWMAIL_LIST_SINCE_SIZE 13
+
+/*
+ * A one-shot SESSION request (0x02) switches the connection to framed mode,
+ * so that any number of requests can be sent over one association.
+ *
+ * request:  type (1 byte) | payload length (4 bytes, big endian) | payload
+ * response: status (1 byte) | payload length (4 bytes, big endian) | payload
+ *
+ * Responses are sent in request order.
+ *
+ * HELLO: version (2) | features (4) -> version (2) | features (4)
+ *                                     [| difficulty (1), with STAMP]
+ * PUT:  [stamp (8), with STAMP |] message -> empty, or status STAMP
+ * LIST: cursor (8) | limit (4)     -> cursor (8) | heads, as for LIST_SINCE
+ * GET:  hash (32)                  -> message, or status NOT_FOUND
+ * GET_MANY: hashes (32 each)       -> one GET response per hash
+ *
+ * A LIST response holds at most as many heads as fit in the 32-bit length,
+ * even without a limit, and the client asks again from the cursor it got.
+ *
+ * A client starts a session with HELLO, sent as its own SCTP message after
+ * the SESSION byte. The server replies with the lower of both versions and
+ * the features both sides support, and from then on uses the error statuses
+ * of that version. A server from before version 2 answers HELLO with
+ * BAD_REQUEST, which the client takes as version 1 without features.
+ *
+ * A server only takes a connection for a session once it has the SESSION
+ * byte and a whole HELLO header, and stores anything else starting with 0x02
+ * as a one-shot PUT. A server without sessions, or one of version 1 that got
+ * the SESSION byte and HELLO in one read, waits for the end of that PUT
+ * instead of replying. A client that gets no reply within
+ * COWMAIL_HELLO_TIMEOUT seconds resets the connection, so that nothing is
+ * stored, and fails like for a closed connection, unless the server answers a
+ * one-shot LIST in time. Then it sends one-shot requests to that server for
+ * COWMAIL_LEGACY_TTL seconds, and reports one-shot PUTs with
+ * COWMAIL_STATUS_SENT, because they get no reply.
+ *
+ * STAMP: a server that asks for proof of work offers STAMP and appends the
+ *        difficulty in bits to its HELLO reply. Every PUT then starts with a
+ *        stamp for the head of the message, see cowmail-stamp.h, and a PUT
+ *        whose stamp is missing or too weak is refused with status STAMP
+ *        before anything is stored. Such a server drops one-shot PUTs.
+ *
+ * A server under load may refuse any request with status BUSY. It closes
+ * connections over its cap right after accepting them, and one-shot requests
+ * that it refuses without a reply.
+ */
+#define COWMAIL_CMD_SESSION        0x02
+
+#define COWMAIL_PROTOCOL_VERSION   2
+/* optional extensions announced in HELLO */
+#define COWMAIL_FEATURE_STAMP      (1 << 0)
+#define COWMAIL_FEATURES           COWMAIL_FEATURE_STAMP
+
+#define COWMAIL_FRAME_HEADER_SIZE  5
+#define COWMAIL_FRAME_PUT          0x10
+#define COWMAIL_FRAME_LIST         0x11
+#define COWMAIL_FRAME_GET          0x12
+#define COWMAIL_FRAME_GET_MANY     0x13
+#define COWMAIL_FRAME_HELLO        0x14
+#define COWMAIL_HELLO_SIZE         6
+/* maximum payload of a request or response frame, other than a LIST response */
+#define COWMAIL_FRAME_MAX          (64 * 1024 * 1024)
+/* seconds a client waits for the reply to HELLO */
+#define COWMAIL_HELLO_TIMEOUT      5
+/* seconds a client sends one-shot requests to a server without sessions */
+#define COWMAIL_LEGACY_TTL         600
+
+/* maximum number of unacknowledged PUT requests per session */
+#define COWMAIL_PUT_WINDOW         32
+
+/* maximum number of hashes per GET_MANY request */
+#define COWMAIL_GET_MANY_MAX       4096
+
+#define COWMAIL_STATUS_OK           0x00
+#define COWMAIL_STATUS_NOT_FOUND    0x01
+#define COWMAIL_STATUS_BAD_REQUEST  0x02
+/* since version 2, version 1 sessions get BAD_REQUEST instead */
+#define COWMAIL_STATUS_TOO_LARGE    0x03
+#define COWMAIL_STATUS_UNSUPPORTED  0x04
+#define COWMAIL_STATUS_SERVER_ERROR 0x05
+/* only in sessions with STAMP */
+#define COWMAIL_STATUS_STAMP        0x06
+/* the server refuses the request for now, try again later */
+#define COWMAIL_STATUS_BUSY         0x07
+/* never sent by a server: the message went out as a one-shot PUT, which has no reply */
+#define COWMAIL_STATUS_SENT         0xff
+
+/* number of heads requested per LIST_SINCE page */
+#define COWMAIL_LIST_PAGE       65536
+
+/*
+ * Message features a recipient can read, kept with the contact as the hex
+ * suffix of its key, "KEY:FEATURES". A sender only uses the features that the
+ * contact lists, so recipients with older clients get plain messages.
+ *
+ * DEFLATE: the text is compressed with raw deflate and prefixed with
+ *          COWMAIL_MSG_DEFLATE_MARKER before it is encrypted. A plain text
+ *          message never starts with a NUL byte, unless it is empty.
+ */
+#define COWMAIL_MSG_DEFLATE        (1 << 0)
+#define COWMAIL_MSG_FEATURES       COWMAIL_MSG_DEFLATE
+#define COWMAIL_MSG_DEFLATE_MARKER "\0Z"
+/* texts shorter than this are not worth compressing */
+#define COWMAIL_COMPRESS_MIN       256
+/* maximum size of a decompressed text */
+#define COWMAIL_DECOMPRESS_MAX     (64 * 1024 * 1024)
+
+/* minimum number of heads per worker thread when scanning in parallel */
+#define COWMAIL_SCAN_SLICE_MIN 64
+/* number of heads buffered and scanned at once while streaming a LIST */
+#define COWMAIL_SCAN_BATCH     4096
+
+
+
+typedef struct _cowmail_seen cowmail_seen;
+
 
 
 typedef struct
 {
-  gchar  *name;
-  guchar  key[COWMAIL_KEY_SIZE];
+  gchar        *name;
+  guchar        key[COWMAIL_KEY_SIZE];
+  guint32       features; /* COWMAIL_MSG_FEATURES the owner of a contact can read */
+  cowmail_seen *seen;   /* heads scanned before, see cowmail_seen_load(), or NULL */
 } cowmail_id;
 
 
 
 typedef struct
 {
-  guchar  hash[COWMAIL_KEY_SIZE];
-  guchar  secret[COWMAIL_KEY_SIZE];
-  guchar  nonce[COWMAIL_TAG_SIZE];
+  guchar            hash[COWMAIL_KEY_SIZE];
+  guchar            secret[COWMAIL_KEY_SIZE];
+  guchar            nonce[COWMAIL_TAG_SIZE];
+  const cowmail_id *id;
+  guint64           seq;  /* sequence number of the head on the server that listed it */
 } cowmail_ticket;
 
 
 
+/**
+ * cowmail_msg_func:
+ * @ticket: the header of the message
+ * @msg: the decrypted message, owned by the callee, or NULL on failure
+ * @userdata: user data
+ *
+ * Called for every message requested with cowmail_get_many().
+ */
+typedef void     (*cowmail_msg_func)       (cowmail_ticket        *ticket,
+                                            gchar                 *msg,
+                                            gpointer               userdata);
+
+
+
+typedef struct _cowmail_session cowmail_session;
+
+
+
+/**
+ * cowmail_ticket_func:
+ * @ticket: a successfully decrypted header, owned by the callee
+ * @userdata: user data
+ *
+ * Called for every message header that belongs to one of the identities.
+ * Free the ticket with g_free() when it is no longer needed.
+ */
+typedef void     (*cowmail_ticket_func)    (cowmail_ticket        *ticket,
+                                            gpointer               userdata);
+
+
+
 /**
  * cowmail_id_new:
  * @name: name for the cowmail identity
@@ -81,12 +264,45 @@ cowmail_id        *cowmail_id_from_key     (const gchar           *name,
  * @id: the cowmail identity
  *
  * Creates a Cowmail contact (i.e. name and public key) based on a Cowmail
- * identity (i.e. name and secret key).
+ * identity (i.e. name and secret key). The contact has the message features
+ * of this client.
  *
  * Returns: the contact
  */
 cowmail_id        *cowmail_id_to_contact   (const cowmail_id      *id);
 
+/**
+ * cowmail_id_key_to_string:
+ * @id: the cowmail identity
+ *
+ * Returns: the key of @id in base64, followed by ":" and its features in hex
+ * unless they are 0
+ */
+gchar             *cowmail_id_key_to_string (const cowmail_id     *id);
+
+/**
+ * cowmail_id_key_from_string:
+ * @text: a key as from cowmail_id_key_to_string()
+ * @key: return location for COWMAIL_KEY_SIZE bytes of key
+ * @features: return location for the features
+ *
+ * Returns: TRUE if @text is a valid key
+ */
+gboolean           cowmail_id_key_from_string (const gchar        *text,
+                                               guchar             *key,
+                                               guint32            *features);
+
+/**
+ * cowmail_id_fingerprint:
+ * @id: the cowmail identity
+ *
+ * Computes the hexadecimal public key of an identity, which can be used to
+ * name per-identity state without revealing the secret key.
+ *
+ * Returns: the fingerprint, free with g_free()
+ */
+gchar             *cowmail_id_fingerprint  (const cowmail_id      *id);
+
 /**
  * cowmail_id_free:
  * @id: the cowmail identity to be freed
@@ -120,6 +336,110 @@ GList             *cowmail_ids_load        (GFile                 *file);
 
 
 
+/**
+ * cowmail_cursors_load:
+ * @file: the file to load the LIST cursors from
+ *
+ * Loads the LIST cursors for all servers and identities. A missing file gives
+ * an empty table.
+ *
+ * Returns: table for cowmail_cursor_get() and cowmail_cursor_set()
+ */
+GHashTable        *cowmail_cursors_load    (GFile                 *file);
+
+/**
+ * cowmail_cursors_store:
+ * @file: file to store the LIST cursors to
+ * @cursors: table from cowmail_cursors_load()
+ *
+ * Stores the LIST cursors to a file, one line per server and identity.
+ */
+void               cowmail_cursors_store   (GFile                 *file,
+                                            GHashTable            *cursors);
+
+/**
+ * cowmail_cursor_get:
+ * @cursors: table from cowmail_cursors_load()
+ * @server: the server
+ * @id: the cowmail identity
+ *
+ * Returns: the LIST cursor of the identity on the server, 0 if unknown
+ */
+guint64            cowmail_cursor_get      (GHashTable            *cursors,
+                                            const gchar           *server,
+                                            const cowmail_id      *id);
+
+/**
+ * cowmail_cursor_set:
+ * @cursors: table from cowmail_cursors_load()
+ * @server: the server
+ * @id: the cowmail identity
+ * @cursor: the new LIST cursor
+ *
+ * Sets the LIST cursor of the identity on the server.
+ */
+void               cowmail_cursor_set      (GHashTable            *cursors,
+                                            const gchar           *server,
+                                            const cowmail_id      *id,
+                                            guint64                cursor);
+
+
+
+/**
+ * cowmail_msg_encrypt:
+ * @msg: the message
+ * @contact: the recipient's cowmail identity
+ *
+ * Encrypts a message for a recipient. The result is exactly what is sent to
+ * the server with PUT, so it can be stored and sent later.
+ *
+ * Returns: head and body of the encrypted message
+ */
+GBytes            *cowmail_msg_encrypt     (const gchar           *msg,
+                                            const cowmail_id      *id);
+
+/**
+ * cowmail_encrypt_stream:
+ * @id: the recipient's cowmail identity
+ * @clear: the message, read until end of stream
+ * @body: stream to write the encrypted body to
+ * @head: buffer of COWMAIL_HEAD_SIZE bytes for the head
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for an error
+ *
+ * Encrypts a message of any size and content chunk by chunk, with memory use
+ * independent of its size. The head contains the hash of the body, so it is
+ * only known at the end; a message is sent as @head followed by the body.
+ *
+ * Returns: TRUE on success
+ */
+gboolean           cowmail_encrypt_stream  (const cowmail_id      *id,
+                                            GInputStream          *clear,
+                                            GOutputStream         *body,
+                                            guchar                *head,
+                                            GCancellable          *cancellable,
+                                            GError               **error);
+
+/**
+ * cowmail_decrypt_stream:
+ * @ticket: the header for the message
+ * @body: the encrypted body, read until end of stream
+ * @clear: stream to write the message to
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for an error
+ *
+ * Decrypts a body chunk by chunk. Each chunk is written to @clear once it is
+ * authenticated; a truncated body or one that does not match the hash in the
+ * ticket is an error after the chunks before it were written.
+ *
+ * Returns: TRUE on success
+ */
+gboolean           cowmail_decrypt_stream  (const cowmail_ticket  *ticket,
+                                            GInputStream          *body,
+                                            GOutputStream         *clear,
+                                            GCancellable          *cancellable,
+                                            GError               **error);
+
 /**
  * cowmail_put:
  * @server: server to connect to, may include a port (default: 1337)
@@ -132,19 +452,99 @@ void               cowmail_put             (const gchar           *hostname,
                                             const gchar           *msg,
                                             const cowmail_id      *id);
 
+/**
+ * cowmail_put_stream:
+ * @server: server to connect to, may include a port (default: 1337)
+ * @clear: the message, read until end of stream
+ * @contact: the recipient's cowmail identity
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for an error
+ *
+ * Like cowmail_put(), but for messages of any size and content. The encrypted
+ * body is staged in a temporary file, because the head must be sent first.
+ *
+ * Returns: TRUE on success
+ */
+gboolean           cowmail_put_stream      (const gchar           *hostname,
+                                            GInputStream          *clear,
+                                            const cowmail_id      *id,
+                                            GCancellable          *cancellable,
+                                            GError               **error);
+
 /**
  * cowmail_list:
  * @server: server to connect to, may include a port (default: 1337)
- * @ids: identities to get messages for
+ * @id: identity to get messages for
  *
  * Gets all message headers from the server and attempts to decrypt them with
- * the identities. All successfully decrypted headers are put to a list.
+ * the identity. All successfully decrypted headers are put to a list. The
+ * trial decryption is spread over all processors.
  *
  * Returns: the list of headers for the messages
  */
 GList             *cowmail_list            (const gchar           *hostname,
                                             const cowmail_id      *id);
 
+/**
+ * cowmail_list_ids:
+ * @server: server to connect to, may include a port (default: 1337)
+ * @ids: identities to get messages for
+ *
+ * Like cowmail_list(), but downloads the message headers only once and tries
+ * every identity on each of them. Each header in the result points to the
+ * identity it was decrypted with; the identities must outlive the list.
+ *
+ * Returns: the list of headers for the messages
+ */
+GList             *cowmail_list_ids        (const gchar           *hostname,
+                                            GList                 *ids);
+
+/**
+ * cowmail_list_foreach:
+ * @server: server to connect to, may include a port (default: 1337)
+ * @ids: identities to get messages for
+ * @func: called for every header that belongs to one of the identities
+ * @userdata: user data for @func
+ *
+ * Streams the message headers from the server and scans them in batches of
+ * COWMAIL_SCAN_BATCH. Matches are reported as soon as their batch is scanned,
+ * so memory use does not depend on the number of messages on the server.
+ *
+ * Returns: the number of headers scanned
+ */
+gsize              cowmail_list_foreach    (const gchar           *hostname,
+                                            GList                 *ids,
+                                            cowmail_ticket_func    func,
+                                            gpointer               userdata);
+
+/**
+ * cowmail_list_since:
+ * @server: server to connect to, may include a port (default: 1337)
+ * @ids: identities to get messages for
+ * @cursor: sequence number of the first header to get
+ * @limit: maximum number of headers to get, 0 for no limit
+ * @next: return location for the cursor to continue with
+ * @func: called for every header that belongs to one of the identities
+ * @userdata: user data for @func
+ *
+ * Like cowmail_list_foreach(), but only gets the headers the server stored
+ * since @cursor. If the result equals @limit, there may be more headers.
+ *
+ * If the server has fewer headers than @cursor, because its store was reset,
+ * @next is 0 so that the next call starts over. A server that was not seen
+ * with sessions for COWMAIL_LEGACY_TTL seconds is asked with a session, or
+ * with LIST, skipping @cursor headers, if it has no sessions.
+ *
+ * Returns: the number of headers scanned
+ */
+gsize              cowmail_list_since      (const gchar           *hostname,
+                                            GList                 *ids,
+                                            guint64                cursor,
+                                            guint32                limit,
+                                            guint64               *next,
+                                            cowmail_ticket_func    func,
+                                            gpointer               userdata);
+
 /**
  * cowmail_get:
  * @server: server to connect to, may include a port (default: 1337)
@@ -157,6 +557,276 @@ GList             *cowmail_list            (const gchar           *hostname,
 gchar             *cowmail_get             (const gchar           *hostname,
                                             cowmail_ticket        *ticket);
 
+/**
+ * cowmail_get_stream:
+ * @server: server to connect to, may include a port (default: 1337)
+ * @ticket: the header for the message
+ * @clear: stream to write the message to
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for an error
+ *
+ * Like cowmail_get(), but for messages of any size and content, decrypted
+ * with cowmail_decrypt_stream() as the body arrives.
+ *
+ * Returns: TRUE on success
+ */
+gboolean           cowmail_get_stream      (const gchar           *hostname,
+                                            const cowmail_ticket  *ticket,
+                                            GOutputStream         *clear,
+                                            GCancellable          *cancellable,
+                                            GError               **error);
+
+/**
+ * cowmail_get_many:
+ * @server: server to connect to, may include a port (default: 1337)
+ * @tickets: the headers for the messages
+ * @func: called for every message, in the order of @tickets
+ * @userdata: user data for @func
+ *
+ * Gets many messages in one round trip and decrypts each as it arrives.
+ *
+ * Returns: the number of messages received
+ */
+gsize              cowmail_get_many        (const gchar           *hostname,
+                                            GList                 *tickets,
+                                            cowmail_msg_func       func,
+                                            gpointer               userdata);
+
+
+
+/**
+ * cowmail_status_message:
+ * @status: a COWMAIL_STATUS_* value
+ *
+ * Returns: a description of the status
+ */
+const gchar       *cowmail_status_message  (guchar                 status);
+
+/**
+ * cowmail_session_open:
+ * @server: server to connect to, may include a port (default: 1337)
+ *
+ * Opens one association to the server, over which any number of PUT, LIST and
+ * GET requests can be sent with the cowmail_session_*() functions.
+ *
+ * Returns: the session, or NULL if the server cannot be reached
+ */
+cowmail_session   *cowmail_session_open    (const gchar           *hostname);
+
+/**
+ * cowmail_session_get_version:
+ * @session: the session
+ *
+ * Returns: the protocol version agreed on with the server, 1 for a server
+ * without the HELLO handshake, 0 for a server without sessions, to which the
+ * session sends one-shot requests
+ */
+guint16            cowmail_session_get_version (cowmail_session   *session);
+
+/**
+ * cowmail_session_get_features:
+ * @session: the session
+ *
+ * Returns: the COWMAIL_FEATURES bits that both sides support
+ */
+guint32            cowmail_session_get_features (cowmail_session  *session);
+
+/**
+ * cowmail_session_close:
+ * @session: the session
+ *
+ * Closes the association and frees the session.
+ */
+void               cowmail_session_close   (cowmail_session       *session);
+
+/**
+ * cowmail_session_put:
+ * @session: the session
+ * @msg: the message to be put
+ * @contact: the recipient's cowmail identity
+ *
+ * Like cowmail_put(), but waits for the server to acknowledge the message.
+ *
+ * Returns: TRUE if the server stored the message, or, for a server without
+ * sessions, which does not acknowledge anything, if it was sent
+ */
+gboolean           cowmail_session_put     (cowmail_session       *session,
+                                            const gchar           *msg,
+                                            const cowmail_id      *id);
+
+/**
+ * cowmail_session_put_many:
+ * @session: the session
+ * @msgs: messages from cowmail_msg_encrypt()
+ * @n: number of messages
+ * @status: return location for @n statuses
+ *
+ * Puts many messages, keeping up to COWMAIL_PUT_WINDOW of them in flight, and
+ * collects the status the server replied for each: COWMAIL_STATUS_OK when it
+ * stored the message. Messages that got no reply have COWMAIL_STATUS_SERVER_ERROR,
+ * and those that were not sent because the server asks for a stamp of more than
+ * COWMAIL_STAMP_MAX_BITS have COWMAIL_STATUS_UNSUPPORTED. Messages sent to a
+ * server without sessions have COWMAIL_STATUS_SENT and are not acknowledged.
+ *
+ * Returns: the number of acknowledged messages
+ */
+gsize              cowmail_session_put_many (cowmail_session      *session,
+                                             GBytes              **msgs,
+                                             gsize                 n,
+                                             guchar               *status);
+
+/**
+ * cowmail_session_list:
+ * @session: the session
+ * @ids: identities to get messages for
+ * @cursor: sequence number of the first header to get
+ * @limit: maximum number of headers to get, 0 for no limit
+ * @next: return location for the cursor to continue with
+ * @func: called for every header that belongs to one of the identities
+ * @userdata: user data for @func
+ *
+ * Like cowmail_list_since(), but over the session. @func must not use the
+ * session, because the headers are still being received. Without a limit,
+ * the server may still send fewer headers than it has; continue from @next
+ * until no headers are left. A request that the server refuses, for example
+ * with status BUSY, scans no headers and leaves @next at @cursor.
+ *
+ * Returns: the number of headers scanned
+ */
+gsize              cowmail_session_list    (cowmail_session       *session,
+                                            GList                 *ids,
+                                            guint64                cursor,
+                                            guint32                limit,
+                                            guint64               *next,
+                                            cowmail_ticket_func    func,
+                                            gpointer               userdata);
+
+/**
+ * cowmail_session_get:
+ * @session: the session
+ * @ticket: the header for the message
+ *
+ * Like cowmail_get(), but over the session and without a size limit.
+ *
+ * Returns: the decrypted message
+ */
+gchar             *cowmail_session_get     (cowmail_session       *session,
+                                            cowmail_ticket        *ticket);
+
+/**
+ * cowmail_session_get_many:
+ * @session: the session
+ * @tickets: the headers for the messages
+ * @func: called for every message, in the order of @tickets
+ * @userdata: user data for @func
+ *
+ * Like cowmail_get_many(), but over the session. A request that the server
+ * refuses ends the call, and @func is not called for the remaining tickets.
+ *
+ * Returns: the number of messages received
+ */
+gsize              cowmail_session_get_many (cowmail_session      *session,
+                                             GList                *tickets,
+                                             cowmail_msg_func      func,
+                                             gpointer              userdata);
+
+
+
+/**
+ * cowmail_put_async:
+ * @server: server to connect to, may include a port (default: 1337)
+ * @msg: the message to be put
+ * @id: the recipient's cowmail identity
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: called in the thread-default main context when done
+ * @userdata: user data for @callback
+ *
+ * Like cowmail_put(), but runs on a worker thread. The message is encrypted
+ * before this returns.
+ */
+void               cowmail_put_async       (const gchar           *hostname,
+                                            const gchar           *msg,
+                                            const cowmail_id      *id,
+                                            GCancellable          *cancellable,
+                                            GAsyncReadyCallback    callback,
+                                            gpointer               userdata);
+
+/**
+ * cowmail_put_finish:
+ * @result: the #GAsyncResult passed to the callback
+ * @error: return location for an error
+ *
+ * Returns: TRUE if the server stored the message
+ */
+gboolean           cowmail_put_finish      (GAsyncResult          *result,
+                                            GError               **error);
+
+/**
+ * cowmail_list_async:
+ * @server: server to connect to, may include a port (default: 1337)
+ * @ids: identities to get messages for, must outlive the operation
+ * @cursor: sequence number of the first header to get
+ * @limit: maximum number of headers to get, 0 for no limit
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: called in the thread-default main context when done
+ * @userdata: user data for @callback
+ *
+ * Like cowmail_list_since(), but runs on a worker thread and fetches the
+ * headers in pages of COWMAIL_LIST_PAGE until @limit or the end is reached.
+ * Cancelling stops the scan at the next read. A server that is busy after
+ * the first headers ends the list early, with the cursor where it stopped;
+ * otherwise the operation fails with G_IO_ERROR_BUSY.
+ */
+void               cowmail_list_async      (const gchar           *hostname,
+                                            GList                 *ids,
+                                            guint64                cursor,
+                                            guint32                limit,
+                                            GCancellable          *cancellable,
+                                            GAsyncReadyCallback    callback,
+                                            gpointer               userdata);
+
+/**
+ * cowmail_list_finish:
+ * @result: the #GAsyncResult passed to the callback
+ * @next: (nullable): return location for the cursor to continue with
+ * @error: return location for an error
+ *
+ * Returns: the headers that belong to one of the identities, in server order,
+ * or NULL on error; free with g_list_free_full() and g_free()
+ */
+GList             *cowmail_list_finish     (GAsyncResult          *result,
+                                            guint64               *next,
+                                            GError               **error);
+
+/**
+ * cowmail_get_async:
+ * @server: server to connect to, may include a port (default: 1337)
+ * @tickets: the headers for the messages, must outlive the operation
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: called in the thread-default main context when done
+ * @userdata: user data for @callback
+ *
+ * Like cowmail_get_many(), but runs on a worker thread. A server that is busy
+ * after the first messages leaves the rest NULL; otherwise the operation
+ * fails with G_IO_ERROR_BUSY.
+ */
+void               cowmail_get_async       (const gchar           *hostname,
+                                            GList                 *tickets,
+                                            GCancellable          *cancellable,
+                                            GAsyncReadyCallback    callback,
+                                            gpointer               userdata);
+
+/**
+ * cowmail_get_finish:
+ * @result: the #GAsyncResult passed to the callback
+ * @error: return location for an error
+ *
+ * Returns: the decrypted messages in the order of the tickets, NULL where a
+ * message could not be fetched or decrypted, or NULL on error
+ */
+GPtrArray         *cowmail_get_finish      (GAsyncResult          *result,
+                                            GError               **error);
+
 
 
 /**